@@ -1,7 +1,7 @@
 #include "AABBox.h"
 
 
-bool AABBox::intersect(Ray& ray, float& tmin_) {
+bool AABBox::intersect(const Ray& ray, float& tmin_) const {
     // Slab Method
     // This is a branchless method and is known to be the fastest
     float tx1 = (cornerDown.x - ray.origin.x) * ray.inv_dir.x;
@@ -1,13 +1,13 @@
 #pragma once
 
 #include <iostream>
+#include <limits>
 
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 #define GLM_ENABLE_EXPERIMENTAL
 
 #include <glm/gtx/string_cast.hpp>
-#include <vector>
 
 #include "../Ray.h"
 
@@ -15,15 +15,20 @@
 class AABBox {
 
 public:
-	AABBox() {};
+	// An empty box, ready to be extended
+	AABBox() : cornerUp(-std::numeric_limits<float>::max()), cornerDown(std::numeric_limits<float>::max()) {};
 	AABBox(glm::vec3 cornerUp_, glm::vec3 cornerDown_) : cornerUp(cornerUp_), cornerDown(cornerDown_) {};
 
-    inline void add(size_t mesh_index, size_t triangle_index) { triangles.push_back(std::make_pair(mesh_index, triangle_index)); };
-    inline void add(std::pair<size_t, size_t> triangle) { triangles.push_back(triangle); };
+    inline void extend(const glm::vec3& p) { cornerUp = glm::max(cornerUp, p); cornerDown = glm::min(cornerDown, p); };
+    inline void extend(const AABBox& b) { cornerUp = glm::max(cornerUp, b.cornerUp); cornerDown = glm::min(cornerDown, b.cornerDown); };
+    inline glm::vec3 center() const { return 0.5f * (cornerUp + cornerDown); };
+    inline float surfaceArea() const {
+        glm::vec3 d = glm::max(cornerUp - cornerDown, glm::vec3(0.0f));
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    };
 
-    bool intersect(Ray& ray, float& tmin_);
+    bool intersect(const Ray& ray, float& tmin_) const;
 
 	glm::vec3 cornerUp;
     glm::vec3 cornerDown;
-    std::vector<std::pair<size_t, size_t>> triangles;
 };
@@ -1,40 +1,41 @@
 #include "BVH.h"
+#include "Parallel.h"
 
 
-float findMedian(std::vector<float> a, size_t n)
+float findMedian(std::vector<float>& a, size_t n)
 {
-  
+
     // If size of the arr[] is even
     if (n % 2 == 0) {
-  
+
         // Applying nth_element
         // on n/2th index
         std::nth_element(a.begin(),
                     a.begin() + n / 2,
                     a.end());
-  
+
         // Applying nth_element
         // on (n-1)/2 th index
         std::nth_element(a.begin(),
                     a.begin() + (n - 1) / 2,
                     a.end());
-  
+
         // Find the average of value at
         // index N/2 and (N-1)/2
         return (float)(a[(n - 1) / 2]
                         + a[n / 2])
                / 2.0f;
     }
-  
+
     // If size of the arr[] is odd
     else {
-  
+
         // Applying nth_element
         // on n/2
         nth_element(a.begin(),
                     a.begin() + n / 2,
                     a.end());
-  
+
         // Value at index (N/2)th
         // is the median
         return (float)a[n / 2];
@@ -42,281 +43,552 @@ float findMedian(std::vector<float> a, size_t n)
 }
 
 
-void BVH::init(const std::shared_ptr<Scene> scenePtr, bool debug) 
+void BVH::init(const std::shared_ptr<Scene> scenePtr, bool debug)
+{
+    // Gather every triangle of the scene once. This array is partitioned in place
+    // by the builder, so the whole construction only needs O(n) memory.
+    std::vector<BVHBuildPrimitive> buildPrimitives;
+    const size_t numOfObjects = scenePtr->numOfObjects ();
+    for (size_t i = 0; i < numOfObjects; i++)
+        gather(*scenePtr->mesh(scenePtr->objectMesh(i)), scenePtr->objectTransformMatrix(i), (uint32_t)i, buildPrimitives);
+    build(buildPrimitives, debug);
+}
+
+
+void BVH::init(const Mesh& mesh, bool debug)
 {
-    // This constructor should only be called for the root
+    std::vector<BVHBuildPrimitive> buildPrimitives;
+    gather(mesh, glm::mat4(1.0f), 0, buildPrimitives);
+    build(buildPrimitives, debug);
+}
 
-    std::vector<std::pair<size_t, size_t>> triangles;
-    size_t numOfMeshes = scenePtr->numOfMeshes ();
-	for (size_t i = 0; i < numOfMeshes; i++) {
-        const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(i);
-        const size_t nbTriangles  = mesh->triangleIndices().size();
 
-        for(size_t k=0; k<nbTriangles; k++) {
-            triangles.push_back(std::make_pair(i, k));
-        } 
+void BVH::gather(const Mesh& mesh, const glm::mat4& transform, uint32_t object_index, std::vector<BVHBuildPrimitive>& buildPrimitives) const
+{
+    const std::vector<glm::vec3>& vertexPositions  = mesh.vertexPositions();
+    const std::vector<glm::uvec3>& triangleIndices = mesh.triangleIndices();
+    const size_t nbTriangles  = triangleIndices.size();
+    const size_t first = buildPrimitives.size();
+    buildPrimitives.resize(first + nbTriangles);
+
+    #pragma omp parallel for if(nbTriangles >= parallelReductionThreshold)
+    for(int k=0; k<(int)nbTriangles; k++) {
+        BVHBuildPrimitive& primitive = buildPrimitives[first + k];
+        primitive.ref = { object_index, (uint32_t)k };
+        primitive.triangle = Triangle(glm::vec3(transform * glm::vec4(vertexPositions[triangleIndices[k][0]], 1.0f)),
+                                      glm::vec3(transform * glm::vec4(vertexPositions[triangleIndices[k][1]], 1.0f)),
+                                      glm::vec3(transform * glm::vec4(vertexPositions[triangleIndices[k][2]], 1.0f)));
+        primitive.box = AABBox();
+        primitive.box.extend(primitive.triangle.p0);
+        primitive.box.extend(primitive.triangle.p1);
+        primitive.box.extend(primitive.triangle.p2);
     }
+}
 
-    init(scenePtr, triangles, debug, 0);
+
+void BVH::build(std::vector<BVHBuildPrimitive>& buildPrimitives, bool debug)
+{
+    clear();
+    if (buildPrimitives.empty()) return;
+
+    // A binary tree with one triangle per leaf has exactly 2n-1 nodes
+    triangleCount = buildPrimitives.size();
+    nodes.reserve(2 * triangleCount - 1);
+
+    if (builder == BVHBuilder::LBVH) {
+        buildLBVH(buildPrimitives);
+    }
+    else if (builder == BVHBuilder::SBVH) {
+        buildSBVH(buildPrimitives); // Adds the references of the triangles split
+    }
+    else {
+        // The top of the tree is split across OpenMP tasks, see BVH::build
+        #pragma omp parallel if(!debug && triangleCount >= parallelBuildThreshold)
+        {
+            #pragma omp single
+            build(nodes, buildPrimitives, 0, triangleCount, debug, 0);
+        }
+    }
+    if (optimizeTreelets) restructureTreelets();
+    buildLeafBlocks(buildPrimitives);
+    nodes.shrink_to_fit();
+    buildWideNodes();
+
+    primitives.resize(buildPrimitives.size());
+    for (size_t i = 0; i < buildPrimitives.size(); i++)
+        primitives[i] = buildPrimitives[i].ref;
+    builtSAHCost = sahCost();
+    treeDepth = computeDepth();
 }
 
 
+void BVH::clear() {
+    nodes.clear();
+    primitives.clear();
+    blocks.clear();
+    wideNodes.clear();
+    quantizedNodes.clear();
+    builtSAHCost = 0.0f;
+    treeDepth = 0;
+    triangleCount = 0;
+    mapped.reset();
+}
 
 
-void BVH::init(const std::shared_ptr<Scene> scenePtr, std::vector<std::pair<size_t, size_t>>& triangles, bool debug, size_t depth) {
-    if (debug) {
-        for(size_t i =0; i < 2*depth; i++) std::cout << " ";
-        std::cout << "-> BVH node : ";
+float BVH::sahCost() const {
+    if (empty()) return 0.0f;
+    const float rootArea = bounds().surfaceArea();
+    if (rootArea <= 0.0f) return leafCost(numOfPrimitives());
+
+    float cost = 0.0f;
+    const BVHNode* nodeArray = nodeData();
+    for (size_t i = 0; i < numOfNodes(); i++) {
+        const BVHNode& node = nodeArray[i];
+        const float area = node.box.surfaceArea() / rootArea;
+        if (node.isLeaf()) cost += area * leafCost(node.count);
+        else               cost += area * traversalCost;
     }
+    return cost;
+}
 
-    // 0. Copy the triangle indices
-    for (size_t i = 0; i < triangles.size(); i++)
-        box.add(triangles[i].first, triangles[i].second);
 
+void BVH::flatten(const std::vector<BVHBuildNode>& buildNodes, int32_t root) {
+    // Depth-first emission, left child first, without recursion since the
+    // trees of some builders can be deep
+    nodes.clear();
+    nodes.reserve(buildNodes.size());
+    std::vector<std::pair<int32_t, int32_t>> stack; // Build node, parent waiting for its right child
+    stack.push_back(std::make_pair(root, -1));
+    while (!stack.empty()) {
+        const int32_t index = stack.back().first;
+        const int32_t parent = stack.back().second;
+        stack.pop_back();
+        if (parent >= 0) nodes[parent].offset = (uint32_t)nodes.size();
+
+        const BVHBuildNode& buildNode = buildNodes[index];
+        BVHNode node;
+        node.box = buildNode.box;
+        if (buildNode.isLeaf()) {
+            node.offset = buildNode.offset;
+            node.count = (uint16_t)buildNode.count;
+            nodes.push_back(node);
+        }
+        else {
+            glm::vec3 dims = buildNode.box.cornerUp - buildNode.box.cornerDown;
+            node.axis = (dims.x >= dims.y && dims.x >= dims.z) ? 0 : (dims.y >= dims.z ? 1 : 2);
+            nodes.push_back(node);
+            stack.push_back(std::make_pair(buildNode.right, (int32_t)nodes.size() - 1));
+            stack.push_back(std::make_pair(buildNode.left, -1));
+        }
+    }
+}
 
-    // 1. Determine the size of the box
-    float dimMin[3];
-    float dimMax[3];
-    for(int i=0; i<3; i++) {
-        dimMin[i] = std::numeric_limits<float>::max();
-        dimMax[i] = std::numeric_limits<float>::min();
+
+void BVH::buildLeafBlocks(const std::vector<BVHBuildPrimitive>& buildPrimitives) {
+    // Subtrees small enough to fit in a leaf are collapsed into one when it lowers their SAH
+    // cost, so that the builders going down to one triangle per leaf also fill the blocks.
+    // Children are stored after their parent, so a reverse sweep visits them first.
+    const size_t leafSize = std::min<size_t>(std::max<size_t>(maxLeafSize, 1), std::numeric_limits<uint16_t>::max());
+    std::vector<size_t> subtreeCounts(nodes.size());
+    std::vector<float> subtreeCosts(nodes.size());
+    for (size_t i = nodes.size(); i-- > 0;) {
+        const BVHNode& node = nodes[i];
+        if (node.isLeaf()) {
+            subtreeCounts[i] = node.count;
+            subtreeCosts[i] = node.box.surfaceArea() * leafCost(node.count);
+        }
+        else {
+            subtreeCounts[i] = subtreeCounts[i + 1] + subtreeCounts[node.offset];
+            subtreeCosts[i] = traversalCost * node.box.surfaceArea() + subtreeCosts[i + 1] + subtreeCosts[node.offset];
+        }
     }
 
-	for (size_t i = 0; i < triangles.size(); i++) {
-        std::pair<size_t, size_t>& pair = box.triangles[i];
-        const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(pair.first);
-        glm::uvec3& triangleIndex  = mesh->triangleIndices()[pair.second];
-        const std::vector<glm::vec3>& vertexPositions  = mesh->vertexPositions();
-        
-        for(size_t k=0; k<3; k++) {
-            for(int j=0; j<3; j++) {
-                if (vertexPositions[triangleIndex[k]][j] < dimMin[j]) dimMin[j] = vertexPositions[triangleIndex[k]][j];
-                if (vertexPositions[triangleIndex[k]][j] > dimMax[j]) dimMax[j] = vertexPositions[triangleIndex[k]][j];
+    // Emit the collapsed tree depth-first, the triangles of every leaf starting a new block
+    std::vector<BVHNode> collapsed;
+    collapsed.reserve(nodes.size());
+    blocks.clear();
+    std::vector<std::pair<size_t, int32_t>> stack; // Node, parent waiting for its right child
+    std::vector<size_t> subtree;
+    stack.push_back(std::make_pair((size_t)0, -1));
+    while (!stack.empty()) {
+        const size_t index = stack.back().first;
+        const int32_t parent = stack.back().second;
+        stack.pop_back();
+        if (parent >= 0) collapsed[parent].offset = (uint32_t)collapsed.size();
+
+        const BVHNode& node = nodes[index];
+        const bool collapse = subtreeCounts[index] <= leafSize && node.box.surfaceArea() * leafCost(subtreeCounts[index]) <= subtreeCosts[index];
+        if (!node.isLeaf() && !collapse) {
+            collapsed.push_back(node);
+            stack.push_back(std::make_pair((size_t)node.offset, (int32_t)collapsed.size() - 1));
+            stack.push_back(std::make_pair(index + 1, -1));
+            continue;
+        }
+
+        BVHNode leaf;
+        leaf.box = node.box;
+        leaf.offset = (uint32_t)blocks.size();
+        leaf.count = (uint16_t)subtreeCounts[index];
+        collapsed.push_back(leaf);
+
+        size_t lane = 0;
+        subtree.assign(1, index);
+        while (!subtree.empty()) {
+            const BVHNode& child = nodes[subtree.back()];
+            const size_t childIndex = subtree.back();
+            subtree.pop_back();
+            if (!child.isLeaf()) {
+                subtree.push_back(child.offset);
+                subtree.push_back(childIndex + 1);
+                continue;
             }
+            for (size_t i = child.offset; i < child.offset + child.count; i++) {
+                if (lane == 0) blocks.emplace_back();
+                blocks.back().set(lane, buildPrimitives[i].triangle, (uint32_t)i);
+                lane = (lane + 1) % triangleBlockWidth;
+            }
+        }
+    }
+    nodes.swap(collapsed);
+    blocks.shrink_to_fit();
+}
+
+
+namespace {
+
+// Bounds of the triangles and of their centroids, reduced in parallel over large ranges
+void computeBounds(const std::vector<BVHBuildPrimitive>& buildPrimitives, size_t begin, size_t end, AABBox& box, AABBox& centroidBox) {
+    const size_t numChunks = (end - begin >= BVH::parallelReductionThreshold) ? numOfChunks(end - begin, BVH::parallelReductionThreshold / 16) : 1;
+    std::vector<AABBox> boxes(numChunks);
+    std::vector<AABBox> centroidBoxes(numChunks);
+    parallelForChunks(numChunks, [&](size_t c) {
+        const size_t last = chunkBegin(begin, end, numChunks, c + 1);
+        for (size_t i = chunkBegin(begin, end, numChunks, c); i < last; i++) {
+            boxes[c].extend(buildPrimitives[i].box);
+            centroidBoxes[c].extend(buildPrimitives[i].box.center());
         }
+    });
+    for (size_t c = 0; c < numChunks; c++) {
+        box.extend(boxes[c]);
+        centroidBox.extend(centroidBoxes[c]);
     }
-    box.cornerDown = glm::vec3(dimMin[0], dimMin[1], dimMin[2]);
-    box.cornerUp   = glm::vec3(dimMax[0], dimMax[1], dimMax[2]);
+}
+
+// Appends a subtree built in a separate array, whose right child offsets are relative to it
+size_t appendSubtree(std::vector<BVHNode>& out, const std::vector<BVHNode>& subtree) {
+    const size_t base = out.size();
+    out.insert(out.end(), subtree.begin(), subtree.end());
+    for (size_t i = base; i < out.size(); i++)
+        if (!out[i].isLeaf()) out[i].offset += (uint32_t)base;
+    return base;
+}
+
+}
+
+
+size_t BVH::build(std::vector<BVHNode>& out, std::vector<BVHBuildPrimitive>& buildPrimitives, size_t begin, size_t end, bool debug, size_t depth) {
+    // Nodes may be reallocated by the recursive calls, so we only keep the index
+    const size_t nodeIndex = out.size();
+    out.emplace_back();
+    const size_t count = end - begin;
+
+    if (debug) {
+        for(size_t i =0; i < 2*depth; i++) std::cout << " ";
+        std::cout << "-> BVH node : ";
+    }
+
+    // 1. Determine the size of the box
+    AABBox box;
+    AABBox centroidBox;
+    computeBounds(buildPrimitives, begin, end, box, centroidBox);
+    out[nodeIndex].box = box;
     if (debug) std::cout << "(" << box.cornerDown[0] << ", " << box.cornerDown[1] << ", " << box.cornerDown[2] << ") - (" << box.cornerUp[0] << ", " << box.cornerUp[1] << ", " << box.cornerUp[2] << ")";
 
+    // 2. Let the selected strategy split the triangles
+    size_t mid = begin;
+    int axis = 0;
+    bool split;
+    switch (builder) {
+        case BVHBuilder::SAH:
+            split = splitSAH(buildPrimitives, begin, end, box, centroidBox, mid, axis);
+            if (debug) std::cout << " - Triangles: " << count << std::endl;
+            break;
+        default:
+            split = splitMedian(buildPrimitives, begin, end, box, mid, axis, debug);
+            break;
+    }
+
+    if (!split) {
+        out[nodeIndex].offset = (uint32_t)begin;
+        out[nodeIndex].count = (uint16_t)count;
+        return nodeIndex;
+    }
+    out[nodeIndex].axis = (uint8_t)axis;
+
+    // 3. Create the childs, the left one directly follows this node
+#if defined(_OPENMP) && _OPENMP >= 200805
+    if (!debug && count >= parallelBuildThreshold) {
+        // Both subtrees are built concurrently into their own arrays, then appended
+        // left first. The resulting layout does not depend on the number of threads.
+        std::vector<BVHNode> leftNodes;
+        std::vector<BVHNode> rightNodes;
+        #pragma omp task shared(buildPrimitives, leftNodes)
+        build(leftNodes, buildPrimitives, begin, mid, debug, depth + 1);
+        #pragma omp task shared(buildPrimitives, rightNodes)
+        build(rightNodes, buildPrimitives, mid, end, debug, depth + 1);
+        #pragma omp taskwait
+        appendSubtree(out, leftNodes);
+        out[nodeIndex].offset = (uint32_t)appendSubtree(out, rightNodes);
+        return nodeIndex;
+    }
+#endif
+    build(out, buildPrimitives, begin, mid, debug, depth + 1);  // Has at least 1
+    out[nodeIndex].offset = (uint32_t)build(out, buildPrimitives, mid, end, debug, depth + 1); // Has at least 1
+    return nodeIndex;
+}
+
+
+bool BVH::splitMedian(std::vector<BVHBuildPrimitive>& buildPrimitives, size_t begin, size_t end, const AABBox& box, size_t& mid, int& axis, bool debug) {
+    const size_t count = end - begin;
 
     // 1.5. SHORTCUT (BASE CASE)
-    if(triangles.size() == 1) {
+    if(count == 1) {
         if (debug) std::cout << " ONE TRIANGLE END" << std::endl;
-        return;
+        return false;
     }
-    else if(triangles.size() == 2) {
+    else if(count == 2) {
         if (debug) std::cout << " TWO TRIANGLE END" << std::endl;
-
-        std::vector<std::pair<size_t, size_t>> triangles1;
-        triangles1.push_back(std::make_pair(triangles[0].first, triangles[0].second));
-        child_left = new BVH();
-        child_left->init(scenePtr, triangles1, debug, depth + 1);
-        
-        std::vector<std::pair<size_t, size_t>> triangles2;
-        triangles2.push_back(std::make_pair(triangles[1].first, triangles[1].second));
-        child_right = new BVH();
-        child_right->init(scenePtr, triangles2, debug, depth + 1);
-
-        return;
+        mid = begin + 1;
+        return true;
     }
 
     // 2. Find the largest axis
     axis = 0;
-    float size = dimMax[0] - dimMin[0];
+    glm::vec3 dims = box.cornerUp - box.cornerDown;
     for(int i=1; i<3; i++) {
-        float s = dimMax[i] - dimMin[i];
-        if(s > size) {
-            size = s;
-            axis = i;
-        }
+        if(dims[i] > dims[axis]) axis = i;
     }
     if (debug) std::cout << " - Axis " << axis;
 
 
-
-    // 3. Find the median of the axis
-
-    // First we create a set with the vertex of the triangles
-    // This is useful so that if a vertex is part of several triangles it is not added several times
-    std::vector<float> pos;
-    for (size_t i = 0; i < triangles.size(); i++) {
-        std::pair<size_t, size_t>& pair = box.triangles[i];
-        const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(pair.first);
-        glm::uvec3& triangleIndex  = mesh->triangleIndices()[pair.second];
-        for(size_t k=0; k<3; k++) {
-            pos.push_back(mesh->vertexPositions()[triangleIndex[k]][axis]);
-        }
+    // 3. Find the median of the vertex coordinates along the axis
+    std::vector<float> pos(3 * count);
+    #pragma omp parallel for if(count >= parallelReductionThreshold)
+    for (int i = 0; i < (int)count; i++) {
+        const Triangle& triangle = buildPrimitives[begin + i].triangle;
+        pos[3*i]     = triangle.p0[axis];
+        pos[3*i + 1] = triangle.p1[axis];
+        pos[3*i + 2] = triangle.p2[axis];
     }
-    numOfVertex = pos.size();
-    // And find the median
-    median = findMedian(pos, numOfVertex);
+    const size_t numOfVertex = pos.size();
+    float median = findMedian(pos, numOfVertex);
+    std::vector<float>().swap(pos);
     if (debug) std::cout << " - Median " << median;
-    if (debug) std::cout << " - Triangles: " << triangles.size() << " - Vertex: " << numOfVertex << std::endl;
+    if (debug) std::cout << " - Triangles: " << count << " - Vertex: " << numOfVertex << std::endl;
 
 
     // 4. Separate the triangles
-    std::vector<std::pair<size_t, size_t>> trianglesRight;
-    std::vector<std::pair<size_t, size_t>> trianglesLeft;
-
-    for (size_t i = 0; i < triangles.size(); i++) {
-        std::pair<size_t, size_t> pair = box.triangles[i];
-
-        bool needToAdd = true;
-        if(i+1 ==  triangles.size()) {
-            if(trianglesRight.size() == 0){
-                trianglesRight.push_back(pair);
-                needToAdd = false;
-            }
-            if(trianglesLeft.size() == 0)  {
-                trianglesLeft.push_back(pair);
-                needToAdd = false;
-            }
+    // First decide on which side each triangle goes, then partition the range in place
+    std::vector<bool> goesLeft(count);
+    size_t numLeft = 0;
+    size_t numRight = 0;
+    for (size_t i = 0; i < count; i++) {
+        const Triangle& triangle = buildPrimitives[begin + i].triangle;
+
+        bool left;
+        if(i+1 == count && (numRight == 0 || numLeft == 0)) {
+            // Make sure that both children have at least one triangle
+            left = (numLeft == 0);
         }
-
-        if(needToAdd) {
-            const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(pair.first);
-            glm::uvec3& triangleIndex  = mesh->triangleIndices()[pair.second];
-            const std::vector<glm::vec3>& vertexPositions  = mesh->vertexPositions();
-            
+        else {
             size_t right = 0;
             size_t equality = 0;
-            for(size_t k=0; k<3; k++) {
-                if (vertexPositions[triangleIndex[k]][axis] > median) right++;
-                if (vertexPositions[triangleIndex[k]][axis] == median) equality++;
+            for(int k=0; k<3; k++) {
+                const float p = (k == 0) ? triangle.p0[axis] : ((k == 1) ? triangle.p1[axis] : triangle.p2[axis]);
+                if (p > median) right++;
+                if (p == median) equality++;
             }
 
-            if(equality == 3) {
-                if(trianglesRight.size() >= trianglesLeft.size()) trianglesLeft.push_back(pair);
-                else trianglesRight.push_back(pair);
-            }
-            else if(equality == 2) {
-                if(right > 0) trianglesRight.push_back(pair);
-                else trianglesLeft.push_back(pair);
-            }
+            if(equality == 3) left = (numRight >= numLeft);
+            else if(equality == 2) left = (right == 0);
             else if(equality == 1) {
-                if(right == 2) trianglesRight.push_back(pair);
-                else if(right == 0) trianglesLeft.push_back(pair);
-                else {
-                    if(trianglesRight.size() >= trianglesLeft.size()) trianglesLeft.push_back(pair);
-                    else trianglesRight.push_back(pair);
-                }
+                if(right == 2) left = false;
+                else if(right == 0) left = true;
+                else left = (numRight >= numLeft);
             }
-            else if(right >= 2) trianglesRight.push_back(pair);
-            else trianglesLeft.push_back(pair);
+            else left = (right < 2);
         }
+
+        goesLeft[i] = left;
+        if (left) numLeft++;
+        else numRight++;
     }
 
-    // 5. Create the childs
-    if(triangles.size() >= 2) { // if it's not a leaf
-        child_left  = new BVH();
-        child_left->init(scenePtr, trianglesLeft, debug, depth + 1);  // Has at least 1
-        child_right = new BVH();
-        child_right->init(scenePtr, trianglesRight, debug, depth + 1); // Has at least 1
+    mid = begin;
+    for (size_t i = begin; i < end; i++) {
+        if (goesLeft[i - begin]) {
+            std::swap(buildPrimitives[i], buildPrimitives[mid]);
+            mid++;
+        }
     }
+    return true;
 }
 
-BVH::~BVH() {
-    if(child_left != nullptr) delete child_left;
-    if(child_right != nullptr) delete child_right;
+
+size_t BVH::computeDepth() const {
+    // Parents are stored before their children
+    if (nodes.empty()) return 0;
+    std::vector<uint32_t> levels(nodes.size());
+    size_t maxLevel = 0;
+    levels[0] = 1;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        maxLevel = std::max<size_t>(maxLevel, levels[i]);
+        if (nodes[i].isLeaf()) continue;
+        levels[i + 1] = levels[i] + 1;
+        levels[nodes[i].offset] = levels[i] + 1;
+    }
+    return maxLevel;
 }
 
 
-bool BVH::intersect(const std::shared_ptr<Scene> scenePtr, RayHit& rayHit, Ray& ray, size_t& mesh_index, size_t& triangle_index, float tmin) {
-    // To optimize (so that we do not check useless boxes)
-    if(tmin >= rayHit.t) // Thi means that we won't find a closer intersection
-        return false;
+bool BVH::intersect(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const {
+    BVH_COUNT(rays, 1);
+    return traverse<BVHQuery::Nearest>(rayHit, ray, object_index, triangle_index) > 0;
+}
+
+
+bool BVH::fastIntersect(const Ray& ray, float tmax) const {
+    RayHit rayHit(0, 0, 0, tmax);
+    size_t object_index, triangle_index;
+    BVH_COUNT(rays, 1);
+    return traverse<BVHQuery::Any>(rayHit, ray, object_index, triangle_index) > 0;
+}
+
+
+size_t BVH::countIntersections(const Ray& ray, float tmax) const {
+    RayHit rayHit(0, 0, 0, tmax);
+    size_t object_index, triangle_index;
+    BVH_COUNT(rays, 1);
+    return traverse<BVHQuery::Count>(rayHit, ray, object_index, triangle_index);
+}
 
-    // If we have a leaf, then no need to check intersection with box, let's check
-    // intersection with triangle to save time
-    if(child_left == nullptr) { // If it's a leaf
-        std::pair<size_t, size_t>& pair = box.triangles[0];
-        const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(pair.first);
-        glm::uvec3& triangleIndex  = mesh->triangleIndices()[pair.second];
-        glm::vec3& p0 = mesh->vertexPositions()[triangleIndex[0]];
-        glm::vec3& p1 = mesh->vertexPositions()[triangleIndex[1]];
-        glm::vec3& p2 = mesh->vertexPositions()[triangleIndex[2]];
-        
-        bool hit = ray.intersect(rayHit, p0, p1, p2);
-        if(hit) {
-            mesh_index = pair.first;
-            triangle_index = pair.second;
-            return true;
-        }
-        return false;
-    }
 
-    // We now check with childs
-    float tminRight = 0;
-    bool intersectRight = child_right->box.intersect(ray, tminRight);
-    float tminLeft = 0;
-    bool intersectLeft = child_left->box.intersect(ray, tminLeft);
-    
-    if(!intersectLeft && !intersectRight) return false;
-    else if(!intersectRight) return child_left->intersect(scenePtr,  rayHit, ray, mesh_index, triangle_index, tminLeft);
-    else if(!intersectLeft)  return child_right->intersect(scenePtr,  rayHit, ray, mesh_index, triangle_index, tminRight);
-    else if(tminRight < tminLeft) {
-        bool intesect_right = child_right->intersect(scenePtr, rayHit, ray, mesh_index, triangle_index, tminRight);
-        bool intesect_left  = child_left->intersect(scenePtr,  rayHit, ray, mesh_index, triangle_index, tminLeft);
-        return (intesect_left || intesect_right);
+void BVH::countHits(const TriangleBlock& block, const TriangleRay& ray, float tmax, size_t& hits, std::vector<uint64_t>& hitTriangles) const {
+    const int mask = hitMask(block, ray, tmax);
+    if (numOfPrimitives() == triangleCount) {
+        for (int m = mask; m; m &= m - 1) hits++;
+        return;
     }
-    else {
-        bool intesect_left  = child_left->intersect(scenePtr,  rayHit, ray, mesh_index, triangle_index, tminLeft);
-        bool intesect_right = child_right->intersect(scenePtr, rayHit, ray, mesh_index, triangle_index, tminRight);
-        return (intesect_left || intesect_right);
+    for (size_t lane = 0; lane < triangleBlockWidth; lane++) {
+        if (!(mask & (1 << lane))) continue;
+        const BVHPrimitive& primitive = primitiveData()[block.primitive[lane]];
+        hitTriangles.push_back((uint64_t)primitive.object_index << 32 | (uint64_t)primitive.triangle_index);
     }
 }
 
 
-bool BVH::intersect(const std::shared_ptr<Scene> scenePtr, RayHit& rayHit, Ray& ray, size_t& mesh_index, size_t& triangle_index) {
-    float tmin = 0;
-    bool hit = box.intersect(ray, tmin);
-    if(!hit) return false;
-    return this->intersect(scenePtr, rayHit, ray, mesh_index, triangle_index, tmin);
+size_t BVH::countDistinct(std::vector<uint64_t>& hitTriangles) {
+    std::sort(hitTriangles.begin(), hitTriangles.end());
+    return std::unique(hitTriangles.begin(), hitTriangles.end()) - hitTriangles.begin();
 }
 
 
+template <BVHQuery query>
+size_t BVH::traverse(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const {
+    if (empty()) return 0;
+    if (numOfQuantizedNodes() > 0) return traverseWide<query>(quantizedNodeData(), rayHit, ray, object_index, triangle_index);
+    if (numOfWideNodes() > 0) return traverseWide<query>(wideNodeData(), rayHit, ray, object_index, triangle_index);
+    return traverseBinary<query>(rayHit, ray, object_index, triangle_index);
+}
+
+template size_t BVH::traverse<BVHQuery::Nearest>(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+template size_t BVH::traverse<BVHQuery::Any>(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+template size_t BVH::traverse<BVHQuery::Count>(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+
+
+namespace {
+
+struct BinaryStackEntry {
+    uint32_t node;
+    float tmin; // Entry distance in the node
+};
 
-bool BVH::fastIntersect(const std::shared_ptr<Scene> scenePtr, Ray& ray) {
-    float tmin = 0;
-    bool hit = box.intersect(ray, tmin);
-    if(!hit) return false;
-    return this->fastIntersect(scenePtr, ray, tmin);
 }
 
-bool BVH::fastIntersect(const std::shared_ptr<Scene> scenePtr, Ray& ray, float tmin) {
-    // If we have a leaf, then no need to check intersection with box, let's check
-    // intersection with triangle to save time
-    if(child_left == nullptr) { // If it's a leaf
-        std::pair<size_t, size_t>& pair = box.triangles[0];
-        const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(pair.first);
-        glm::uvec3& triangleIndex  = mesh->triangleIndices()[pair.second];
-        glm::vec3& p0 = mesh->vertexPositions()[triangleIndex[0]];
-        glm::vec3& p1 = mesh->vertexPositions()[triangleIndex[1]];
-        glm::vec3& p2 = mesh->vertexPositions()[triangleIndex[2]];
-        
-        return ray.fastIntersect(p0, p1, p2);
-    }
 
-    // We now check with childs
-    float tminRight = 0;
-    bool intersectRight = child_right->box.intersect(ray, tminRight);
-    float tminLeft = 0;
-    bool intersectLeft = child_left->box.intersect(ray, tminLeft);
-    
-    if(!intersectLeft && !intersectRight) return false;
-    else if(!intersectRight) return child_left->fastIntersect(scenePtr, ray, tminLeft);
-    else if(!intersectLeft)  return child_right->fastIntersect(scenePtr, ray, tminRight);
-    else if(tminRight < tminLeft) {
-        bool intersect_right = child_right->fastIntersect(scenePtr, ray, tminRight);
-        if (intersect_right) return true; // To make things faster
-        bool intersect_left  = child_left->fastIntersect(scenePtr, ray, tminLeft);
-        return intersect_left;
+template <BVHQuery query>
+size_t BVH::traverseBinary(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const {
+    const BVHNode* nodeArray = nodeData();
+    const TriangleBlock* blockArray = blockData();
+    float tmin = 0;
+    BVH_COUNT(boxTests, 1);
+    if (!nodeArray[0].box.intersect(ray, tmin)) return 0;
+
+    // Visiting a node replaces it with at most two children, so the stack never holds more
+    // than one entry per level
+    BinaryStackEntry localStack[binaryStackSize];
+    std::vector<BinaryStackEntry> deepStack;
+    BinaryStackEntry* stack = localStack;
+    if (treeDepth > binaryStackSize) {
+        deepStack.resize(treeDepth);
+        stack = deepStack.data();
     }
-    else {
-        bool intersect_left  = child_left->fastIntersect(scenePtr, ray, tminLeft);
-        if (intersect_left) return true; // To make things faster
-        bool intersect_right = child_right->fastIntersect(scenePtr, ray, tminRight);
-        return intersect_right;
+    size_t stackSize = 0;
+    stack[stackSize++] = BinaryStackEntry{ 0, tmin };
+
+    const TriangleRay triangleRay(ray);
+    size_t hits = 0;
+    std::vector<uint64_t> hitTriangles;
+    while (stackSize > 0) {
+        const BinaryStackEntry entry = stack[--stackSize];
+        if (entry.tmin >= rayHit.t) continue; // A closer triangle was found since it was pushed
+
+        // Leaves are intersected a whole triangle block at a time
+        const BVHNode& node = nodeArray[entry.node];
+        if (node.isLeaf()) {
+            BVH_COUNT(triangleTests, node.count);
+            const size_t lastBlock = node.offset + numOfTriangleBlocks(node.count);
+            for (size_t b = node.offset; b < lastBlock; b++) {
+                if (query == BVHQuery::Nearest) {
+                    size_t lane;
+                    if (::intersect(blockArray[b], triangleRay, rayHit, lane)) {
+                        const BVHPrimitive& primitive = primitiveData()[blockArray[b].primitive[lane]];
+                        object_index = primitive.object_index;
+                        triangle_index = primitive.triangle_index;
+                        hits = 1;
+                    }
+                }
+                else if (query == BVHQuery::Any) {
+                    if (occluded(blockArray[b], triangleRay, rayHit.t)) return 1;
+                }
+                else {
+                    countHits(blockArray[b], triangleRay, rayHit.t, hits, hitTriangles);
+                }
+            }
+            continue;
+        }
+
+        // The nearest child is pushed last, to be visited first
+        BVH_COUNT(nodesVisited, 1);
+        BVH_COUNT(boxTests, 2);
+        const uint32_t left = entry.node + 1;
+        const uint32_t right = node.offset;
+        float tminLeft = 0;
+        float tminRight = 0;
+        const bool intersectLeft = nodeArray[left].box.intersect(ray, tminLeft) && tminLeft < rayHit.t;
+        const bool intersectRight = nodeArray[right].box.intersect(ray, tminRight) && tminRight < rayHit.t;
+        if (intersectLeft && intersectRight) {
+            if (tminRight < tminLeft) {
+                stack[stackSize++] = BinaryStackEntry{ left, tminLeft };
+                stack[stackSize++] = BinaryStackEntry{ right, tminRight };
+            }
+            else {
+                stack[stackSize++] = BinaryStackEntry{ right, tminRight };
+                stack[stackSize++] = BinaryStackEntry{ left, tminLeft };
+            }
+        }
+        else if (intersectLeft)  stack[stackSize++] = BinaryStackEntry{ left, tminLeft };
+        else if (intersectRight) stack[stackSize++] = BinaryStackEntry{ right, tminRight };
     }
+    return hits + countDistinct(hitTriangles);
 }
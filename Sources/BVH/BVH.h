@@ -10,32 +10,280 @@
 #include <vector>
 #include <limits>
 #include <algorithm>
-#include <set>
+#include <cstdint>
+#include <memory>
+#include <string>
 
 #include "AABBox.h"
+#include "BVHStats.h"
+#include "RayPacket.h"
+#include "TriangleBlock.h"
 #include "../Ray.h"
+#include "../Triangle.h"
 #include "../Scene.h"
 
 
+/// Reference to a triangle of the scene: the object it belongs to (see Scene::objectMesh)
+/// and its index in the mesh of that object.
+struct BVHPrimitive {
+    uint32_t object_index;
+    uint32_t triangle_index;
+};
+
+/// Node of the flattened BVH. Nodes are stored in depth-first order, so the left child of
+/// an inner node is always the next node in the array and only the right child is stored.
+struct alignas(32) BVHNode {
+    inline bool isLeaf() const { return count > 0; }
+
+    AABBox box;
+    uint32_t offset = 0; // Inner node: index of the right child. Leaf: index of its first triangle block
+    uint16_t count = 0;  // Number of triangles of a leaf, 0 for an inner node
+    uint8_t axis = 0;    // 0 for x, 1 for y and 2 for z
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fit two nodes per cache line");
+
+/// Number of children of a node of the wide BVH, tested at once
+constexpr size_t wideNodeWidth = simdWidth;
+
+/// Node of the wide BVH, collapsed from the binary one. The child bounds are stored as a
+/// structure of arrays so that a single slab test covers all the children. Unused children
+/// have empty bounds, which no ray intersects.
+struct alignas(32) BVHWideNode {
+    float bounds[6][wideNodeWidth];     // Lower x, y, z then upper x, y, z of each child
+    uint32_t child[wideNodeWidth];      // Inner child: index of its wide node. Leaf: index of its first triangle block
+    uint16_t count[wideNodeWidth];      // Number of triangles of a leaf child, 0 for an inner child
+};
+
+/// Wide node with its child bounds quantized to 8 bits on a grid local to the node, half the
+/// size of a BVHWideNode. A bound is decoded as origin + q * 2^exponent, which is computed
+/// exactly in float: the grid is never finer than the float spacing of the node coordinates.
+/// The quantized boxes are rounded outwards, so they contain the children they replace.
+struct alignas(16) BVHQuantizedNode {
+    float origin[3];                    // Lower corner of the grid, on the grid itself
+    int8_t exponent[3];                 // Grid spacing along each axis, as a power of two
+    uint8_t bounds[6][wideNodeWidth];   // Lower x, y, z then upper x, y, z of each child, in grid steps
+    uint32_t child[wideNodeWidth];      // As BVHWideNode
+    uint16_t count[wideNodeWidth];
+};
+static_assert(sizeof(BVHQuantizedNode) * 2 <= sizeof(BVHWideNode), "BVHQuantizedNode should be at most half a BVHWideNode");
+
+class MappedFile;
+
+/// Arrays of a BVH loaded from a cache file, pointing directly into its mapped pages
+struct BVHMappedArrays {
+    std::shared_ptr<const MappedFile> file;
+    const BVHNode* nodes = nullptr;
+    const BVHPrimitive* primitives = nullptr;
+    const TriangleBlock* blocks = nullptr;
+    const BVHWideNode* wideNodes = nullptr;
+    const BVHQuantizedNode* quantizedNodes = nullptr;
+    size_t numOfNodes = 0;
+    size_t numOfPrimitives = 0;
+    size_t numOfBlocks = 0;
+    size_t numOfWideNodes = 0;
+    size_t numOfQuantizedNodes = 0;
+};
+
+/// Queries answered by the traversal. Like Ray::intersect, only front facing triangles are hit.
+enum class BVHQuery {
+    Nearest, // Closest hit
+    Any,     // First hit found, the traversal stops there
+    Count    // Every hit
+};
+
+/// Available construction algorithms
+enum class BVHBuilder {
+    Median, // Split on the longest axis at the median vertex
+    SAH,    // Binned surface area heuristic
+    LBVH,   // Linear BVH over Morton-sorted centroids, fast enough for per-frame rebuilds
+    SBVH    // SAH with spatial splits, which split the large triangles overlapping other nodes
+};
+
+inline const char* builderName(BVHBuilder builder) {
+    switch (builder) {
+        case BVHBuilder::SAH:  return "SAH";
+        case BVHBuilder::LBVH: return "LBVH";
+        case BVHBuilder::SBVH: return "SBVH";
+        default:               return "median";
+    }
+}
+
+/// Build-time record of a primitive. The builders partition an array of these in place.
+struct BVHBuildPrimitive {
+    BVHPrimitive ref;
+    Triangle triangle;
+    AABBox box;
+};
+
+/// Build-time node with explicit children, for the builders and passes which do not work
+/// directly on the depth-first layout.
+struct BVHBuildNode {
+    inline bool isLeaf() const { return left < 0; }
+
+    AABBox box;
+    int32_t left = -1;   // Index of the left child, -1 for a leaf
+    int32_t right = -1;  // Index of the right child, -1 for a leaf
+    uint32_t offset = 0; // Leaf: index of the first primitive
+    uint32_t count = 0;  // Leaf: number of primitives
+};
+
+
 class BVH {
 
 public:
     BVH() {};
+    /// Builds the BVH of every object of the scene, with its triangles in world space
     void init(const std::shared_ptr<Scene> scenePtr, bool debug = false);
-    void init(const std::shared_ptr<Scene> scenePtr, std::vector<std::pair<size_t, size_t>>& triangles, bool debug = false, size_t depth = 0);
-    ~BVH();
+    /// Builds the BVH of a single mesh in object space, every triangle belongs to object 0
+    void init(const Mesh& mesh, bool debug = false);
+    /// Updates the triangles and bounds from the current vertex positions and transforms of the
+    /// objects, keeping the tree topology. The objects must keep the triangles they had at build
+    /// time. The tree is rebuilt instead once the refit degrades its SAH cost past
+    /// rebuildThreshold times the cost after the last build. Returns whether it was rebuilt.
+    bool refit(const std::shared_ptr<Scene> scenePtr);
+    /// Same for a BVH built from a single mesh
+    bool refit(const Mesh& mesh);
+    void clear();
 
-    bool intersect(const std::shared_ptr<Scene> scenePtr, RayHit& rayHit, Ray& ray, size_t& mesh_index, size_t& triangle_index);
-    bool intersect(const std::shared_ptr<Scene> scenePtr, RayHit& rayHit, Ray& ray, size_t& mesh_index, size_t& triangle_index, float tmin);
-    bool fastIntersect(const std::shared_ptr<Scene> scenePtr, Ray& ray);
-    bool fastIntersect(const std::shared_ptr<Scene> scenePtr, Ray& ray, float tmin);
-	
+    /// Writes the BVH to a binary file that load maps back. 'key' identifies the geometry and
+    /// the settings it was built from, see cacheKey. Returns false on I/O errors.
+    bool save(const std::string& filename, uint64_t key) const;
+    /// Maps a file written by save, the traversal then runs directly on its pages. Returns false
+    /// and leaves the BVH unchanged when the file is missing, or was written by another format
+    /// version, for another key or with another node layout.
+    bool load(const std::string& filename, uint64_t key);
+    /// Hash of the vertex and index buffers of the mesh and of the build settings
+    uint64_t cacheKey(const Mesh& mesh) const;
+    inline bool isMapped() const { return mapped != nullptr; }
 
-    const std::shared_ptr<Scene> scenePtr;
-    AABBox box;
-    size_t numOfVertex = 0;
-    BVH* child_left = nullptr;
-    BVH* child_right = nullptr;
-    int axis = -1; // 0 for x, 1 for y and z for 2
-    float median;
+    /// Nearest triangle hit with 0 <= t < rayHit.t, rayHit is then updated
+    bool intersect(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+    /// Whether any triangle is hit with 0 <= t < tmax, e.g. for shadow rays
+    bool fastIntersect(const Ray& ray, float tmax = std::numeric_limits<float>::infinity()) const;
+    /// Number of triangles hit with 0 <= t < tmax
+    size_t countIntersections(const Ray& ray, float tmax = std::numeric_limits<float>::infinity()) const;
+    /// Nearest hits of the rays of the packet, traced together over the binary tree
+    void intersect(RayPacket& packet) const;
+    /// Occlusion of the rays of the packet up to their t, e.g. for the shadow rays of a tile
+    void fastIntersect(RayPacket& packet) const;
+
+    inline bool empty() const { return numOfNodes() == 0; }
+    inline size_t numOfNodes() const { return mapped ? mapped->numOfNodes : nodes.size(); }
+    inline size_t numOfPrimitives() const { return mapped ? mapped->numOfPrimitives : primitives.size(); }
+    /// Number of distinct triangles, lower than numOfPrimitives when spatial splits referenced some twice
+    inline size_t numOfTriangles() const { return triangleCount; }
+    inline size_t numOfWideNodes() const { return mapped ? mapped->numOfWideNodes : wideNodes.size(); }
+    inline size_t numOfQuantizedNodes() const { return mapped ? mapped->numOfQuantizedNodes : quantizedNodes.size(); }
+    /// Bounds of the whole tree, which must not be empty
+    inline const AABBox& bounds() const { return nodeData()[0].box; }
+
+    /// Expected cost of a ray traversal, according to the surface area heuristic
+    float sahCost() const;
+    /// Node and leaf counts, depths, leaf sizes, SAH cost and memory footprint of the tree
+    BVHStats stats() const;
+
+    /// Work of the traversals of every thread since the last reset, empty unless BVH_COUNTERS
+    /// is defined. Not to be called while other threads traverse.
+    static BVHTraversalCounters traversalCounters();
+    static void resetTraversalCounters();
+
+    // Build settings
+    BVHBuilder builder = BVHBuilder::Median;
+    size_t binCount = 16;     // Number of centroid bins per axis for the SAH builder
+    size_t maxLeafSize = triangleBlockWidth; // Maximum number of triangles in a leaf
+    size_t mortonBits = 30;   // Morton code length for the LBVH builder: 30 or 63 bits
+    bool optimizeTreelets = false; // Restructure the treelets of the built tree to lower its SAH cost, with any builder
+    float spatialSplitBudget = 0.3f; // Triangle references the SBVH builder may add by splitting, relative to the number of triangles
+    float spatialSplitAlpha = 1e-5f; // Overlap of the children of an object split, relative to the root area, above which spatial splits are tried
+    bool useWideNodes = true;      // Traverse the tree collapsed to wideNodeWidth children per node
+    bool quantizeWideNodes = false; // Store the wide nodes as BVHQuantizedNode, for trees larger than the caches
+    float rebuildThreshold = 1.5f; // Ratio of the SAH cost after the last build past which a refit rebuilds
+
+    // Relative costs of a node traversal and of a triangle intersection
+    static constexpr float traversalCost = 1.0f;
+    static constexpr float intersectionCost = 1.0f;
+    // Triangles are intersected a whole block at a time, so a leaf costs one test per block
+    static inline float leafCost(size_t count) { return intersectionCost * numOfTriangleBlocks(count); }
+
+    // Subtrees with more triangles than this are built by separate OpenMP tasks
+    static constexpr size_t parallelBuildThreshold = 4096;
+    // Nodes with more triangles than this compute their bounds, bins and partitions in parallel
+    static constexpr size_t parallelReductionThreshold = 65536;
+    // Subtrees with more nodes than this are refit by separate OpenMP tasks
+    static constexpr size_t parallelRefitThreshold = 1024;
+
+    // Arrays of a built BVH. They are empty for a BVH loaded from a file, whose arrays are mapped.
+    std::vector<BVHNode> nodes;             // Depth-first ordered, the root is nodes[0]
+    std::vector<BVHPrimitive> primitives;   // Every triangle of the scene, referenced by the blocks, possibly more than once
+    std::vector<TriangleBlock> blocks;      // Leaves reference contiguous ranges of this array
+    std::vector<BVHWideNode> wideNodes;     // Depth-first ordered, empty when the wide traversal is not used or quantized
+    std::vector<BVHQuantizedNode> quantizedNodes; // The wide nodes once quantized, empty unless quantizeWideNodes is set
+
+    // Entries of the fixed size stack of the wide traversal. Deeper trees use the binary one.
+    static constexpr size_t wideStackSize = 512;
+    // Bottom-up sweeps of the treelet restructuring, each one starting from the tree left by the previous one
+    static constexpr size_t treeletPasses = 3;
+    // Spatial splits are only tried above this depth, deeper nodes only split the objects
+    static constexpr size_t maxSpatialSplitDepth = 48;
+    // Entries of the fixed size stack of the binary traversal. Deeper trees allocate theirs.
+    static constexpr size_t binaryStackSize = 128;
+
+    // Version of the cache file format, to increase whenever the layout or the builders change
+    static constexpr uint32_t cacheVersion = 5;
+
+private:
+    friend class TLAS; // Queries its BVHs with traverse, to count the rays of the top level only
+
+    // Arrays traversed by the queries: the ones built, or the ones mapped from a file
+    inline const BVHNode* nodeData() const { return mapped ? mapped->nodes : nodes.data(); }
+    inline const BVHPrimitive* primitiveData() const { return mapped ? mapped->primitives : primitives.data(); }
+    inline const TriangleBlock* blockData() const { return mapped ? mapped->blocks : blocks.data(); }
+    inline const BVHWideNode* wideNodeData() const { return mapped ? mapped->wideNodes : wideNodes.data(); }
+    inline const BVHQuantizedNode* quantizedNodeData() const { return mapped ? mapped->quantizedNodes : quantizedNodes.data(); }
+    void copyMappedArrays();
+
+    void gather(const Mesh& mesh, const glm::mat4& transform, uint32_t object_index, std::vector<BVHBuildPrimitive>& buildPrimitives) const;
+    void build(std::vector<BVHBuildPrimitive>& buildPrimitives, bool debug);
+    void buildLBVH(std::vector<BVHBuildPrimitive>& buildPrimitives);
+    struct SBVHState;
+    void buildSBVH(std::vector<BVHBuildPrimitive>& buildPrimitives);
+    int32_t buildSBVHNode(std::vector<BVHBuildNode>& buildNodes, std::vector<BVHBuildPrimitive>& references, SBVHState& state, size_t depth);
+    void restructureTreelets();
+    void restructureTreelets(std::vector<BVHBuildNode>& buildNodes, int32_t root) const;
+    void flatten(const std::vector<BVHBuildNode>& buildNodes, int32_t root);
+    void buildLeafBlocks(const std::vector<BVHBuildPrimitive>& buildPrimitives);
+    void buildWideNodes();
+    void buildQuantizedNodes();
+    bool refit(const std::vector<const Mesh*>& meshes, const std::vector<glm::mat4>& transforms);
+    void refitNode(size_t nodeIndex, size_t end, const std::vector<const Mesh*>& meshes, const std::vector<glm::mat4>& transforms);
+    size_t build(std::vector<BVHNode>& out, std::vector<BVHBuildPrimitive>& buildPrimitives, size_t begin, size_t end, bool debug, size_t depth);
+
+    // Split strategies: return false when [begin, end) should become a leaf, otherwise
+    // partition the range in place around 'mid' and set the split axis. 'splitCost' receives
+    // the SAH cost of the best split found, relative to the node area.
+    bool splitMedian(std::vector<BVHBuildPrimitive>& buildPrimitives, size_t begin, size_t end, const AABBox& box, size_t& mid, int& axis, bool debug);
+    bool splitSAH(std::vector<BVHBuildPrimitive>& buildPrimitives, size_t begin, size_t end, const AABBox& box, const AABBox& centroidBox, size_t& mid, int& axis, float* splitCost = nullptr);
+
+    size_t computeDepth() const;
+
+    // Iterative traversals of the binary and wide trees. They test the triangles up to
+    // rayHit.t, and return the number of hits: at most 1 unless counting.
+    template <BVHQuery query>
+    size_t traverse(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+    template <BVHQuery query>
+    size_t traverseBinary(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+    // Traversal of the rays of 'mask' together, returns the mask of those which hit. See RayPacket.
+    template <BVHQuery query>
+    uint64_t traversePacket(RayPacket& packet, uint64_t mask) const;
+    template <BVHQuery query, typename WideNode>
+    size_t traverseWide(const WideNode* wideNodeArray, RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+    // Count queries: the triangles split by the SBVH builder are in several leaves, so their
+    // hits are collected as (object, triangle) keys and counted once
+    void countHits(const TriangleBlock& block, const TriangleRay& ray, float tmax, size_t& hits, std::vector<uint64_t>& hitTriangles) const;
+    static size_t countDistinct(std::vector<uint64_t>& hitTriangles);
+
+    float builtSAHCost = 0.0f; // SAH cost after the last build, for the refits to compare with
+    size_t treeDepth = 0;      // Number of levels of the binary tree, for the traversal stack
+    size_t triangleCount = 0;  // Number of distinct triangles
+    std::shared_ptr<const BVHMappedArrays> mapped; // Set when the BVH was loaded from a file
 };
@@ -0,0 +1,179 @@
+#include "BVH.h"
+#include "MappedFile.h"
+
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+
+namespace {
+
+// The arrays follow the header in this order, each one starting on a cache line
+enum BVHFileArray { NodeArray, PrimitiveArray, BlockArray, WideNodeArray, QuantizedNodeArray, NumOfArrays };
+constexpr size_t fileAlignment = 64;
+
+/// First bytes of a cache file. Everything but the arrays must match the running build,
+/// since the arrays are used as they are in memory.
+struct BVHFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianness;
+    uint32_t elementSizes[NumOfArrays];
+    uint32_t triangleBlockWidth;
+    uint32_t wideNodeWidth;
+    uint64_t key;
+    uint64_t offsets[NumOfArrays]; // In bytes from the start of the file
+    uint64_t counts[NumOfArrays];
+    float builtSAHCost;
+    uint32_t treeDepth;
+    uint64_t triangleCount;
+};
+
+BVHFileHeader expectedHeader(uint64_t key) {
+    BVHFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "MYRBVH\0\0", 8);
+    header.version = BVH::cacheVersion;
+    header.endianness = 0x01020304;
+    header.elementSizes[NodeArray] = sizeof(BVHNode);
+    header.elementSizes[PrimitiveArray] = sizeof(BVHPrimitive);
+    header.elementSizes[BlockArray] = sizeof(TriangleBlock);
+    header.elementSizes[WideNodeArray] = sizeof(BVHWideNode);
+    header.elementSizes[QuantizedNodeArray] = sizeof(BVHQuantizedNode);
+    header.triangleBlockWidth = (uint32_t)::triangleBlockWidth;
+    header.wideNodeWidth = (uint32_t)::wideNodeWidth;
+    header.key = key;
+    return header;
+}
+
+inline size_t alignUp(size_t size) { return (size + fileAlignment - 1) / fileAlignment * fileAlignment; }
+
+// 64-bit FNV-1a
+constexpr uint64_t hashSeed = 14695981039346656037ull;
+inline uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+template <typename T>
+inline uint64_t hashValue(uint64_t hash, const T& value) { return hashBytes(hash, &value, sizeof(T)); }
+
+}
+
+
+uint64_t BVH::cacheKey(const Mesh& mesh) const {
+    const std::vector<glm::vec3>& vertexPositions = mesh.vertexPositions();
+    const std::vector<glm::uvec3>& triangleIndices = mesh.triangleIndices();
+    uint64_t hash = hashSeed;
+    hash = hashValue(hash, (uint64_t)vertexPositions.size());
+    hash = hashBytes(hash, vertexPositions.data(), vertexPositions.size() * sizeof(glm::vec3));
+    hash = hashValue(hash, (uint64_t)triangleIndices.size());
+    hash = hashBytes(hash, triangleIndices.data(), triangleIndices.size() * sizeof(glm::uvec3));
+
+    // Settings changing the tree
+    hash = hashValue(hash, (uint32_t)builder);
+    hash = hashValue(hash, (uint64_t)binCount);
+    hash = hashValue(hash, (uint64_t)maxLeafSize);
+    hash = hashValue(hash, (uint64_t)mortonBits);
+    hash = hashValue(hash, (uint8_t)optimizeTreelets);
+    hash = hashValue(hash, (uint8_t)useWideNodes);
+    hash = hashValue(hash, (uint8_t)quantizeWideNodes);
+    hash = hashValue(hash, spatialSplitBudget);
+    hash = hashValue(hash, spatialSplitAlpha);
+    return hash;
+}
+
+
+bool BVH::save(const std::string& filename, uint64_t key) const {
+    BVHFileHeader header = expectedHeader(key);
+    const char* arrays[NumOfArrays] = { (const char*)nodeData(), (const char*)primitiveData(), (const char*)blockData(), (const char*)wideNodeData(), (const char*)quantizedNodeData() };
+    header.counts[NodeArray] = numOfNodes();
+    header.counts[PrimitiveArray] = numOfPrimitives();
+    header.counts[BlockArray] = mapped ? mapped->numOfBlocks : blocks.size();
+    header.counts[WideNodeArray] = numOfWideNodes();
+    header.counts[QuantizedNodeArray] = numOfQuantizedNodes();
+    header.builtSAHCost = builtSAHCost;
+    header.treeDepth = (uint32_t)treeDepth;
+    header.triangleCount = triangleCount;
+    size_t offset = alignUp(sizeof(header));
+    for (int a = 0; a < NumOfArrays; a++) {
+        header.offsets[a] = offset;
+        offset = alignUp(offset + header.counts[a] * header.elementSizes[a]);
+    }
+
+    // Written next to the final file then renamed, so that another process never maps a
+    // partially written file
+    const std::string temporaryFilename = filename + ".tmp";
+    {
+        std::ofstream out(temporaryFilename, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        const char padding[fileAlignment] = {};
+        out.write((const char*)&header, sizeof(header));
+        size_t written = sizeof(header);
+        for (int a = 0; a < NumOfArrays; a++) {
+            out.write(padding, header.offsets[a] - written);
+            out.write(arrays[a], header.counts[a] * header.elementSizes[a]);
+            written = header.offsets[a] + header.counts[a] * header.elementSizes[a];
+        }
+        if (!out) return false;
+    }
+    std::error_code error;
+    std::filesystem::rename(temporaryFilename, filename, error);
+    if (error) std::filesystem::remove(temporaryFilename, error);
+    return !error;
+}
+
+
+bool BVH::load(const std::string& filename, uint64_t key) {
+    std::shared_ptr<const MappedFile> file = std::make_shared<MappedFile>(filename);
+    if (!file->valid() || file->size() < sizeof(BVHFileHeader)) return false;
+
+    // The header is compared up to the array positions, which depend on the file
+    BVHFileHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    const BVHFileHeader expected = expectedHeader(key);
+    if (std::memcmp(&header, &expected, offsetof(BVHFileHeader, offsets)) != 0) return false;
+    for (int a = 0; a < NumOfArrays; a++) {
+        if (header.offsets[a] % fileAlignment != 0 || header.offsets[a] > file->size()) return false;
+        if (header.counts[a] > (file->size() - header.offsets[a]) / header.elementSizes[a]) return false;
+    }
+    if (header.counts[NodeArray] == 0) return false;
+
+    std::shared_ptr<BVHMappedArrays> arrays = std::make_shared<BVHMappedArrays>();
+    arrays->file = file;
+    arrays->nodes = (const BVHNode*)(file->data() + header.offsets[NodeArray]);
+    arrays->primitives = (const BVHPrimitive*)(file->data() + header.offsets[PrimitiveArray]);
+    arrays->blocks = (const TriangleBlock*)(file->data() + header.offsets[BlockArray]);
+    arrays->wideNodes = (const BVHWideNode*)(file->data() + header.offsets[WideNodeArray]);
+    arrays->quantizedNodes = (const BVHQuantizedNode*)(file->data() + header.offsets[QuantizedNodeArray]);
+    arrays->numOfNodes = header.counts[NodeArray];
+    arrays->numOfPrimitives = header.counts[PrimitiveArray];
+    arrays->numOfBlocks = header.counts[BlockArray];
+    arrays->numOfWideNodes = header.counts[WideNodeArray];
+    arrays->numOfQuantizedNodes = header.counts[QuantizedNodeArray];
+
+    clear();
+    mapped = arrays;
+    builtSAHCost = header.builtSAHCost;
+    treeDepth = header.treeDepth;
+    triangleCount = header.triangleCount;
+    return true;
+}
+
+
+void BVH::copyMappedArrays() {
+    // The mapped pages are read-only, so the arrays are copied before being modified
+    if (!mapped) return;
+    const std::shared_ptr<const BVHMappedArrays> arrays = mapped;
+    mapped.reset();
+    nodes.assign(arrays->nodes, arrays->nodes + arrays->numOfNodes);
+    primitives.assign(arrays->primitives, arrays->primitives + arrays->numOfPrimitives);
+    blocks.assign(arrays->blocks, arrays->blocks + arrays->numOfBlocks);
+    wideNodes.assign(arrays->wideNodes, arrays->wideNodes + arrays->numOfWideNodes);
+    quantizedNodes.assign(arrays->quantizedNodes, arrays->quantizedNodes + arrays->numOfQuantizedNodes);
+}
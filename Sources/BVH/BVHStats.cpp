@@ -0,0 +1,120 @@
+#include "BVH.h"
+
+#include <mutex>
+
+
+BVHStats BVH::stats() const {
+    BVHStats stats;
+    stats.numOfNodes = numOfNodes();
+    stats.numOfWideNodes = numOfWideNodes() + numOfQuantizedNodes();
+    stats.numOfTriangles = numOfTriangles();
+    stats.numOfReferences = numOfPrimitives();
+    stats.sahCost = sahCost();
+    stats.mapped = isMapped();
+    stats.memory = numOfNodes() * sizeof(BVHNode) + numOfPrimitives() * sizeof(BVHPrimitive)
+                 + (mapped ? mapped->numOfBlocks : blocks.size()) * sizeof(TriangleBlock)
+                 + numOfWideNodes() * sizeof(BVHWideNode) + numOfQuantizedNodes() * sizeof(BVHQuantizedNode);
+    if (empty()) return stats;
+
+    // Parents are stored before their children
+    const BVHNode* nodeArray = nodeData();
+    std::vector<uint32_t> depths(numOfNodes());
+    size_t depthSum = 0;
+    for (size_t i = 0; i < numOfNodes(); i++) {
+        const BVHNode& node = nodeArray[i];
+        if (!node.isLeaf()) {
+            depths[i + 1] = depths[i] + 1;
+            depths[node.offset] = depths[i] + 1;
+            continue;
+        }
+        stats.numOfLeaves++;
+        stats.maxDepth = std::max<size_t>(stats.maxDepth, depths[i]);
+        depthSum += depths[i];
+        if (stats.leafSizes.size() <= node.count) stats.leafSizes.resize(node.count + 1);
+        stats.leafSizes[node.count]++;
+    }
+    stats.meanDepth = (float)depthSum / stats.numOfLeaves;
+    return stats;
+}
+
+
+std::ostream& operator<<(std::ostream& out, const BVHStats& stats) {
+    out << stats.numOfNodes << " nodes, " << stats.numOfLeaves << " leaves, " << stats.numOfWideNodes << " wide nodes, "
+        << stats.numOfTriangles << " triangles";
+    if (stats.numOfReferences != stats.numOfTriangles) out << " (" << stats.numOfReferences << " references)";
+    out << ", depth " << stats.meanDepth << " mean, " << stats.maxDepth << " max, SAH cost " << stats.sahCost
+        << ", " << stats.memory / 1024 << " KiB" << (stats.mapped ? " mapped" : "") << std::endl;
+    out << "Leaf sizes:";
+    for (size_t n = 1; n < stats.leafSizes.size(); n++)
+        if (stats.leafSizes[n] > 0) out << " " << n << ": " << stats.leafSizes[n];
+    return out;
+}
+
+
+BVHTraversalCounters& BVHTraversalCounters::operator+=(const BVHTraversalCounters& other) {
+    rays += other.rays;
+    nodesVisited += other.nodesVisited;
+    boxTests += other.boxTests;
+    triangleTests += other.triangleTests;
+    return *this;
+}
+
+
+std::ostream& operator<<(std::ostream& out, const BVHTraversalCounters& counters) {
+    const double rays = (double)std::max<uint64_t>(counters.rays, 1);
+    return out << counters.rays << " rays, per ray: " << counters.nodesVisited / rays << " nodes visited, "
+               << counters.boxTests / rays << " box tests, " << counters.triangleTests / rays << " triangle tests";
+}
+
+
+#ifdef BVH_COUNTERS
+
+namespace {
+
+// Counters of the running threads, and the sum of those of the threads which exited
+std::mutex counterMutex;
+std::vector<const BVHTraversalCounters*> threadCounters;
+BVHTraversalCounters exitedThreadCounters;
+
+struct RegisteredCounters {
+    RegisteredCounters() {
+        std::lock_guard<std::mutex> lock(counterMutex);
+        threadCounters.push_back(&counters);
+    }
+    ~RegisteredCounters() {
+        std::lock_guard<std::mutex> lock(counterMutex);
+        exitedThreadCounters += counters;
+        threadCounters.erase(std::find(threadCounters.begin(), threadCounters.end(), &counters));
+    }
+
+    BVHTraversalCounters counters;
+};
+
+thread_local RegisteredCounters registeredCounters;
+
+}
+
+BVHTraversalCounters& threadTraversalCounters() {
+    return registeredCounters.counters;
+}
+
+BVHTraversalCounters BVH::traversalCounters() {
+    // Meant to be read between renders, while no thread is counting
+    std::lock_guard<std::mutex> lock(counterMutex);
+    BVHTraversalCounters sum = exitedThreadCounters;
+    for (const BVHTraversalCounters* counters : threadCounters) sum += *counters;
+    return sum;
+}
+
+void BVH::resetTraversalCounters() {
+    std::lock_guard<std::mutex> lock(counterMutex);
+    exitedThreadCounters = BVHTraversalCounters();
+    for (const BVHTraversalCounters* counters : threadCounters) *const_cast<BVHTraversalCounters*>(counters) = BVHTraversalCounters();
+}
+
+#else
+
+BVHTraversalCounters BVH::traversalCounters() { return BVHTraversalCounters(); }
+void BVH::resetTraversalCounters() {}
+
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+
+/// Shape and size of a built BVH, see BVH::stats
+struct BVHStats {
+    size_t numOfNodes = 0;      // Binary nodes, leaves included
+    size_t numOfLeaves = 0;
+    size_t numOfWideNodes = 0;  // Wide nodes, quantized or not, 0 when the binary tree is traversed
+    size_t numOfTriangles = 0;  // Distinct triangles
+    size_t numOfReferences = 0; // Triangles referenced by the leaves, more than numOfTriangles with spatial splits
+    size_t maxDepth = 0;        // Of the deepest leaf, the root being at depth 0
+    float meanDepth = 0.0f;     // Of the leaves
+    std::vector<size_t> leafSizes; // leafSizes[n] is the number of leaves with n triangles
+    float sahCost = 0.0f;
+    size_t memory = 0;          // Bytes of the arrays used by the traversal
+    bool mapped = false;        // The arrays are mapped from a cache file
+};
+
+std::ostream& operator<<(std::ostream& out, const BVHStats& stats);
+
+
+/// Work done by the traversals. Every thread counts in its own copy, and BVH::traversalCounters
+/// sums them. The counting is compiled in when BVH_COUNTERS is defined, which is the case of
+/// the builds without NDEBUG. Release builds define it with MYRENDERER_BVH_COUNTERS.
+struct BVHTraversalCounters {
+    uint64_t rays = 0;          // Queries, those of the top level only for a TLAS
+    uint64_t nodesVisited = 0;  // Inner nodes whose children were tested
+    uint64_t boxTests = 0;      // Child boxes tested, all the lanes of a wide node
+    uint64_t triangleTests = 0; // Triangles of the leaves visited
+
+    BVHTraversalCounters& operator+=(const BVHTraversalCounters& other);
+};
+
+std::ostream& operator<<(std::ostream& out, const BVHTraversalCounters& counters);
+
+#if !defined(NDEBUG) && !defined(BVH_COUNTERS)
+#define BVH_COUNTERS
+#endif
+
+#ifdef BVH_COUNTERS
+/// Counters of the calling thread
+BVHTraversalCounters& threadTraversalCounters();
+#define BVH_COUNT(counter, n) (threadTraversalCounters().counter += (n))
+#else
+#define BVH_COUNT(counter, n) ((void)0)
+#endif
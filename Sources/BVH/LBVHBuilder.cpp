@@ -0,0 +1,140 @@
+#include "BVH.h"
+#include "Parallel.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+namespace {
+
+inline int countLeadingZeros(uint64_t x) {
+    if (x == 0) return 64;
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - (int)index;
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+}
+
+
+void BVH::buildLBVH(std::vector<BVHBuildPrimitive>& buildPrimitives) {
+    // Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees", HPG 2012
+    const size_t n = buildPrimitives.size();
+    const size_t bitsPerAxis = (mortonBits > 30) ? 21 : 10;
+    const size_t numChunks = numOfChunks(n, 16384);
+
+    // 1. Morton codes of the centroids, quantized in the centroid bounds
+    std::vector<AABBox> chunkBoxes(numChunks);
+    parallelForChunks(numChunks, [&](size_t c) {
+        const size_t last = chunkBegin(0, n, numChunks, c + 1);
+        for (size_t i = chunkBegin(0, n, numChunks, c); i < last; i++)
+            chunkBoxes[c].extend(buildPrimitives[i].box.center());
+    });
+    AABBox centroidBox;
+    for (const AABBox& box : chunkBoxes) centroidBox.extend(box);
+    const glm::vec3 extent = centroidBox.cornerUp - centroidBox.cornerDown;
+    const float maxCoordinate = (float)((1u << bitsPerAxis) - 1);
+    glm::vec3 scale;
+    for (int a = 0; a < 3; a++) scale[a] = extent[a] > 0.0f ? maxCoordinate / extent[a] : 0.0f;
+
+    std::vector<uint64_t> keys(n);
+    std::vector<uint32_t> order(n);
+    parallelForChunks(numChunks, [&](size_t c) {
+        const size_t last = chunkBegin(0, n, numChunks, c + 1);
+        for (size_t i = chunkBegin(0, n, numChunks, c); i < last; i++) {
+            glm::vec3 q = glm::clamp((buildPrimitives[i].box.center() - centroidBox.cornerDown) * scale, glm::vec3(0.0f), glm::vec3(maxCoordinate));
+            if (bitsPerAxis == 10)
+                keys[i] = (expandBits10((uint64_t)q.x) << 2) | (expandBits10((uint64_t)q.y) << 1) | expandBits10((uint64_t)q.z);
+            else
+                keys[i] = (expandBits21((uint64_t)q.x) << 2) | (expandBits21((uint64_t)q.y) << 1) | expandBits21((uint64_t)q.z);
+            order[i] = (uint32_t)i;
+        }
+    });
+
+    // 2. Sort the triangles along the curve
+    radixSort(keys, order, 3 * bitsPerAxis);
+    {
+        std::vector<BVHBuildPrimitive> sorted(n);
+        parallelForChunks(numChunks, [&](size_t c) {
+            const size_t last = chunkBegin(0, n, numChunks, c + 1);
+            for (size_t i = chunkBegin(0, n, numChunks, c); i < last; i++)
+                sorted[i] = buildPrimitives[order[i]];
+        });
+        buildPrimitives.swap(sorted);
+    }
+
+    // 3. Hierarchy: internal nodes are [0, n-1), leaf i is node n-1+i and holds the i-th
+    // sorted triangle. Every internal node finds its range and split independently.
+    std::vector<BVHBuildNode> buildNodes(2 * n - 1);
+    const long long count = (long long)n;
+    auto delta = [&](long long i, long long j) -> int {
+        if (j < 0 || j >= count) return -1;
+        if (keys[i] == keys[j]) return 64 + countLeadingZeros((uint64_t)(i ^ j)); // Duplicated codes are told apart by their index
+        return countLeadingZeros(keys[i] ^ keys[j]);
+    };
+    auto nodeOf = [&](long long index, bool leaf) { return (int32_t)(leaf ? (n - 1 + index) : index); };
+
+    parallelForChunks(numChunks, [&](size_t c) {
+        const long long last = (long long)chunkBegin(0, n - 1, numChunks, c + 1);
+        for (long long i = (long long)chunkBegin(0, n - 1, numChunks, c); i < last; i++) {
+            // Direction of the range and its other end
+            const int d = (delta(i, i + 1) - delta(i, i - 1)) >= 0 ? 1 : -1;
+            const int deltaMin = delta(i, i - d);
+            long long lmax = 2;
+            while (delta(i, i + lmax * d) > deltaMin) lmax *= 2;
+            long long l = 0;
+            for (long long t = lmax / 2; t >= 1; t /= 2)
+                if (delta(i, i + (l + t) * d) > deltaMin) l += t;
+            const long long j = i + l * d;
+
+            // Split position, where the common prefix of the range ends
+            const int deltaNode = delta(i, j);
+            long long s = 0;
+            long long t = l;
+            do {
+                t = (t + 1) / 2;
+                if (delta(i, i + (s + t) * d) > deltaNode) s += t;
+            } while (t > 1);
+            const long long gamma = i + s * d + std::min(d, 0);
+
+            buildNodes[i].left  = nodeOf(gamma,     std::min(i, j) == gamma);
+            buildNodes[i].right = nodeOf(gamma + 1, std::max(i, j) == gamma + 1);
+        }
+    });
+    for (size_t i = 0; i < n; i++) {
+        BVHBuildNode& leaf = buildNodes[n - 1 + i];
+        leaf.box = buildPrimitives[i].box;
+        leaf.offset = (uint32_t)i;
+        leaf.count = 1;
+    }
+    std::vector<uint64_t>().swap(keys);
+    std::vector<uint32_t>().swap(order);
+
+    // 4. Bounds, bottom-up from a depth-first ordering of the internal nodes
+    const int32_t root = (n == 1) ? 0 : nodeOf(0, false);
+    if (n > 1) {
+        std::vector<int32_t> preorder;
+        preorder.reserve(n - 1);
+        std::vector<int32_t> stack(1, root);
+        while (!stack.empty()) {
+            int32_t index = stack.back();
+            stack.pop_back();
+            if (buildNodes[index].isLeaf()) continue;
+            preorder.push_back(index);
+            stack.push_back(buildNodes[index].right);
+            stack.push_back(buildNodes[index].left);
+        }
+        for (size_t k = preorder.size(); k-- > 0;) {
+            BVHBuildNode& node = buildNodes[preorder[k]];
+            node.box = buildNodes[node.left].box;
+            node.box.extend(buildNodes[node.right].box);
+        }
+    }
+
+    flatten(buildNodes, root);
+}
@@ -0,0 +1,172 @@
+#include "LightBVH.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+void LightBVH::init(const Scene& scene) {
+    clear();
+    const size_t numOfLights = scene.numOflightSourcesPoint();
+    std::vector<BuildLight> lights;
+    lights.reserve(numOfLights);
+    for (size_t i = 0; i < numOfLights; i++) {
+        const LightSourcePoint& light = *scene.lightSourcePoint(i);
+        const float power = light.intensity * (light.color.r + light.color.g + light.color.b) / 3.0f;
+        if (power > 0.0f) lights.push_back(BuildLight{ light.position, power, (uint32_t)i });
+    }
+    if (lights.empty()) return;
+    nodes.reserve(2 * lights.size() - 1);
+    build(lights, 0, lights.size(), 0);
+}
+
+
+void LightBVH::clear() {
+    nodes.clear();
+}
+
+
+size_t LightBVH::build(std::vector<BuildLight>& lights, size_t begin, size_t end, size_t depth) {
+    const size_t nodeIndex = nodes.size();
+    nodes.emplace_back();
+    AABBox box;
+    float power = 0.0f;
+    for (size_t i = begin; i < end; i++) {
+        box.extend(lights[i].position);
+        power += lights[i].power;
+    }
+    nodes[nodeIndex].box = box;
+    nodes[nodeIndex].power = power;
+    if (end - begin == 1) {
+        nodes[nodeIndex].offset = lights[begin].light_index;
+        nodes[nodeIndex].leaf = 1;
+        return nodeIndex;
+    }
+
+    // Binned split minimizing the power times the area of the children, the SAH weighted by
+    // the power. Lights at the same position, or too deep a tree, are split at the median.
+    const glm::vec3 extent = box.cornerUp - box.cornerDown;
+    const int longestAxis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+    int bestAxis = -1;
+    size_t bestBin = 0;
+    if (depth < maxSAHDepth) {
+        float bestCost = std::numeric_limits<float>::max();
+        for (int a = 0; a < 3; a++) {
+            if (extent[a] <= 0.0f) continue;
+            AABBox binBoxes[binCount];
+            float binPowers[binCount] = {};
+            size_t binCounts[binCount] = {};
+            auto binOf = [&](const BuildLight& light) { return std::min((size_t)(binCount * (light.position[a] - box.cornerDown[a]) / extent[a]), binCount - 1); };
+            for (size_t i = begin; i < end; i++) {
+                const size_t b = binOf(lights[i]);
+                binBoxes[b].extend(lights[i].position);
+                binPowers[b] += lights[i].power;
+                binCounts[b]++;
+            }
+            float rightCosts[binCount] = {};
+            size_t rightCounts[binCount] = {};
+            AABBox accumulated;
+            float accumulatedPower = 0.0f;
+            size_t accumulatedCount = 0;
+            for (size_t b = binCount - 1; b > 0; b--) {
+                accumulated.extend(binBoxes[b]);
+                accumulatedPower += binPowers[b];
+                accumulatedCount += binCounts[b];
+                rightCosts[b] = accumulatedPower * accumulated.surfaceArea();
+                rightCounts[b] = accumulatedCount;
+            }
+            accumulated = AABBox();
+            accumulatedPower = 0.0f;
+            accumulatedCount = 0;
+            for (size_t b = 0; b + 1 < binCount; b++) {
+                accumulated.extend(binBoxes[b]);
+                accumulatedPower += binPowers[b];
+                accumulatedCount += binCounts[b];
+                if (accumulatedCount == 0 || rightCounts[b + 1] == 0) continue;
+                const float cost = accumulatedPower * accumulated.surfaceArea() + rightCosts[b + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestBin = b;
+                }
+            }
+        }
+    }
+
+    size_t mid = begin;
+    if (bestAxis >= 0) {
+        mid = std::partition(lights.begin() + begin, lights.begin() + end, [&](const BuildLight& light) {
+            return std::min((size_t)(binCount * (light.position[bestAxis] - box.cornerDown[bestAxis]) / extent[bestAxis]), binCount - 1) <= bestBin;
+        }) - lights.begin();
+    }
+    if (mid == begin || mid == end) {
+        mid = (begin + end) / 2;
+        std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end, [&](const BuildLight& a, const BuildLight& b) {
+            return a.position[longestAxis] < b.position[longestAxis];
+        });
+    }
+
+    build(lights, begin, mid, depth + 1);
+    const size_t right = build(lights, mid, end, depth + 1);
+    nodes[nodeIndex].offset = (uint32_t)right;
+    return nodeIndex;
+}
+
+
+float LightBVH::importance(const LightBVHNode& node, const glm::vec3& p, const glm::vec3& n) {
+    // Bound on the contribution of the lights of the node: their power, over the squared
+    // distance to the box, times the largest cosine between the normal and a direction
+    // towards the box (the lights are isotropic, only the receiving side is bounded).
+    const glm::vec3 center = node.box.center();
+    const glm::vec3 diagonal = node.box.cornerUp - node.box.cornerDown;
+    const float radius2 = 0.25f * glm::dot(diagonal, diagonal);
+    const glm::vec3 toCenter = center - p;
+    const float distance2 = glm::dot(toCenter, toCenter);
+    // The distance is clamped to the size of the box as in PBRT, so that the bound stays
+    // finite near and inside the nodes, where every direction may reach a light
+    const float d2 = std::max(distance2, std::max(std::sqrt(radius2), 1e-4f));
+    if (distance2 <= radius2) return node.power / d2;
+
+    // Angle between the normal and the direction of the center, minus the angle the
+    // bounding sphere of the box subtends
+    const float cosThetaI = glm::dot(toCenter, n) / std::sqrt(distance2);
+    const float sin2ThetaB = radius2 / distance2;
+    const float cosThetaB = std::sqrt(std::max(0.0f, 1.0f - sin2ThetaB));
+    float cosTheta = 1.0f;
+    if (cosThetaI < cosThetaB) {
+        const float sinThetaI = std::sqrt(std::max(0.0f, 1.0f - cosThetaI * cosThetaI));
+        cosTheta = cosThetaI * cosThetaB + sinThetaI * std::sqrt(sin2ThetaB);
+    }
+    if (cosTheta <= 0.0f) return 0.0f;
+    return node.power * cosTheta / d2;
+}
+
+
+bool LightBVH::sample(const glm::vec3& p, const glm::vec3& n, float u, size_t& light_index, float& pmf) const {
+    if (empty() || importance(nodes[0], p, n) <= 0.0f) return false;
+    size_t index = 0;
+    pmf = 1.0f;
+    while (!nodes[index].isLeaf()) {
+        const size_t left = index + 1;
+        const size_t right = nodes[index].offset;
+        const float importanceLeft = importance(nodes[left], p, n);
+        const float importanceRight = importance(nodes[right], p, n);
+        if (importanceLeft <= 0.0f && importanceRight <= 0.0f) return false;
+
+        // u is rescaled to [0, 1) within the chosen side, to be used again below
+        const float probabilityLeft = importanceLeft / (importanceLeft + importanceRight);
+        if (u < probabilityLeft) {
+            index = left;
+            pmf *= probabilityLeft;
+            u = std::min(u / probabilityLeft, 0x1.fffffep-1f);
+        }
+        else {
+            index = right;
+            pmf *= 1.0f - probabilityLeft;
+            u = std::min((u - probabilityLeft) / (1.0f - probabilityLeft), 0x1.fffffep-1f);
+        }
+    }
+    light_index = nodes[index].offset;
+    return true;
+}
+
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "AABBox.h"
+#include "../Scene.h"
+
+
+/// Node of the light BVH, flattened depth-first as BVHNode: the left child of an inner node
+/// is the next node. Point lights emit in every direction, so the bounds of a node are its box
+/// and its total power only.
+struct LightBVHNode {
+    inline bool isLeaf() const { return leaf != 0; }
+
+    AABBox box;
+    float power = 0.0f;  // Sum of the powers of the lights below
+    uint32_t offset = 0; // Inner node: index of the right child. Leaf: index of its light in the scene
+    uint32_t leaf = 0;   // 1 for a leaf, which holds a single light
+};
+
+/// Hierarchy over the point lights of the scene, to pick the lights worth a shadow ray at a
+/// shading point in O(log n) instead of looping over all of them (Conty Estevez and Kulla,
+/// "Importance Sampling of Many Lights with Adaptive Tree Splitting", HPG 2018). A light is
+/// picked by descending from the root, choosing each child with a probability proportional
+/// to a bound on its contribution.
+class LightBVH {
+
+public:
+    LightBVH() {};
+    /// Builds the hierarchy over the point lights of the scene, in world space
+    void init(const Scene& scene);
+    void clear();
+    inline bool empty() const { return nodes.empty(); }
+
+    /// Picks a point light for the shading point p of normal n, from a uniform number u in
+    /// [0, 1). Returns false when no light can light the point, otherwise the light and the
+    /// probability it had to be picked.
+    bool sample(const glm::vec3& p, const glm::vec3& n, float u, size_t& light_index, float& pmf) const;
+
+    // Buckets of the power-weighted SAH split along each axis
+    static constexpr size_t binCount = 12;
+    // Beyond this depth the lights are split at the median, which bounds the depth of the tree
+    static constexpr size_t maxSAHDepth = 48;
+
+    std::vector<LightBVHNode> nodes; // Depth-first ordered, the root is nodes[0]
+
+private:
+    struct BuildLight {
+        glm::vec3 position;
+        float power;
+        uint32_t light_index;
+    };
+    size_t build(std::vector<BuildLight>& lights, size_t begin, size_t end, size_t depth);
+    static float importance(const LightBVHNode& node, const glm::vec3& p, const glm::vec3& n);
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+
+/// Read-only memory mapping of a whole file. The pages are only read from the disk when
+/// accessed, and are shared with the other processes mapping the same file.
+class MappedFile {
+
+public:
+    /// Maps the file, check valid() for failures
+    MappedFile(const std::string& filename);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    inline bool valid() const { return m_data != nullptr; }
+    inline const char* data() const { return m_data; }
+    inline size_t size() const { return m_size; }
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+};
@@ -0,0 +1,385 @@
+#include "BVH.h"
+#include "TLAS.h"
+
+#include <cmath>
+
+
+namespace {
+
+inline uint64_t allRays(const RayPacket& packet) {
+    return packet.size >= 64 ? ~0ull : (1ull << packet.size) - 1;
+}
+
+inline int lowestRay(uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+inline size_t numOfRays(uint64_t mask) {
+    size_t count = 0;
+    for (; mask; mask &= mask - 1) count++;
+    return count;
+}
+
+// Packet prepared for the traversals: the rays as a structure of arrays for the SIMD box
+// tests, and the bounds of their origins and inverse directions for the frustum culling
+struct PacketRays {
+    PacketRays(const RayPacket& packet) {
+        coherent = true;
+        for (int a = 0; a < 3; a++) {
+            const bool negative = std::signbit(packet.rays[0].inv_dir[a]);
+            nearPlane[a] = negative ? 1 : 0;
+            originMin[a] = invDirMin[a] = std::numeric_limits<float>::max();
+            originMax[a] = invDirMax[a] = -std::numeric_limits<float>::max();
+            boundedAxis[a] = true;
+            for (size_t i = 0; i < RayPacket::maxSize; i++) {
+                if (i >= packet.size) {
+                    origin[a][i] = 0.0f;
+                    invDir[a][i] = 0.0f;
+                    continue;
+                }
+                const Ray& ray = packet.rays[i];
+                origin[a][i] = ray.origin[a];
+                invDir[a][i] = ray.inv_dir[a];
+                if (std::signbit(ray.inv_dir[a]) != negative) coherent = false;
+                if (std::isinf(ray.inv_dir[a])) boundedAxis[a] = false;
+                originMin[a] = std::min(originMin[a], ray.origin[a]);
+                originMax[a] = std::max(originMax[a], ray.origin[a]);
+                invDirMin[a] = std::min(invDirMin[a], ray.inv_dir[a]);
+                invDirMax[a] = std::max(invDirMax[a], ray.inv_dir[a]);
+            }
+        }
+    }
+
+    // Whether every ray misses the box before tmax, by interval arithmetic over the origins
+    // and inverse directions. The slab distances are monotonic in both, so the products of
+    // the interval ends bound the distances computed for each ray, roundings included.
+    inline bool frustumMisses(const AABBox& box, float tmax) const {
+        float tnear = 0.0f;
+        float tfar = tmax;
+        for (int a = 0; a < 3; a++) {
+            if (!boundedAxis[a]) continue;
+            const float nearBound = nearPlane[a] ? box.cornerUp[a] : box.cornerDown[a];
+            const float farBound = nearPlane[a] ? box.cornerDown[a] : box.cornerUp[a];
+            const float n0 = (nearBound - originMax[a]) * invDirMin[a];
+            const float n1 = (nearBound - originMax[a]) * invDirMax[a];
+            const float n2 = (nearBound - originMin[a]) * invDirMin[a];
+            const float n3 = (nearBound - originMin[a]) * invDirMax[a];
+            const float f0 = (farBound - originMax[a]) * invDirMin[a];
+            const float f1 = (farBound - originMax[a]) * invDirMax[a];
+            const float f2 = (farBound - originMin[a]) * invDirMin[a];
+            const float f3 = (farBound - originMin[a]) * invDirMax[a];
+            tnear = std::max(tnear, std::min(std::min(n0, n1), std::min(n2, n3)));
+            tfar = std::min(tfar, std::max(std::max(f0, f1), std::max(f2, f3)));
+        }
+        return tnear > tfar;
+    }
+
+    // Rays of 'mask' entering the box before their t, tested a SIMD register at a time with
+    // the slab test of the single ray traversals
+    inline uint64_t intersectBox(const AABBox& box, uint64_t mask, const float* t) const {
+        float nearBound[3];
+        float farBound[3];
+        for (int a = 0; a < 3; a++) {
+            nearBound[a] = nearPlane[a] ? box.cornerUp[a] : box.cornerDown[a];
+            farBound[a] = nearPlane[a] ? box.cornerDown[a] : box.cornerUp[a];
+        }
+        uint64_t entered = 0;
+        for (size_t first = 0; first < RayPacket::maxSize; first += simdWidth) {
+            if (((mask >> first) & ((1ull << simdWidth) - 1)) == 0) continue;
+#if defined(BVH_SIMD_AVX2)
+            __m256 tnear = _mm256_setzero_ps();
+            __m256 tfar = _mm256_load_ps(t + first);
+            for (int a = 0; a < 3; a++) {
+                const __m256 o = _mm256_load_ps(origin[a] + first);
+                const __m256 inv = _mm256_load_ps(invDir[a] + first);
+                tnear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(nearBound[a]), o), inv), tnear);
+                tfar  = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(farBound[a]),  o), inv), tfar);
+            }
+            entered |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ)) << first;
+#elif defined(BVH_SIMD_SSE)
+            __m128 tnear = _mm_setzero_ps();
+            __m128 tfar = _mm_load_ps(t + first);
+            for (int a = 0; a < 3; a++) {
+                const __m128 o = _mm_load_ps(origin[a] + first);
+                const __m128 inv = _mm_load_ps(invDir[a] + first);
+                tnear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearBound[a]), o), inv), tnear);
+                tfar  = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farBound[a]),  o), inv), tfar);
+            }
+            entered |= (uint64_t)_mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) << first;
+#else
+            for (size_t i = first; i < first + simdWidth; i++) {
+                float tnear = 0.0f;
+                float tfar = t[i];
+                for (int a = 0; a < 3; a++) {
+                    tnear = std::max((nearBound[a] - origin[a][i]) * invDir[a][i], tnear);
+                    tfar  = std::min((farBound[a]  - origin[a][i]) * invDir[a][i], tfar);
+                }
+                if (tnear <= tfar) entered |= 1ull << i;
+            }
+#endif
+        }
+        return entered & mask;
+    }
+
+    bool coherent;     // The directions have the same signs, so the rays share their near planes
+    int nearPlane[3];  // 0 when the rays enter the boxes by their lower corner along the axis, 1 by the upper one
+    alignas(32) float origin[3][RayPacket::maxSize];
+    alignas(32) float invDir[3][RayPacket::maxSize];
+    float originMin[3];
+    float originMax[3];
+    float invDirMin[3];
+    float invDirMax[3];
+    bool boundedAxis[3]; // False when a ray is parallel to the axis, the frustum then ignores it
+};
+
+struct PacketStackEntry {
+    uint32_t node;
+    uint64_t mask; // Rays which entered the node
+};
+
+inline float maxDistance(const RayPacket& packet, uint64_t mask) {
+    float tmax = 0.0f;
+    for (; mask; mask &= mask - 1) tmax = std::max(tmax, packet.t[lowestRay(mask)]);
+    return tmax;
+}
+
+}
+
+
+void BVH::intersect(RayPacket& packet) const {
+    BVH_COUNT(rays, packet.size);
+    packet.hits = traversePacket<BVHQuery::Nearest>(packet, allRays(packet));
+}
+
+
+void BVH::fastIntersect(RayPacket& packet) const {
+    BVH_COUNT(rays, packet.size);
+    packet.hits = traversePacket<BVHQuery::Any>(packet, allRays(packet));
+}
+
+
+template <BVHQuery query>
+uint64_t BVH::traversePacket(RayPacket& packet, uint64_t mask) const {
+    static_assert(query != BVHQuery::Count, "Packets are traced for their nearest hits or their occlusion");
+    if (empty() || mask == 0) return 0;
+    uint64_t hits = 0;
+
+    // Rays going in opposite directions do not share a frustum, nor an order of the children
+    const PacketRays rays(packet);
+    if (!rays.coherent) {
+        for (; mask; mask &= mask - 1) {
+            const int i = lowestRay(mask);
+            RayHit rayHit = packet.rayHit(i);
+            size_t object_index, triangle_index;
+            if (traverse<query>(rayHit, packet.rays[i], object_index, triangle_index) == 0) continue;
+            packet.t[i] = rayHit.t;
+            packet.b0[i] = rayHit.b0;
+            packet.b1[i] = rayHit.b1;
+            packet.b2[i] = rayHit.b2;
+            packet.objectIndex[i] = (uint32_t)object_index;
+            packet.triangleIndex[i] = (uint32_t)triangle_index;
+            hits |= 1ull << i;
+        }
+        return hits;
+    }
+
+    const BVHNode* nodeArray = nodeData();
+    const TriangleBlock* blockArray = blockData();
+    float packetTmax = maxDistance(packet, mask);
+    BVH_COUNT(boxTests, numOfRays(mask));
+    if (rays.frustumMisses(nodeArray[0].box, packetTmax)) return 0;
+    mask = rays.intersectBox(nodeArray[0].box, mask, packet.t);
+    if (mask == 0) return 0;
+
+    // Each level leaves at most one child on the stack, as in traverseBinary
+    PacketStackEntry localStack[binaryStackSize];
+    std::vector<PacketStackEntry> deepStack;
+    PacketStackEntry* stack = localStack;
+    if (treeDepth > binaryStackSize) {
+        deepStack.resize(treeDepth);
+        stack = deepStack.data();
+    }
+    size_t stackSize = 0;
+    stack[stackSize++] = PacketStackEntry{ 0, mask };
+
+    TriangleRay triangleRays[RayPacket::maxSize]; // Prepared when the ray reaches its first leaf
+    uint64_t prepared = 0;
+    uint64_t done = 0; // Occluded rays, which need no more tests
+    while (stackSize > 0) {
+        const PacketStackEntry entry = stack[--stackSize];
+        const uint64_t active = entry.mask & ~done;
+        if (active == 0) continue;
+
+        const BVHNode& node = nodeArray[entry.node];
+        if (node.isLeaf()) {
+            BVH_COUNT(triangleTests, node.count * numOfRays(active));
+            const size_t lastBlock = node.offset + numOfTriangleBlocks(node.count);
+            bool shortened = false;
+            for (uint64_t m = active; m; m &= m - 1) {
+                const int i = lowestRay(m);
+                if (!(prepared & (1ull << i))) {
+                    triangleRays[i] = TriangleRay(packet.rays[i]);
+                    prepared |= 1ull << i;
+                }
+                for (size_t b = node.offset; b < lastBlock; b++) {
+                    if (query == BVHQuery::Nearest) {
+                        RayHit rayHit = packet.rayHit(i);
+                        size_t lane;
+                        if (!::intersect(blockArray[b], triangleRays[i], rayHit, lane)) continue;
+                        const BVHPrimitive& primitive = primitiveData()[blockArray[b].primitive[lane]];
+                        packet.t[i] = rayHit.t;
+                        packet.b0[i] = rayHit.b0;
+                        packet.b1[i] = rayHit.b1;
+                        packet.b2[i] = rayHit.b2;
+                        packet.objectIndex[i] = primitive.object_index;
+                        packet.triangleIndex[i] = primitive.triangle_index;
+                        hits |= 1ull << i;
+                        shortened = true;
+                    }
+                    else if (occluded(blockArray[b], triangleRays[i], packet.t[i])) {
+                        hits |= 1ull << i;
+                        done |= 1ull << i;
+                        break;
+                    }
+                }
+            }
+            if (query == BVHQuery::Any && done == mask) return hits;
+            if (shortened) packetTmax = maxDistance(packet, mask & ~done);
+            continue;
+        }
+
+        // Children culled by the frustum first, then ray by ray. The nearest child along the
+        // split axis is pushed last, to be visited first.
+        BVH_COUNT(nodesVisited, 1);
+        BVH_COUNT(boxTests, 2 * numOfRays(active));
+        const uint32_t left = entry.node + 1;
+        const uint32_t right = node.offset;
+        const uint64_t leftMask = rays.frustumMisses(nodeArray[left].box, packetTmax) ? 0 : rays.intersectBox(nodeArray[left].box, active, packet.t);
+        const uint64_t rightMask = rays.frustumMisses(nodeArray[right].box, packetTmax) ? 0 : rays.intersectBox(nodeArray[right].box, active, packet.t);
+        const bool rightFirst = rays.nearPlane[node.axis] == 1;
+        const PacketStackEntry nearChild = rightFirst ? PacketStackEntry{ right, rightMask } : PacketStackEntry{ left, leftMask };
+        const PacketStackEntry farChild = rightFirst ? PacketStackEntry{ left, leftMask } : PacketStackEntry{ right, rightMask };
+        if (farChild.mask) stack[stackSize++] = farChild;
+        if (nearChild.mask) stack[stackSize++] = nearChild;
+    }
+    return hits;
+}
+
+template uint64_t BVH::traversePacket<BVHQuery::Nearest>(RayPacket& packet, uint64_t mask) const;
+template uint64_t BVH::traversePacket<BVHQuery::Any>(RayPacket& packet, uint64_t mask) const;
+
+
+void TLAS::intersect(RayPacket& packet) const {
+    packet.hits = traversePacket<BVHQuery::Nearest>(packet);
+}
+
+
+void TLAS::fastIntersect(RayPacket& packet) const {
+    packet.hits = traversePacket<BVHQuery::Any>(packet);
+}
+
+
+template <BVHQuery query>
+uint64_t TLAS::traversePacket(RayPacket& packet) const {
+    uint64_t mask = allRays(packet);
+    if (nodes.empty() || mask == 0) return 0;
+    uint64_t hits = 0;
+
+    const PacketRays rays(packet);
+    if (!rays.coherent) {
+        for (; mask; mask &= mask - 1) {
+            const int i = lowestRay(mask);
+            if (query == BVHQuery::Any) {
+                if (fastIntersect(packet.rays[i], packet.t[i])) hits |= 1ull << i;
+                continue;
+            }
+            RayHit rayHit = packet.rayHit(i);
+            size_t object_index, triangle_index;
+            if (!intersect(rayHit, packet.rays[i], object_index, triangle_index)) continue;
+            packet.t[i] = rayHit.t;
+            packet.b0[i] = rayHit.b0;
+            packet.b1[i] = rayHit.b1;
+            packet.b2[i] = rayHit.b2;
+            packet.objectIndex[i] = (uint32_t)object_index;
+            packet.triangleIndex[i] = (uint32_t)triangle_index;
+            hits |= 1ull << i;
+        }
+        return hits;
+    }
+
+    BVH_COUNT(rays, packet.size);
+    BVH_COUNT(boxTests, packet.size);
+    float packetTmax = maxDistance(packet, mask);
+    if (rays.frustumMisses(nodes[0].box, packetTmax)) return 0;
+    mask = rays.intersectBox(nodes[0].box, mask, packet.t);
+    if (mask == 0) return 0;
+
+    PacketStackEntry stack[stackSize];
+    size_t size = 0;
+    stack[size++] = PacketStackEntry{ 0, mask };
+    uint64_t done = 0;
+    RayPacket instancePacket;
+    int instanceRays[RayPacket::maxSize]; // Index in the packet of each ray of the instance packet
+    while (size > 0) {
+        const PacketStackEntry entry = stack[--size];
+        const uint64_t active = entry.mask & ~done;
+        if (active == 0) continue;
+
+        const BVHNode& node = nodes[entry.node];
+        if (node.isLeaf()) {
+            const TLASInstance& instance = instances[node.offset];
+            const BVH& blas = blases[instance.blas];
+            uint64_t instanceHits = 0;
+            if (instance.identity) {
+                instanceHits = blas.traversePacket<query>(packet, active);
+            }
+            else {
+                // The rays are brought to the space of the instance, with the same distances
+                instancePacket.clear();
+                for (uint64_t m = active; m; m &= m - 1) {
+                    const int i = lowestRay(m);
+                    instanceRays[instancePacket.add(instance.toObjectSpace(packet.rays[i]), packet.t[i])] = i;
+                }
+                for (uint64_t m = blas.traversePacket<query>(instancePacket, allRays(instancePacket)); m; m &= m - 1) {
+                    const int j = lowestRay(m);
+                    const int i = instanceRays[j];
+                    packet.t[i] = instancePacket.t[j];
+                    packet.b0[i] = instancePacket.b0[j];
+                    packet.b1[i] = instancePacket.b1[j];
+                    packet.b2[i] = instancePacket.b2[j];
+                    packet.triangleIndex[i] = instancePacket.triangleIndex[j];
+                    instanceHits |= 1ull << i;
+                }
+            }
+            for (uint64_t m = instanceHits; m; m &= m - 1) packet.objectIndex[lowestRay(m)] = instance.object_index;
+            hits |= instanceHits;
+            if (query == BVHQuery::Any) {
+                done |= instanceHits;
+                if (done == mask) return hits;
+            }
+            else if (instanceHits) {
+                packetTmax = maxDistance(packet, mask);
+            }
+            continue;
+        }
+
+        BVH_COUNT(nodesVisited, 1);
+        BVH_COUNT(boxTests, 2 * numOfRays(active));
+        const uint32_t left = (uint32_t)entry.node + 1;
+        const uint32_t right = node.offset;
+        const uint64_t leftMask = rays.frustumMisses(nodes[left].box, packetTmax) ? 0 : rays.intersectBox(nodes[left].box, active, packet.t);
+        const uint64_t rightMask = rays.frustumMisses(nodes[right].box, packetTmax) ? 0 : rays.intersectBox(nodes[right].box, active, packet.t);
+        const bool rightFirst = rays.nearPlane[node.axis] == 1;
+        const PacketStackEntry nearChild = rightFirst ? PacketStackEntry{ right, rightMask } : PacketStackEntry{ left, leftMask };
+        const PacketStackEntry farChild = rightFirst ? PacketStackEntry{ left, leftMask } : PacketStackEntry{ right, rightMask };
+        if (farChild.mask) stack[size++] = farChild;
+        if (nearChild.mask) stack[size++] = nearChild;
+    }
+    return hits;
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <memory>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+/// Number of chunks a range of 'count' elements is split into for a parallel loop. It only
+/// depends on the size of the range, so results merged in chunk order do not depend on the
+/// number of threads.
+inline size_t numOfChunks(size_t count, size_t grainSize) {
+    return std::max<size_t>(1, std::min<size_t>(256, count / std::max<size_t>(grainSize, 1)));
+}
+
+/// First element of a chunk of [begin, end) split in numChunks chunks.
+inline size_t chunkBegin(size_t begin, size_t end, size_t numChunks, size_t chunk) {
+    return begin + (end - begin) * chunk / numChunks;
+}
+
+/// Runs f(chunk) for every chunk in [0, numChunks). Inside a parallel region (e.g. from an
+/// OpenMP task) the chunks become tasks of the current team, otherwise a team is started.
+template <typename F>
+inline void parallelForChunks(size_t numChunks, F f) {
+    const int n = (int)numChunks;
+#if defined(_OPENMP) && _OPENMP >= 201511
+    if (omp_in_parallel()) {
+        #pragma omp taskloop grainsize(1)
+        for (int c = 0; c < n; c++) f((size_t)c);
+        return;
+    }
+#endif
+    #pragma omp parallel for schedule(dynamic, 1) if(n > 1)
+    for (int c = 0; c < n; c++) f((size_t)c);
+}
+
+/// Number of workers of parallelForStealing, to size their scratch state.
+inline size_t numOfWorkers() {
+#ifdef _OPENMP
+    return (size_t)std::max(1, omp_get_max_threads());
+#else
+    return 1;
+#endif
+}
+
+/// Runs f(worker, i) for every i in [0, count), with 'worker' in [0, numOfWorkers()) the index
+/// of the worker running it, so that each worker can keep its own scratch state. Every worker
+/// starts with a contiguous range of indices, consumed from its front. A worker whose range is
+/// empty steals the back half of the range of another, so the load balances itself when the
+/// cost of the indices varies, while each worker mostly keeps neighbouring indices.
+template <typename F>
+inline void parallelForStealing(size_t count, F f) {
+    const size_t n = numOfWorkers();
+    if (n == 1 || count <= 1) {
+        for (size_t i = 0; i < count; i++) f(0, i);
+        return;
+    }
+    // Range [begin, end) of a worker, packed in 32 bits each so that it changes atomically.
+    // Indices are handed out once, so a range never comes back to a former value.
+    struct alignas(64) WorkerRange { std::atomic<uint64_t> range; };
+    auto pack = [](uint64_t begin, uint64_t end) { return (begin << 32) | end; };
+    std::unique_ptr<WorkerRange[]> ranges(new WorkerRange[n]);
+    for (size_t w = 0; w < n; w++)
+        ranges[w].range.store(pack(chunkBegin(0, count, n, w), chunkBegin(0, count, n, w + 1)), std::memory_order_relaxed);
+
+    #pragma omp parallel num_threads((int)n)
+    {
+#ifdef _OPENMP
+        const size_t worker = (size_t)omp_get_thread_num();
+#else
+        const size_t worker = 0;
+#endif
+        std::atomic<uint64_t>& own = ranges[worker].range;
+        for (;;) {
+            // Next index of the own range
+            uint64_t range = own.load(std::memory_order_acquire);
+            uint64_t begin = range >> 32, end = range & 0xffffffff;
+            if (begin < end) {
+                if (own.compare_exchange_weak(range, pack(begin + 1, end), std::memory_order_acq_rel)) f(worker, (size_t)begin);
+                continue;
+            }
+            // Steal the back half of the first non-empty range after the own one. The workers
+            // a team smaller than n leaves out have their range stolen as well.
+            bool stolen = false;
+            for (size_t k = 1; k < n && !stolen; k++) {
+                std::atomic<uint64_t>& victim = ranges[(worker + k) % n].range;
+                uint64_t victimRange = victim.load(std::memory_order_acquire);
+                for (;;) {
+                    const uint64_t victimBegin = victimRange >> 32, victimEnd = victimRange & 0xffffffff;
+                    if (victimBegin >= victimEnd) break;
+                    const uint64_t middle = victimEnd - (victimEnd - victimBegin + 1) / 2;
+                    if (victim.compare_exchange_weak(victimRange, pack(victimBegin, middle), std::memory_order_acq_rel)) {
+                        own.store(pack(middle, victimEnd), std::memory_order_release);
+                        stolen = true;
+                        break;
+                    }
+                }
+            }
+            if (!stolen) break;
+        }
+    }
+}
+
+/// Spreads the lowest 10 bits of x so that there are two zeros between consecutive bits, to
+/// interleave three coordinates into a Morton code sorted by radixSort
+inline uint64_t expandBits10(uint64_t x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x <<  8)) & 0x0300f00f;
+    x = (x | (x <<  4)) & 0x030c30c3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+/// Spreads the lowest 21 bits of x as expandBits10
+inline uint64_t expandBits21(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x001f00000000ffffull;
+    x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+    x = (x | (x <<  8)) & 0x100f00f00f00f00full;
+    x = (x | (x <<  4)) & 0x10c30c30c30c30c3ull;
+    x = (x | (x <<  2)) & 0x1249249249249249ull;
+    return x;
+}
+
+/// Stable LSD radix sort of (key, value) pairs on the lowest 'bits' bits of the keys, by 8-bit
+/// digits. Every pass computes per-chunk histograms in parallel, then scatters each chunk to
+/// its final position.
+inline void radixSort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, size_t bits) {
+    const size_t n = keys.size();
+    const size_t numChunks = numOfChunks(n, 16384);
+    std::vector<uint64_t> keysTmp(n);
+    std::vector<uint32_t> valuesTmp(n);
+    std::vector<size_t> histograms(numChunks * 256);
+
+    for (size_t shift = 0; shift < bits; shift += 8) {
+        std::fill(histograms.begin(), histograms.end(), 0);
+        parallelForChunks(numChunks, [&](size_t c) {
+            size_t* histogram = &histograms[c * 256];
+            const size_t last = chunkBegin(0, n, numChunks, c + 1);
+            for (size_t i = chunkBegin(0, n, numChunks, c); i < last; i++)
+                histogram[(keys[i] >> shift) & 0xff]++;
+        });
+
+        // Exclusive prefix sum, digit major then chunk order. A digit shared by
+        // every key leaves the order unchanged, so the pass can be skipped.
+        size_t sum = 0;
+        bool trivial = false;
+        for (size_t d = 0; d < 256; d++) {
+            size_t digitCount = 0;
+            for (size_t c = 0; c < numChunks; c++) {
+                size_t count = histograms[c * 256 + d];
+                histograms[c * 256 + d] = sum;
+                sum += count;
+                digitCount += count;
+            }
+            if (digitCount == n) trivial = true;
+        }
+        if (trivial) continue;
+
+        parallelForChunks(numChunks, [&](size_t c) {
+            size_t* offsets = &histograms[c * 256];
+            const size_t last = chunkBegin(0, n, numChunks, c + 1);
+            for (size_t i = chunkBegin(0, n, numChunks, c); i < last; i++) {
+                size_t& offset = offsets[(keys[i] >> shift) & 0xff];
+                keysTmp[offset] = keys[i];
+                valuesTmp[offset] = values[i];
+                offset++;
+            }
+        });
+        keys.swap(keysTmp);
+        values.swap(valuesTmp);
+    }
+}
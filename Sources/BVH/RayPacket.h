@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "../Ray.h"
+#include "../RayHit.h"
+
+
+/// Rays traced together, e.g. the primary rays of an 8x8 pixel tile or the shadow rays of
+/// their hits towards a directional light. The traversal visits the nodes once for the whole
+/// packet, culls them with the frustum bounding the rays, then tests the rays entering them
+/// a SIMD register at a time. Packets whose directions do not share their signs are traced
+/// one ray at a time.
+struct RayPacket {
+    static constexpr size_t maxSize = 64;
+
+    inline void clear() { size = 0; hits = 0; }
+    /// Appends a ray tested up to tmax, and returns its index in the packet
+    inline size_t add(const Ray& ray, float tmax = std::numeric_limits<float>::max()) {
+        rays[size] = ray;
+        t[size] = tmax;
+        return size++;
+    }
+    inline bool hit(size_t i) const { return (hits >> i) & 1; }
+    /// Nearest hit of ray i, valid when hit(i)
+    inline RayHit rayHit(size_t i) const { return RayHit(b0[i], b1[i], b2[i], t[i]); }
+
+    size_t size = 0;
+    Ray rays[maxSize];
+    uint64_t hits = 0; // Bit i is set when ray i hit a triangle, or is occluded for an occlusion query
+
+    // Nearest hits. t is the maximum distance on input.
+    alignas(32) float t[maxSize];
+    float b0[maxSize];
+    float b1[maxSize];
+    float b2[maxSize];
+    uint32_t objectIndex[maxSize];
+    uint32_t triangleIndex[maxSize];
+};
@@ -0,0 +1,98 @@
+#include "BVH.h"
+#include "Parallel.h"
+
+
+bool BVH::refit(const std::shared_ptr<Scene> scenePtr) {
+    const size_t numOfObjects = scenePtr->numOfObjects();
+    std::vector<const Mesh*> meshes(numOfObjects);
+    std::vector<glm::mat4> transforms(numOfObjects);
+    for (size_t i = 0; i < numOfObjects; i++) {
+        meshes[i] = scenePtr->mesh(scenePtr->objectMesh(i)).get();
+        transforms[i] = scenePtr->objectTransformMatrix(i);
+    }
+    if (refit(meshes, transforms)) return false;
+    init(scenePtr);
+    return true;
+}
+
+
+bool BVH::refit(const Mesh& mesh) {
+    const std::vector<const Mesh*> meshes(1, &mesh);
+    const std::vector<glm::mat4> transforms(1, glm::mat4(1.0f));
+    if (refit(meshes, transforms)) return false;
+    init(mesh);
+    return true;
+}
+
+
+bool BVH::refit(const std::vector<const Mesh*>& meshes, const std::vector<glm::mat4>& transforms) {
+    // The topology is only kept when the objects still have the triangles it was built for.
+    // The leaves holding a part of a triangle split by the SBVH builder are refitted to the
+    // whole triangle, which is conservative.
+    size_t numOfTriangles = 0;
+    for (const Mesh* mesh : meshes) numOfTriangles += mesh->triangleIndices().size();
+    if (numOfTriangles != this->numOfTriangles()) return false;
+    if (empty()) return true;
+    copyMappedArrays();
+
+    // The top of the tree is split across OpenMP tasks, see BVH::refitNode
+    #pragma omp parallel if(nodes.size() >= parallelRefitThreshold)
+    {
+        #pragma omp single
+        refitNode(0, nodes.size(), meshes, transforms);
+    }
+
+    // The boxes were only extended to follow the vertices, the quality of the tree degrades
+    // as they move away from their positions at build time
+    if (sahCost() > rebuildThreshold * builtSAHCost) return false;
+    buildWideNodes();
+    return true;
+}
+
+
+void BVH::refitNode(size_t nodeIndex, size_t end, const std::vector<const Mesh*>& meshes, const std::vector<glm::mat4>& transforms) {
+    // The subtree of a node is the range [nodeIndex, end) of the depth-first array
+    BVHNode& node = nodes[nodeIndex];
+    if (node.isLeaf()) {
+        AABBox box;
+        for (size_t k = 0; k < node.count; k++) {
+            TriangleBlock& block = blocks[node.offset + k / triangleBlockWidth];
+            const size_t lane = k % triangleBlockWidth;
+            const uint32_t primitiveIndex = block.primitive[lane];
+            const BVHPrimitive& primitive = primitives[primitiveIndex];
+            const std::vector<glm::vec3>& vertexPositions = meshes[primitive.object_index]->vertexPositions();
+            const glm::uvec3& trianglePos = meshes[primitive.object_index]->triangleIndices()[primitive.triangle_index];
+            const glm::mat4& transform = transforms[primitive.object_index];
+            const Triangle triangle(glm::vec3(transform * glm::vec4(vertexPositions[trianglePos[0]], 1.0f)),
+                                    glm::vec3(transform * glm::vec4(vertexPositions[trianglePos[1]], 1.0f)),
+                                    glm::vec3(transform * glm::vec4(vertexPositions[trianglePos[2]], 1.0f)));
+            block.set(lane, triangle, primitiveIndex);
+            box.extend(triangle.p0);
+            box.extend(triangle.p1);
+            box.extend(triangle.p2);
+        }
+        node.box = box;
+        return;
+    }
+
+    const size_t left = nodeIndex + 1;
+    const size_t right = node.offset;
+#if defined(_OPENMP) && _OPENMP >= 200805
+    if (end - nodeIndex >= parallelRefitThreshold) {
+        #pragma omp task shared(meshes, transforms)
+        refitNode(left, right, meshes, transforms);
+        #pragma omp task shared(meshes, transforms)
+        refitNode(right, end, meshes, transforms);
+        #pragma omp taskwait
+    }
+    else
+#endif
+    {
+        refitNode(left, right, meshes, transforms);
+        refitNode(right, end, meshes, transforms);
+    }
+
+    AABBox box = nodes[left].box;
+    box.extend(nodes[right].box);
+    nodes[nodeIndex].box = box;
+}
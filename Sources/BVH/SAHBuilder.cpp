@@ -0,0 +1,139 @@
+#include "BVH.h"
+#include "Parallel.h"
+
+
+namespace {
+
+struct SAHBin {
+    AABBox box;
+    size_t count = 0;
+};
+
+inline size_t binOf(float centroid, float cmin, float scale, size_t binCount) {
+    size_t b = (size_t)((centroid - cmin) * scale);
+    return std::min(b, binCount - 1);
+}
+
+}
+
+
+bool BVH::splitSAH(std::vector<BVHBuildPrimitive>& buildPrimitives, size_t begin, size_t end, const AABBox& box, const AABBox& centroidBox, size_t& mid, int& axis, float* splitCost) {
+    const size_t count = end - begin;
+    const size_t leafSize = std::min<size_t>(std::max<size_t>(maxLeafSize, 1), std::numeric_limits<uint16_t>::max());
+    if (count == 1) return false;
+
+    // 1. Bin the centroids along each axis. Large ranges are binned per chunk in parallel,
+    // and the chunks are merged in order.
+    const size_t numBins = std::max<size_t>(binCount, 2);
+    const size_t numChunks = (count >= parallelReductionThreshold) ? numOfChunks(count, parallelReductionThreshold / 16) : 1;
+    std::vector<SAHBin> chunkBins(numChunks * 3 * numBins);
+    parallelForChunks(numChunks, [&](size_t c) {
+        SAHBin* bins = &chunkBins[c * 3 * numBins];
+        const size_t last = chunkBegin(begin, end, numChunks, c + 1);
+        for (size_t i = chunkBegin(begin, end, numChunks, c); i < last; i++) {
+            const AABBox& primitiveBox = buildPrimitives[i].box;
+            const glm::vec3 centroid = primitiveBox.center();
+            for (int a = 0; a < 3; a++) {
+                const float extent = centroidBox.cornerUp[a] - centroidBox.cornerDown[a];
+                if (extent <= 0.0f) continue;
+                SAHBin& bin = bins[a * numBins + binOf(centroid[a], centroidBox.cornerDown[a], numBins / extent, numBins)];
+                bin.box.extend(primitiveBox);
+                bin.count++;
+            }
+        }
+    });
+    for (size_t c = 1; c < numChunks; c++) {
+        for (size_t b = 0; b < 3 * numBins; b++) {
+            chunkBins[b].box.extend(chunkBins[c * 3 * numBins + b].box);
+            chunkBins[b].count += chunkBins[c * 3 * numBins + b].count;
+        }
+    }
+
+    // 2. Sweep the bins to find the cheapest split
+    const float costAsLeaf = leafCost(count);
+    const float nodeArea = box.surfaceArea();
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1;
+    size_t bestSplit = 0; // Bins [0, bestSplit] go to the left child
+
+    std::vector<float> rightArea(numBins);
+    std::vector<size_t> rightCount(numBins);
+    for (int a = 0; a < 3; a++) {
+        if (centroidBox.cornerUp[a] - centroidBox.cornerDown[a] <= 0.0f) continue; // All centroids are on a plane orthogonal to this axis
+        const SAHBin* bins = &chunkBins[a * numBins];
+
+        AABBox accumulated;
+        size_t accumulatedCount = 0;
+        for (size_t b = numBins - 1; b > 0; b--) {
+            accumulated.extend(bins[b].box);
+            accumulatedCount += bins[b].count;
+            rightArea[b] = accumulated.surfaceArea();
+            rightCount[b] = accumulatedCount;
+        }
+
+        accumulated = AABBox();
+        accumulatedCount = 0;
+        for (size_t b = 0; b + 1 < numBins; b++) {
+            accumulated.extend(bins[b].box);
+            accumulatedCount += bins[b].count;
+            if (accumulatedCount == 0 || rightCount[b + 1] == 0) continue;
+            float cost = traversalCost + (accumulated.surfaceArea() * leafCost(accumulatedCount) + rightArea[b + 1] * leafCost(rightCount[b + 1])) / nodeArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = a;
+                bestSplit = b;
+            }
+        }
+    }
+
+    if (splitCost) *splitCost = bestCost;
+
+    // 3. Create a leaf when splitting does not pay off
+    if (count <= leafSize && (bestAxis < 0 || bestCost >= costAsLeaf))
+        return false;
+
+    if (bestAxis < 0) {
+        // Every centroid is at the same place, split the range in two halves
+        mid = begin + count / 2;
+        return true;
+    }
+    axis = bestAxis;
+
+    // 4. Partition the triangles in place
+    const float cmin = centroidBox.cornerDown[axis];
+    const float scale = numBins / (centroidBox.cornerUp[axis] - cmin);
+    auto goesLeft = [&](const BVHBuildPrimitive& p) { return binOf(p.box.center()[axis], cmin, scale, numBins) <= bestSplit; };
+    if (numChunks == 1) {
+        mid = std::partition(buildPrimitives.begin() + begin, buildPrimitives.begin() + end, goesLeft) - buildPrimitives.begin();
+    }
+    else {
+        // Count the left triangles of each chunk, then scatter every chunk to its
+        // final position. This is a stable partition, independent of the thread count.
+        std::vector<size_t> leftOffsets(numChunks + 1, 0);
+        parallelForChunks(numChunks, [&](size_t c) {
+            const size_t last = chunkBegin(begin, end, numChunks, c + 1);
+            for (size_t i = chunkBegin(begin, end, numChunks, c); i < last; i++)
+                if (goesLeft(buildPrimitives[i])) leftOffsets[c + 1]++;
+        });
+        for (size_t c = 0; c < numChunks; c++) leftOffsets[c + 1] += leftOffsets[c];
+        const size_t numLeft = leftOffsets[numChunks];
+
+        std::vector<BVHBuildPrimitive> partitioned(count);
+        parallelForChunks(numChunks, [&](size_t c) {
+            const size_t first = chunkBegin(begin, end, numChunks, c);
+            const size_t last = chunkBegin(begin, end, numChunks, c + 1);
+            size_t left = leftOffsets[c];
+            size_t right = numLeft + (first - begin) - leftOffsets[c];
+            for (size_t i = first; i < last; i++) {
+                if (goesLeft(buildPrimitives[i])) partitioned[left++] = buildPrimitives[i];
+                else partitioned[right++] = buildPrimitives[i];
+            }
+        });
+        parallelForChunks(numChunks, [&](size_t c) {
+            std::copy(partitioned.begin() + chunkBegin(0, count, numChunks, c), partitioned.begin() + chunkBegin(0, count, numChunks, c + 1), buildPrimitives.begin() + begin + chunkBegin(0, count, numChunks, c));
+        });
+        mid = begin + numLeft;
+    }
+    if (mid == begin || mid == end) mid = begin + count / 2;
+    return true;
+}
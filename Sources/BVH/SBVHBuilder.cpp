@@ -0,0 +1,253 @@
+#include "BVH.h"
+
+
+namespace {
+
+// Parts of a reference on both sides of the plane 'position' along 'axis'. The triangle is
+// clipped, so the parts are tighter than the reference box cut in two.
+void splitReference(const BVHBuildPrimitive& reference, int axis, float position, AABBox& left, AABBox& right) {
+    left = AABBox();
+    right = AABBox();
+    const glm::vec3 vertices[3] = { reference.triangle.p0, reference.triangle.p1, reference.triangle.p2 };
+    for (int i = 0; i < 3; i++) {
+        const glm::vec3& v0 = vertices[i];
+        const glm::vec3& v1 = vertices[(i + 1) % 3];
+        if (v0[axis] <= position) left.extend(v0);
+        if (v0[axis] >= position) right.extend(v0);
+        if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position)) {
+            const float t = (position - v0[axis]) / (v1[axis] - v0[axis]);
+            glm::vec3 p = v0 + t * (v1 - v0);
+            p[axis] = position;
+            left.extend(p);
+            right.extend(p);
+        }
+    }
+
+    // The reference may already be a part of its triangle
+    left.cornerUp[axis] = position;
+    right.cornerDown[axis] = position;
+    left.cornerDown = glm::max(left.cornerDown, reference.box.cornerDown);
+    left.cornerUp = glm::min(left.cornerUp, reference.box.cornerUp);
+    right.cornerDown = glm::max(right.cornerDown, reference.box.cornerDown);
+    right.cornerUp = glm::min(right.cornerUp, reference.box.cornerUp);
+}
+
+inline AABBox merged(const AABBox& a, const AABBox& b) {
+    AABBox box = a;
+    box.extend(b);
+    return box;
+}
+
+struct SpatialBin {
+    AABBox box;
+    size_t entries = 0; // References starting in this bin
+    size_t exits = 0;   // References ending in this bin
+};
+
+inline bool isValid(const AABBox& box) { return glm::all(glm::lessThanEqual(box.cornerDown, box.cornerUp)); }
+
+struct SpatialSplit {
+    float cost = std::numeric_limits<float>::max();
+    int axis = -1;
+    float position = 0.0f;
+    AABBox leftBox;  // Bounds of the bins on each side, before the references are unsplit
+    AABBox rightBox;
+    size_t leftCount = 0;
+    size_t rightCount = 0;
+};
+
+// Cheapest plane between 'numBins' bins of the node along each axis, with the chopped bounds
+// of the references in each bin
+SpatialSplit findSpatialSplit(const std::vector<BVHBuildPrimitive>& references, const AABBox& box, size_t numBins) {
+    const size_t count = references.size();
+    const float nodeArea = box.surfaceArea();
+    SpatialSplit best;
+    std::vector<SpatialBin> bins(numBins);
+    std::vector<AABBox> rightBoxes(numBins);
+    std::vector<size_t> rightCounts(numBins);
+    for (int a = 0; a < 3; a++) {
+        const float origin = box.cornerDown[a];
+        const float extent = box.cornerUp[a] - origin;
+        if (extent <= 0.0f) continue;
+        const float binSize = extent / numBins;
+        auto binOf = [&](float x) { return std::min((size_t)std::max((x - origin) / binSize, 0.0f), numBins - 1); };
+
+        // 1. Chop every reference into the bins it overlaps
+        std::fill(bins.begin(), bins.end(), SpatialBin());
+        for (const BVHBuildPrimitive& reference : references) {
+            const size_t first = binOf(reference.box.cornerDown[a]);
+            const size_t last = binOf(reference.box.cornerUp[a]);
+            BVHBuildPrimitive remaining = reference;
+            for (size_t b = first; b < last; b++) {
+                AABBox part, rest;
+                splitReference(remaining, a, origin + binSize * (b + 1), part, rest);
+                bins[b].box.extend(part);
+                remaining.box = rest;
+            }
+            bins[last].box.extend(remaining.box);
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        // 2. Sweep the planes between the bins
+        AABBox accumulated;
+        size_t accumulatedCount = 0;
+        for (size_t b = numBins - 1; b > 0; b--) {
+            accumulated.extend(bins[b].box);
+            accumulatedCount += bins[b].exits;
+            rightBoxes[b] = accumulated;
+            rightCounts[b] = accumulatedCount;
+        }
+        accumulated = AABBox();
+        accumulatedCount = 0;
+        for (size_t b = 0; b + 1 < numBins; b++) {
+            accumulated.extend(bins[b].box);
+            accumulatedCount += bins[b].entries;
+            if (accumulatedCount == 0 || rightCounts[b + 1] == 0) continue;
+            if (accumulatedCount == count && rightCounts[b + 1] == count) continue; // No reference would be separated
+            const float cost = BVH::traversalCost + (accumulated.surfaceArea() * BVH::leafCost(accumulatedCount) + rightBoxes[b + 1].surfaceArea() * BVH::leafCost(rightCounts[b + 1])) / nodeArea;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = a;
+                best.position = origin + binSize * (b + 1);
+                best.leftBox = accumulated;
+                best.rightBox = rightBoxes[b + 1];
+                best.leftCount = accumulatedCount;
+                best.rightCount = rightCounts[b + 1];
+            }
+        }
+    }
+    return best;
+}
+
+}
+
+
+struct BVH::SBVHState {
+    std::vector<BVHBuildPrimitive> output; // References of the leaves, in depth-first order
+    float minOverlap;       // Overlap area of the object split children above which spatial splits are tried
+    size_t maxReferences;   // Budget of references, duplicated ones included
+    size_t numOfReferences;
+};
+
+
+void BVH::buildSBVH(std::vector<BVHBuildPrimitive>& buildPrimitives) {
+    // Stich et al., "Spatial Splits in Bounding Volume Hierarchies", HPG 2009. The leaves
+    // reference the triangles again from a new array, in which the triangles split by
+    // spatial splits appear once per leaf they overlap.
+    const size_t count = buildPrimitives.size();
+    AABBox rootBox;
+    for (const BVHBuildPrimitive& primitive : buildPrimitives) rootBox.extend(primitive.box);
+
+    SBVHState state;
+    state.minOverlap = spatialSplitAlpha * rootBox.surfaceArea();
+    state.maxReferences = count + (size_t)(std::max(spatialSplitBudget, 0.0f) * count);
+    state.numOfReferences = count;
+    state.output.reserve(count);
+
+    std::vector<BVHBuildNode> buildNodes;
+    buildNodes.reserve(2 * count);
+    std::vector<BVHBuildPrimitive> references;
+    references.swap(buildPrimitives);
+    const int32_t root = buildSBVHNode(buildNodes, references, state, 0);
+    buildPrimitives.swap(state.output);
+    flatten(buildNodes, root);
+}
+
+
+int32_t BVH::buildSBVHNode(std::vector<BVHBuildNode>& buildNodes, std::vector<BVHBuildPrimitive>& references, SBVHState& state, size_t depth) {
+    const int32_t nodeIndex = (int32_t)buildNodes.size();
+    buildNodes.emplace_back();
+    const size_t count = references.size();
+
+    AABBox box;
+    AABBox centroidBox;
+    for (const BVHBuildPrimitive& reference : references) {
+        box.extend(reference.box);
+        centroidBox.extend(reference.box.center());
+    }
+    buildNodes[nodeIndex].box = box;
+
+    // 1. Object split, as the SAH builder. The references are partitioned around 'mid'.
+    size_t mid = 0;
+    int axis = 0;
+    float objectCost = std::numeric_limits<float>::max();
+    const bool split = splitSAH(references, 0, count, box, centroidBox, mid, axis, &objectCost);
+    if (!split) {
+        buildNodes[nodeIndex].offset = (uint32_t)state.output.size();
+        buildNodes[nodeIndex].count = (uint32_t)count;
+        state.output.insert(state.output.end(), references.begin(), references.end());
+        std::vector<BVHBuildPrimitive>().swap(references);
+        return nodeIndex;
+    }
+
+    // 2. Spatial split, only tried when the children of the object split overlap, and
+    // while references may still be duplicated
+    SpatialSplit spatial;
+    AABBox objectLeft;
+    AABBox objectRight;
+    for (size_t i = 0; i < mid; i++) objectLeft.extend(references[i].box);
+    for (size_t i = mid; i < count; i++) objectRight.extend(references[i].box);
+    AABBox overlap;
+    overlap.cornerDown = glm::max(objectLeft.cornerDown, objectRight.cornerDown);
+    overlap.cornerUp = glm::min(objectLeft.cornerUp, objectRight.cornerUp);
+    const bool overlapping = glm::all(glm::lessThan(overlap.cornerDown, overlap.cornerUp));
+    if (overlapping && overlap.surfaceArea() > state.minOverlap && state.numOfReferences < state.maxReferences && depth < maxSpatialSplitDepth)
+        spatial = findSpatialSplit(references, box, std::max<size_t>(binCount, 2));
+
+    std::vector<BVHBuildPrimitive> left;
+    std::vector<BVHBuildPrimitive> right;
+    size_t numOfDuplicates = 0; // Charged to the budget only when the spatial split is kept
+    if (spatial.axis >= 0 && spatial.cost < objectCost) {
+        // 3. Every reference straddling the plane is either split in two, or kept whole
+        // on one side when that is cheaper ("reference unsplitting")
+        AABBox leftBox = spatial.leftBox;
+        AABBox rightBox = spatial.rightBox;
+        size_t leftCount = spatial.leftCount;
+        size_t rightCount = spatial.rightCount;
+        std::vector<size_t> straddling;
+        for (size_t i = 0; i < count; i++) {
+            const AABBox& referenceBox = references[i].box;
+            if (referenceBox.cornerUp[spatial.axis] <= spatial.position) left.push_back(references[i]);
+            else if (referenceBox.cornerDown[spatial.axis] >= spatial.position) right.push_back(references[i]);
+            else straddling.push_back(i);
+        }
+        for (size_t i : straddling) {
+            BVHBuildPrimitive& reference = references[i];
+            AABBox leftPart, rightPart;
+            splitReference(reference, spatial.axis, spatial.position, leftPart, rightPart);
+            const float splitCost = leftBox.surfaceArea() * leftCount + rightBox.surfaceArea() * rightCount;
+            const float leftOnlyCost = merged(leftBox, reference.box).surfaceArea() * leftCount + rightBox.surfaceArea() * (rightCount - 1);
+            const float rightOnlyCost = leftBox.surfaceArea() * (leftCount - 1) + merged(rightBox, reference.box).surfaceArea() * rightCount;
+            const bool canSplit = state.numOfReferences + numOfDuplicates < state.maxReferences && isValid(leftPart) && isValid(rightPart);
+            if (leftOnlyCost < rightOnlyCost && (leftOnlyCost < splitCost || !canSplit)) {
+                leftBox.extend(reference.box);
+                rightCount--;
+                left.push_back(reference);
+            }
+            else if (rightOnlyCost < splitCost || !canSplit) {
+                rightBox.extend(reference.box);
+                leftCount--;
+                right.push_back(reference);
+            }
+            else {
+                numOfDuplicates++;
+                left.push_back(reference);
+                left.back().box = leftPart;
+                right.push_back(reference);
+                right.back().box = rightPart;
+            }
+        }
+    }
+    if (left.empty() || right.empty()) {
+        left.assign(references.begin(), references.begin() + mid);
+        right.assign(references.begin() + mid, references.end());
+    }
+    else state.numOfReferences += numOfDuplicates;
+    std::vector<BVHBuildPrimitive>().swap(references);
+
+    // 4. Children, the left one first in the output so that the leaves stay in depth-first order
+    buildNodes[nodeIndex].left = buildSBVHNode(buildNodes, left, state, depth + 1);
+    buildNodes[nodeIndex].right = buildSBVHNode(buildNodes, right, state, depth + 1);
+    return nodeIndex;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+// The traversal and intersection kernels are compiled for the widest instruction set
+// enabled for this build, with a scalar fallback for the other targets
+#if defined(__AVX2__)
+#define BVH_SIMD_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_SIMD_SSE
+#include <emmintrin.h>
+#endif
+
+
+/// Number of floats in the SIMD registers the kernels use
+#ifdef BVH_SIMD_AVX2
+constexpr size_t simdWidth = 8;
+#else
+constexpr size_t simdWidth = 4;
+#endif
@@ -0,0 +1,276 @@
+#include "TLAS.h"
+
+#include <cstdio>
+#include <filesystem>
+
+
+void TLAS::init(const std::shared_ptr<Scene> scenePtr) {
+    clear();
+    update(scenePtr);
+}
+
+
+void TLAS::clear() {
+    blases.clear();
+    blasOfMesh.clear();
+    instances.clear();
+    nodes.clear();
+}
+
+
+size_t TLAS::numOfPrimitives() const {
+    size_t count = 0;
+    for (const BVH& blas : blases) count += blas.numOfTriangles();
+    return count;
+}
+
+
+void TLAS::update(const std::shared_ptr<Scene> scenePtr) {
+    // 1. Bottom level: the BVHs of the meshes of the scene are kept, in their order of first
+    // use, those of the meshes seen for the first time built
+    std::vector<BVH> previousBlases = std::move(blases);
+    std::map<std::weak_ptr<Mesh>, size_t, std::owner_less<>> previousBlasOfMesh = std::move(blasOfMesh);
+    blases.clear();
+    blasOfMesh.clear();
+    instances.clear();
+    const size_t numOfObjects = scenePtr->numOfObjects();
+    for (size_t i = 0; i < numOfObjects; i++) {
+        const std::shared_ptr<Mesh> mesh = scenePtr->mesh(scenePtr->objectMesh(i));
+        auto found = blasOfMesh.find(mesh);
+        if (found == blasOfMesh.end()) {
+            const auto previous = previousBlasOfMesh.find(mesh);
+            if (previous != previousBlasOfMesh.end()) {
+                blases.push_back(std::move(previousBlases[previous->second]));
+            } else {
+                blases.emplace_back();
+                blases.back().builder = builder;
+                blases.back().quantizeWideNodes = quantizeNodes;
+                blases.back().optimizeTreelets = optimizeTreelets;
+                buildBLAS(blases.back(), *mesh);
+            }
+            found = blasOfMesh.emplace(mesh, blases.size() - 1).first;
+        }
+        const BVH& blas = blases[found->second];
+        if (blas.empty()) continue;
+
+        // 2. Instances, bounded by their transformed BVH bounds
+        const glm::mat4 objectToWorld = scenePtr->objectTransformMatrix(i);
+        TLASInstance instance;
+        instance.worldToObject = glm::inverse(objectToWorld);
+        instance.identity = (objectToWorld == glm::mat4(1.0f));
+        instance.blas = (uint32_t)found->second;
+        instance.object_index = (uint32_t)i;
+        const AABBox& box = blas.bounds();
+        for (int corner = 0; corner < 8; corner++) {
+            const glm::vec3 p((corner & 1) ? box.cornerUp.x : box.cornerDown.x,
+                              (corner & 2) ? box.cornerUp.y : box.cornerDown.y,
+                              (corner & 4) ? box.cornerUp.z : box.cornerDown.z);
+            instance.box.extend(glm::vec3(objectToWorld * glm::vec4(p, 1.0f)));
+        }
+        instances.push_back(instance);
+    }
+
+    // 3. Top level
+    nodes.clear();
+    if (instances.empty()) return;
+    std::vector<uint32_t> order(instances.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = (uint32_t)i;
+    nodes.reserve(2 * instances.size() - 1);
+    build(order, 0, order.size(), 0);
+}
+
+
+void TLAS::buildBLAS(BVH& blas, const Mesh& mesh) const {
+    if (cacheDirectory.empty() || mesh.triangleIndices().size() < minCachedTriangles) {
+        blas.init(mesh);
+        return;
+    }
+
+    // The file is named after the key, so that the models sharing a directory do not collide
+    const uint64_t key = blas.cacheKey(mesh);
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+    const std::string filename = (std::filesystem::path(cacheDirectory) / name).string();
+    if (blas.load(filename, key)) return;
+    blas.init(mesh);
+    if (!blas.save(filename, key)) std::cerr << "Could not write the BVH cache file " << filename << std::endl;
+}
+
+
+size_t TLAS::refit(const std::shared_ptr<Scene> scenePtr) {
+    size_t numOfRebuilds = 0;
+    // Only the meshes of this scene, each once: the map may still hold meshes it dropped
+    std::vector<bool> refitted(blases.size(), false);
+    for (size_t i = 0; i < scenePtr->numOfObjects(); i++) {
+        const std::shared_ptr<Mesh> mesh = scenePtr->mesh(scenePtr->objectMesh(i));
+        const auto found = blasOfMesh.find(mesh);
+        if (found == blasOfMesh.end() || refitted[found->second]) continue; // New meshes are built by update
+        refitted[found->second] = true;
+        if (blases[found->second].refit(*mesh)) numOfRebuilds++;
+    }
+    update(scenePtr);
+    return numOfRebuilds;
+}
+
+
+void TLAS::sortAlong(std::vector<uint32_t>& order, size_t begin, size_t end, int axis) const {
+    // Ties are broken by index, so the order does not depend on the previous one
+    std::sort(order.begin() + begin, order.begin() + end, [&](uint32_t a, uint32_t b) {
+        const float ca = instances[a].box.center()[axis];
+        const float cb = instances[b].box.center()[axis];
+        return ca < cb || (ca == cb && a < b);
+    });
+}
+
+
+size_t TLAS::build(std::vector<uint32_t>& order, size_t begin, size_t end, size_t depth) {
+    // One instance per leaf
+    const size_t nodeIndex = nodes.size();
+    nodes.emplace_back();
+
+    AABBox box;
+    for (size_t i = begin; i < end; i++) box.extend(instances[order[i]].box);
+    nodes[nodeIndex].box = box;
+
+    if (end - begin == 1) {
+        nodes[nodeIndex].offset = order[begin];
+        nodes[nodeIndex].count = 1;
+        return nodeIndex;
+    }
+
+    // Full sweep SAH: there are few instances, so every centroid ordering is tried. Deep
+    // in the tree, splitting in halves bounds the depth for the traversal stack.
+    const size_t count = end - begin;
+    std::vector<float> rightAreas(count);
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = 0;
+    size_t bestSplit = count / 2; // Number of instances on the left
+    for (int axis = 0; axis < 3 && depth < maxSAHDepth; axis++) {
+        sortAlong(order, begin, end, axis);
+        AABBox accumulated;
+        for (size_t i = count; i-- > 1;) {
+            accumulated.extend(instances[order[begin + i]].box);
+            rightAreas[i] = accumulated.surfaceArea();
+        }
+        accumulated = AABBox();
+        for (size_t i = 1; i < count; i++) {
+            accumulated.extend(instances[order[begin + i - 1]].box);
+            const float cost = accumulated.surfaceArea() * i + rightAreas[i] * (count - i);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+    if (depth >= maxSAHDepth) {
+        const glm::vec3 dims = box.cornerUp - box.cornerDown;
+        bestAxis = (dims.x >= dims.y && dims.x >= dims.z) ? 0 : (dims.y >= dims.z ? 1 : 2);
+    }
+    sortAlong(order, begin, end, bestAxis);
+    const size_t mid = begin + bestSplit;
+    nodes[nodeIndex].axis = (uint8_t)bestAxis;
+
+    build(order, begin, mid, depth + 1);
+    nodes[nodeIndex].offset = (uint32_t)build(order, mid, end, depth + 1);
+    return nodeIndex;
+}
+
+
+bool TLAS::intersect(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const {
+    BVH_COUNT(rays, 1);
+    BVH_COUNT(boxTests, 1);
+    float tmin = 0;
+    if (nodes.empty() || !nodes[0].box.intersect(ray, tmin)) return false;
+
+    std::pair<size_t, float> stack[stackSize];
+    size_t size = 0;
+    stack[size++] = std::make_pair((size_t)0, tmin);
+    bool hit = false;
+    while (size > 0) {
+        const size_t nodeIndex = stack[size - 1].first;
+        const float nodeTmin = stack[--size].second;
+        if (nodeTmin >= rayHit.t) continue; // A closer triangle was found since it was pushed
+
+        const BVHNode& node = nodes[nodeIndex];
+        if (node.isLeaf()) {
+            const TLASInstance& instance = instances[node.offset];
+            size_t object;
+            const BVH& blas = blases[instance.blas];
+            const bool blasHit = instance.identity ? blas.traverse<BVHQuery::Nearest>(rayHit, ray, object, triangle_index) > 0
+                                                   : blas.traverse<BVHQuery::Nearest>(rayHit, instance.toObjectSpace(ray), object, triangle_index) > 0;
+            if (blasHit) {
+                object_index = instance.object_index;
+                hit = true;
+            }
+            continue;
+        }
+
+        // The nearest child is visited first
+        BVH_COUNT(nodesVisited, 1);
+        BVH_COUNT(boxTests, 2);
+        float tminLeft = 0;
+        float tminRight = 0;
+        const bool intersectLeft = nodes[nodeIndex + 1].box.intersect(ray, tminLeft);
+        const bool intersectRight = nodes[node.offset].box.intersect(ray, tminRight);
+        if (intersectLeft && intersectRight && tminLeft < tminRight) {
+            stack[size++] = std::make_pair((size_t)node.offset, tminRight);
+            stack[size++] = std::make_pair(nodeIndex + 1, tminLeft);
+        }
+        else {
+            if (intersectLeft)  stack[size++] = std::make_pair(nodeIndex + 1, tminLeft);
+            if (intersectRight) stack[size++] = std::make_pair((size_t)node.offset, tminRight);
+        }
+    }
+    return hit;
+}
+
+
+template <typename Visit>
+bool TLAS::visitInstances(const Ray& ray, float tmax, Visit visit) const {
+    // Visits the instances whose box the ray enters before tmax, in no particular order,
+    // with the ray in their space. Stops when 'visit' returns true.
+    BVH_COUNT(rays, 1);
+    BVH_COUNT(boxTests, 1);
+    float tmin = 0;
+    if (nodes.empty() || !nodes[0].box.intersect(ray, tmin) || tmin >= tmax) return false;
+
+    size_t stack[stackSize];
+    size_t size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        const size_t nodeIndex = stack[--size];
+        const BVHNode& node = nodes[nodeIndex];
+        if (node.isLeaf()) {
+            const TLASInstance& instance = instances[node.offset];
+            if (visit(blases[instance.blas], instance.identity ? ray : instance.toObjectSpace(ray))) return true;
+            continue;
+        }
+        BVH_COUNT(nodesVisited, 1);
+        BVH_COUNT(boxTests, 2);
+        if (nodes[nodeIndex + 1].box.intersect(ray, tmin) && tmin < tmax) stack[size++] = nodeIndex + 1;
+        if (nodes[node.offset].box.intersect(ray, tmin) && tmin < tmax) stack[size++] = node.offset;
+    }
+    return false;
+}
+
+
+bool TLAS::fastIntersect(const Ray& ray, float tmax) const {
+    return visitInstances(ray, tmax, [&](const BVH& blas, const Ray& instanceRay) {
+        RayHit rayHit(0, 0, 0, tmax);
+        size_t object_index, triangle_index;
+        return blas.traverse<BVHQuery::Any>(rayHit, instanceRay, object_index, triangle_index) > 0;
+    });
+}
+
+
+size_t TLAS::countIntersections(const Ray& ray, float tmax) const {
+    size_t count = 0;
+    visitInstances(ray, tmax, [&](const BVH& blas, const Ray& instanceRay) {
+        RayHit rayHit(0, 0, 0, tmax);
+        size_t object_index, triangle_index;
+        count += blas.traverse<BVHQuery::Count>(rayHit, instanceRay, object_index, triangle_index);
+        return false;
+    });
+    return count;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "BVH.h"
+
+
+/// Placement of a bottom-level BVH in the scene.
+struct TLASInstance {
+    /// The ray in the space of the instance. The direction is not normalized, so the distances
+    /// along the ray are the same in both spaces.
+    inline Ray toObjectSpace(const Ray& ray) const {
+        return Ray(glm::vec3(worldToObject * glm::vec4(ray.origin, 1.0f)),
+                   glm::vec3(worldToObject * glm::vec4(ray.direction, 0.0f)));
+    }
+
+    glm::mat4 worldToObject; // Brings the rays to the space of the bottom-level BVH
+    AABBox box;              // World space bounds
+    uint32_t blas;           // Index in TLAS::blases
+    uint32_t object_index;   // Object of the scene, see Scene::objectMesh
+    bool identity;           // The rays do not need to be transformed
+};
+
+/// Two-level acceleration structure. The bottom level is one BVH per mesh, built in object
+/// space. The top level is a small BVH over the objects of the scene, placed with their world
+/// transforms. Moving or adding objects only rebuilds the top level, and all the instances of
+/// a mesh share its BVH.
+class TLAS {
+
+public:
+    TLAS() {};
+    /// Builds the BVH of every mesh, then the top level
+    void init(const std::shared_ptr<Scene> scenePtr);
+    /// Rebuilds the top level from the current transforms, and the BVH of the new meshes only;
+    /// those of the meshes no longer in the scene are dropped. Meshes are identified by their
+    /// shared pointer, call init when their vertices change.
+    void update(const std::shared_ptr<Scene> scenePtr);
+    /// Refits the BVH of every mesh of the scene to its current vertex positions (see
+    /// BVH::refit), then updates the top level. Returns the number of mesh BVHs which had to be rebuilt.
+    size_t refit(const std::shared_ptr<Scene> scenePtr);
+    void clear();
+
+    bool intersect(RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+    bool fastIntersect(const Ray& ray, float tmax = std::numeric_limits<float>::infinity()) const;
+    size_t countIntersections(const Ray& ray, float tmax = std::numeric_limits<float>::infinity()) const;
+    /// Packet queries, see BVH::intersect(RayPacket&). The rays reaching a transformed instance
+    /// are brought to its space as a packet of their own.
+    void intersect(RayPacket& packet) const;
+    void fastIntersect(RayPacket& packet) const;
+
+    inline bool empty() const { return nodes.empty(); }
+    inline size_t numOfBLAS() const { return blases.size(); }
+    inline size_t numOfInstances() const { return instances.size(); }
+    size_t numOfPrimitives() const;
+
+    // Builder of the bottom-level BVHs
+    BVHBuilder builder = BVHBuilder::SAH;
+    // Whether the bottom-level BVHs quantize their wide nodes, see BVH::quantizeWideNodes
+    bool quantizeNodes = false;
+    // Whether the bottom-level BVHs restructure their treelets, see BVH::optimizeTreelets
+    bool optimizeTreelets = false;
+    // When set, the BVHs of the meshes are loaded from this directory, and saved there after
+    // being built. Files are named after BVH::cacheKey, so edited meshes get a new one.
+    std::string cacheDirectory;
+    // Smaller meshes are built faster than their file is opened
+    static constexpr size_t minCachedTriangles = 4096;
+
+    std::vector<BVH> blases;              // One per mesh
+    std::vector<TLASInstance> instances;  // One per object of the scene with triangles
+    std::vector<BVHNode> nodes;           // Depth-first ordered, a leaf holds the instance of index 'offset'
+
+    // Depth of the SAH splits of the top level, below which the instances are split in halves.
+    // The depth is then at most 80 for 2^32 instances.
+    static constexpr size_t maxSAHDepth = 48;
+    static constexpr size_t stackSize = 96;
+
+private:
+    void buildBLAS(BVH& blas, const Mesh& mesh) const;
+    template <typename Visit>
+    bool visitInstances(const Ray& ray, float tmax, Visit visit) const;
+    template <BVHQuery query>
+    uint64_t traversePacket(RayPacket& packet) const;
+    size_t build(std::vector<uint32_t>& order, size_t begin, size_t end, size_t depth);
+    void sortAlong(std::vector<uint32_t>& order, size_t begin, size_t end, int axis) const;
+
+    // Index in blases of the BVH of each mesh. Weak pointers compared by owner: a mesh
+    // allocated where a freed one was is not mistaken for it, nor kept alive.
+    std::map<std::weak_ptr<Mesh>, size_t, std::owner_less<>> blasOfMesh;
+};
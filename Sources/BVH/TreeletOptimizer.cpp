@@ -0,0 +1,186 @@
+#include "BVH.h"
+#include "Parallel.h"
+
+#include <atomic>
+
+
+namespace {
+
+const size_t maxTreeletLeaves = 7;
+
+// Arrays of the dynamic programming over the subsets of the treelet leaves, one per thread
+struct TreeletScratch {
+    static constexpr size_t numSubsets = (size_t)1 << maxTreeletLeaves;
+    float subsetArea[numSubsets];
+    float subsetCost[numSubsets];
+    uint32_t subsetPartition[numSubsets];
+    AABBox subsetBox[numSubsets];
+    std::vector<int32_t> leaves;
+    std::vector<int32_t> inners;
+};
+
+// Replaces the topology of the treelet rooted at 'treeletRoot' by the one with the lowest SAH
+// cost. 'costs' holds the SAH cost of every subtree below, not normalized by the root area.
+void optimizeTreelet(std::vector<BVHBuildNode>& buildNodes, std::vector<float>& costs, int32_t treeletRoot, TreeletScratch& scratch) {
+    // 1. Grow the treelet by repeatedly opening the leaf with the largest area
+    std::vector<int32_t>& leaves = scratch.leaves;
+    std::vector<int32_t>& inners = scratch.inners;
+    leaves.assign({ buildNodes[treeletRoot].left, buildNodes[treeletRoot].right });
+    inners.clear();
+    while (leaves.size() < maxTreeletLeaves) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (size_t k = 0; k < leaves.size(); k++) {
+            const BVHBuildNode& node = buildNodes[leaves[k]];
+            if (!node.isLeaf() && node.box.surfaceArea() > bestArea) {
+                bestArea = node.box.surfaceArea();
+                best = (int)k;
+            }
+        }
+        if (best < 0) break;
+        const int32_t opened = leaves[best];
+        inners.push_back(opened);
+        leaves[best] = buildNodes[opened].left;
+        leaves.push_back(buildNodes[opened].right);
+    }
+    if (leaves.size() < 3) return; // Only one possible topology
+
+    // 2. Optimal cost of every subset of the treelet leaves
+    float* subsetArea = scratch.subsetArea;
+    float* subsetCost = scratch.subsetCost;
+    uint32_t* subsetPartition = scratch.subsetPartition;
+    AABBox* subsetBox = scratch.subsetBox;
+    const uint32_t n = (uint32_t)leaves.size();
+    const uint32_t full = (1u << n) - 1;
+    for (uint32_t subset = 1; subset <= full; subset++) {
+        AABBox box;
+        for (uint32_t k = 0; k < n; k++)
+            if (subset & (1u << k)) box.extend(buildNodes[leaves[k]].box);
+        subsetBox[subset] = box;
+        subsetArea[subset] = box.surfaceArea();
+    }
+    for (uint32_t k = 0; k < n; k++) subsetCost[1u << k] = costs[leaves[k]];
+    for (uint32_t subset = 1; subset <= full; subset++) {
+        if ((subset & (subset - 1)) == 0) continue; // Single leaf
+        // Only the partitions holding the lowest leaf of the subset, each split is seen once
+        const uint32_t lowest = subset & (~subset + 1);
+        float best = std::numeric_limits<float>::max();
+        uint32_t bestPartition = 0;
+        for (uint32_t part = (subset - 1) & subset; part > 0; part = (part - 1) & subset) {
+            if (!(part & lowest)) continue;
+            float cost = subsetCost[part] + subsetCost[subset ^ part];
+            if (cost < best) {
+                best = cost;
+                bestPartition = part;
+            }
+        }
+        subsetCost[subset] = BVH::traversalCost * subsetArea[subset] + best;
+        subsetPartition[subset] = bestPartition;
+    }
+    if (subsetCost[full] >= costs[treeletRoot] * (1.0f - 1e-5f)) return;
+
+    // 3. Rebuild the treelet, reusing its inner nodes
+    struct Pending { int32_t node; uint32_t subset; };
+    Pending pending[maxTreeletLeaves];
+    size_t numPending = 0;
+    pending[numPending++] = Pending{ treeletRoot, full };
+    size_t nextInner = 0;
+    while (numPending > 0) {
+        const Pending p = pending[--numPending];
+        const uint32_t part = subsetPartition[p.subset];
+        const uint32_t children[2] = { part, p.subset ^ part };
+        int32_t childNodes[2];
+        for (int c = 0; c < 2; c++) {
+            if ((children[c] & (children[c] - 1)) == 0) {
+                uint32_t k = 0;
+                while (!(children[c] & (1u << k))) k++;
+                childNodes[c] = leaves[k];
+            }
+            else {
+                childNodes[c] = inners[nextInner++];
+                pending[numPending++] = Pending{ childNodes[c], children[c] };
+            }
+        }
+        BVHBuildNode& node = buildNodes[p.node];
+        node.left = childNodes[0];
+        node.right = childNodes[1];
+        node.box = subsetBox[p.subset];
+        costs[p.node] = subsetCost[p.subset];
+    }
+}
+
+}
+
+
+void BVH::restructureTreelets(std::vector<BVHBuildNode>& buildNodes, int32_t root) const {
+    // Karras and Aila, "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies", HPG 2013.
+    // Each inner node, bottom-up, is the root of a treelet of up to 7 leaves whose topology
+    // is replaced by the one with the lowest SAH cost, found by dynamic programming. Threads
+    // climb the tree from the leaves, and the second one to reach a node optimizes it, once
+    // both of its subtrees are done. The treelet of a node only holds nodes below it, so the
+    // result does not depend on the order of the threads.
+    if (buildNodes[root].isLeaf()) return;
+    const size_t n = buildNodes.size();
+    std::vector<int32_t> parents(n, -1);
+    std::vector<int32_t> leaves;
+    for (size_t pass = 0; pass < treeletPasses; pass++) {
+        // The parents change with the topology, so they are found again for every pass
+        leaves.clear();
+        std::vector<int32_t> stack(1, root);
+        while (!stack.empty()) {
+            const int32_t index = stack.back();
+            stack.pop_back();
+            const BVHBuildNode& node = buildNodes[index];
+            if (node.isLeaf()) {
+                leaves.push_back(index);
+                continue;
+            }
+            parents[node.left] = index;
+            parents[node.right] = index;
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+        }
+
+        std::vector<float> costs(n, 0.0f);
+        std::unique_ptr<std::atomic<uint32_t>[]> arrivals(new std::atomic<uint32_t>[n]);
+        for (size_t i = 0; i < n; i++) arrivals[i].store(0, std::memory_order_relaxed);
+
+        const size_t numChunks = numOfChunks(leaves.size(), 1024);
+        parallelForChunks(numChunks, [&](size_t c) {
+            std::unique_ptr<TreeletScratch> scratch(new TreeletScratch());
+            const size_t last = chunkBegin(0, leaves.size(), numChunks, c + 1);
+            for (size_t i = chunkBegin(0, leaves.size(), numChunks, c); i < last; i++) {
+                const BVHBuildNode& leaf = buildNodes[leaves[i]];
+                costs[leaves[i]] = leaf.box.surfaceArea() * leafCost(leaf.count);
+                for (int32_t index = parents[leaves[i]]; index >= 0; index = parents[index]) {
+                    // The first thread to arrive stops there, the subtree of the other child is not done yet
+                    if (arrivals[index].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+                    const BVHBuildNode& node = buildNodes[index];
+                    costs[index] = traversalCost * node.box.surfaceArea() + costs[node.left] + costs[node.right];
+                    optimizeTreelet(buildNodes, costs, index, *scratch);
+                }
+            }
+        });
+    }
+}
+
+
+void BVH::restructureTreelets() {
+    // The pass works on explicit children, so the depth-first tree is converted back
+    std::vector<BVHBuildNode> buildNodes(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const BVHNode& node = nodes[i];
+        BVHBuildNode& buildNode = buildNodes[i];
+        buildNode.box = node.box;
+        if (node.isLeaf()) {
+            buildNode.offset = node.offset;
+            buildNode.count = node.count;
+        }
+        else {
+            buildNode.left = (int32_t)i + 1;
+            buildNode.right = (int32_t)node.offset;
+        }
+    }
+    restructureTreelets(buildNodes, 0);
+    flatten(buildNodes, 0);
+}
@@ -0,0 +1,212 @@
+#include "TriangleBlock.h"
+
+#include <cmath>
+#include <limits>
+#include <utility>
+
+
+TriangleBlock::TriangleBlock() {
+    for (int a = 0; a < 3; a++) {
+        for (size_t lane = 0; lane < triangleBlockWidth; lane++) {
+            p0[a][lane] = 0.0f;
+            p1[a][lane] = 0.0f;
+            p2[a][lane] = 0.0f;
+        }
+    }
+    for (size_t lane = 0; lane < triangleBlockWidth; lane++) primitive[lane] = 0;
+}
+
+void TriangleBlock::set(size_t lane, const Triangle& triangle, uint32_t primitiveIndex) {
+    for (int a = 0; a < 3; a++) {
+        p0[a][lane] = triangle.p0[a];
+        p1[a][lane] = triangle.p1[a];
+        p2[a][lane] = triangle.p2[a];
+    }
+    primitive[lane] = primitiveIndex;
+}
+
+
+TriangleRay::TriangleRay(const Ray& ray) {
+    for (int a = 0; a < 3; a++) origin[a] = ray.origin[a];
+
+    // z is the dimension where the direction is the largest, the winding is
+    // preserved by swapping x and y when the direction is negative along z
+    const glm::vec3 d = glm::abs(ray.direction);
+    kz = (d.x > d.y) ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if (ray.direction[kz] < 0.0f) std::swap(kx, ky);
+
+    Sx = ray.direction[kx] / ray.direction[kz];
+    Sy = ray.direction[ky] / ray.direction[kz];
+    Sz = 1.0f / ray.direction[kz];
+}
+
+
+namespace {
+
+// Per lane results of a block test, only meaningful for the lanes that are hit
+struct alignas(32) LaneHits {
+    float U[triangleBlockWidth]; // Unnormalized barycentric coordinates of p0, p1 and p2
+    float V[triangleBlockWidth];
+    float W[triangleBlockWidth];
+    float T[triangleBlockWidth]; // Unnormalized distance
+    float det[triangleBlockWidth];
+};
+
+// Watertight test of every lane. Returns the mask of the front facing triangles hit with
+// 0 <= t < tmax, and fills 'hits' with their coordinates when it is not null.
+inline int testBlock(const TriangleBlock& block, const TriangleRay& ray, float tmax, LaneHits* hits) {
+#if defined(BVH_SIMD_AVX2)
+    const __m256 ox = _mm256_set1_ps(ray.origin[ray.kx]);
+    const __m256 oy = _mm256_set1_ps(ray.origin[ray.ky]);
+    const __m256 oz = _mm256_set1_ps(ray.origin[ray.kz]);
+    const __m256 sx = _mm256_set1_ps(ray.Sx);
+    const __m256 sy = _mm256_set1_ps(ray.Sy);
+    const __m256 sz = _mm256_set1_ps(ray.Sz);
+
+    // Vertices relative to the origin, sheared
+    const __m256 az = _mm256_sub_ps(_mm256_load_ps(block.p0[ray.kz]), oz);
+    const __m256 bz = _mm256_sub_ps(_mm256_load_ps(block.p1[ray.kz]), oz);
+    const __m256 cz = _mm256_sub_ps(_mm256_load_ps(block.p2[ray.kz]), oz);
+    const __m256 ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.p0[ray.kx]), ox), _mm256_mul_ps(sx, az));
+    const __m256 ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.p0[ray.ky]), oy), _mm256_mul_ps(sy, az));
+    const __m256 bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.p1[ray.kx]), ox), _mm256_mul_ps(sx, bz));
+    const __m256 by = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.p1[ray.ky]), oy), _mm256_mul_ps(sy, bz));
+    const __m256 cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.p2[ray.kx]), ox), _mm256_mul_ps(sx, cz));
+    const __m256 cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(block.p2[ray.ky]), oy), _mm256_mul_ps(sy, cz));
+
+    // Scaled barycentric coordinates, all positive for a front facing hit
+    const __m256 U = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+    const __m256 V = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+    const __m256 W = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+    const __m256 det = _mm256_add_ps(_mm256_add_ps(U, V), W);
+    const __m256 T = _mm256_mul_ps(sz, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(U, az), _mm256_mul_ps(V, bz)), _mm256_mul_ps(W, cz)));
+
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(U, zero, _CMP_GE_OQ), _mm256_cmp_ps(V, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(W, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(det, zero, _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(T, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(T, _mm256_mul_ps(_mm256_set1_ps(tmax), det), _CMP_LT_OQ));
+    const int mask = _mm256_movemask_ps(valid);
+
+    if (mask && hits) {
+        _mm256_store_ps(hits->U, U);
+        _mm256_store_ps(hits->V, V);
+        _mm256_store_ps(hits->W, W);
+        _mm256_store_ps(hits->T, T);
+        _mm256_store_ps(hits->det, det);
+    }
+    return mask;
+#elif defined(BVH_SIMD_SSE)
+    const __m128 ox = _mm_set1_ps(ray.origin[ray.kx]);
+    const __m128 oy = _mm_set1_ps(ray.origin[ray.ky]);
+    const __m128 oz = _mm_set1_ps(ray.origin[ray.kz]);
+    const __m128 sx = _mm_set1_ps(ray.Sx);
+    const __m128 sy = _mm_set1_ps(ray.Sy);
+    const __m128 sz = _mm_set1_ps(ray.Sz);
+
+    // Vertices relative to the origin, sheared
+    const __m128 az = _mm_sub_ps(_mm_load_ps(block.p0[ray.kz]), oz);
+    const __m128 bz = _mm_sub_ps(_mm_load_ps(block.p1[ray.kz]), oz);
+    const __m128 cz = _mm_sub_ps(_mm_load_ps(block.p2[ray.kz]), oz);
+    const __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.p0[ray.kx]), ox), _mm_mul_ps(sx, az));
+    const __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.p0[ray.ky]), oy), _mm_mul_ps(sy, az));
+    const __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.p1[ray.kx]), ox), _mm_mul_ps(sx, bz));
+    const __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.p1[ray.ky]), oy), _mm_mul_ps(sy, bz));
+    const __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.p2[ray.kx]), ox), _mm_mul_ps(sx, cz));
+    const __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(block.p2[ray.ky]), oy), _mm_mul_ps(sy, cz));
+
+    // Scaled barycentric coordinates, all positive for a front facing hit
+    const __m128 U = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    const __m128 V = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    const __m128 W = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+    const __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+    const __m128 T = _mm_mul_ps(sz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, az), _mm_mul_ps(V, bz)), _mm_mul_ps(W, cz)));
+
+    const __m128 zero = _mm_setzero_ps();
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(U, zero), _mm_cmpge_ps(V, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(W, zero));
+    valid = _mm_and_ps(valid, _mm_cmpgt_ps(det, zero));
+    valid = _mm_and_ps(valid, _mm_cmpge_ps(T, zero));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(T, _mm_mul_ps(_mm_set1_ps(tmax), det)));
+    const int mask = _mm_movemask_ps(valid);
+
+    if (mask && hits) {
+        _mm_store_ps(hits->U, U);
+        _mm_store_ps(hits->V, V);
+        _mm_store_ps(hits->W, W);
+        _mm_store_ps(hits->T, T);
+        _mm_store_ps(hits->det, det);
+    }
+    return mask;
+#else
+    int mask = 0;
+    for (size_t lane = 0; lane < triangleBlockWidth; lane++) {
+        // Vertices relative to the origin, sheared
+        const float az = block.p0[ray.kz][lane] - ray.origin[ray.kz];
+        const float bz = block.p1[ray.kz][lane] - ray.origin[ray.kz];
+        const float cz = block.p2[ray.kz][lane] - ray.origin[ray.kz];
+        const float ax = block.p0[ray.kx][lane] - ray.origin[ray.kx] - ray.Sx * az;
+        const float ay = block.p0[ray.ky][lane] - ray.origin[ray.ky] - ray.Sy * az;
+        const float bx = block.p1[ray.kx][lane] - ray.origin[ray.kx] - ray.Sx * bz;
+        const float by = block.p1[ray.ky][lane] - ray.origin[ray.ky] - ray.Sy * bz;
+        const float cx = block.p2[ray.kx][lane] - ray.origin[ray.kx] - ray.Sx * cz;
+        const float cy = block.p2[ray.ky][lane] - ray.origin[ray.ky] - ray.Sy * cz;
+
+        // Scaled barycentric coordinates, all positive for a front facing hit
+        const float U = cx * by - cy * bx;
+        const float V = ax * cy - ay * cx;
+        const float W = bx * ay - by * ax;
+        if (U < 0.0f || V < 0.0f || W < 0.0f) continue;
+        const float det = U + V + W;
+        if (det <= 0.0f) continue;
+        const float T = ray.Sz * (U * az + V * bz + W * cz);
+        if (T < 0.0f || !(T < tmax * det)) continue;
+
+        mask |= 1 << lane;
+        if (hits) {
+            hits->U[lane] = U;
+            hits->V[lane] = V;
+            hits->W[lane] = W;
+            hits->T[lane] = T;
+            hits->det[lane] = det;
+        }
+    }
+    return mask;
+#endif
+}
+
+}
+
+
+bool intersect(const TriangleBlock& block, const TriangleRay& ray, RayHit& rayHit, size_t& lane) {
+    LaneHits hits;
+    int mask = testBlock(block, ray, rayHit.t, &hits);
+    if (!mask) return false;
+
+    // Closest of the lanes hit
+    bool hit = false;
+    for (size_t l = 0; mask; l++, mask >>= 1) {
+        if (!(mask & 1)) continue;
+        const float t = hits.T[l] / hits.det[l];
+        if (t >= rayHit.t) continue;
+        const float invDet = 1.0f / hits.det[l];
+        rayHit.b0 = hits.V[l] * invDet;
+        rayHit.b1 = hits.W[l] * invDet;
+        rayHit.b2 = hits.U[l] * invDet;
+        rayHit.t = t;
+        lane = l;
+        hit = true;
+    }
+    return hit;
+}
+
+bool occluded(const TriangleBlock& block, const TriangleRay& ray, float tmax) {
+    return testBlock(block, ray, tmax, nullptr) != 0;
+}
+
+int hitMask(const TriangleBlock& block, const TriangleRay& ray, float tmax) {
+    return testBlock(block, ray, tmax, nullptr);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "../Ray.h"
+#include "../RayHit.h"
+#include "../Triangle.h"
+#include "SIMD.h"
+
+
+/// Number of triangles of a block, intersected at once
+constexpr size_t triangleBlockWidth = simdWidth;
+
+/// Number of blocks needed to store 'count' triangles
+inline size_t numOfTriangleBlocks(size_t count) { return (count + triangleBlockWidth - 1) / triangleBlockWidth; }
+
+/// Triangles of a BVH leaf, stored as a structure of arrays so that the whole block is
+/// intersected at once. Unused lanes hold degenerate triangles, which are never hit.
+struct alignas(32) TriangleBlock {
+    TriangleBlock();
+    void set(size_t lane, const Triangle& triangle, uint32_t primitiveIndex);
+
+    float p0[3][triangleBlockWidth]; // Vertices, one array per coordinate
+    float p1[3][triangleBlockWidth];
+    float p2[3][triangleBlockWidth];
+    uint32_t primitive[triangleBlockWidth]; // Index of the triangle in BVH::primitives
+};
+
+/// Ray prepared for the watertight intersection test of Woop et al., "Watertight Ray/Triangle
+/// Intersection", JCGT 2013. The triangles are translated to the ray origin, the axes are
+/// permuted so that the ray goes along z, then sheared so that it becomes (0, 0, 1). This is
+/// computed once per traversal.
+struct TriangleRay {
+    TriangleRay() {} // Uninitialized, for the arrays of the packet traversal
+    TriangleRay(const Ray& ray);
+
+    float origin[3];
+    int kx, ky, kz; // Permutation of the axes
+    float Sx, Sy, Sz; // Shear
+};
+
+/// Closest front facing triangle of the block with 0 <= t < rayHit.t. On a hit, rayHit is
+/// updated with the same barycentric convention as Ray::intersect and 'lane' is set.
+bool intersect(const TriangleBlock& block, const TriangleRay& ray, RayHit& rayHit, size_t& lane);
+
+/// Whether a front facing triangle of the block is hit with 0 <= t < tmax. With an infinite
+/// tmax, this is Ray::fastIntersect.
+bool occluded(const TriangleBlock& block, const TriangleRay& ray, float tmax);
+
+/// Lanes of the front facing triangles of the block hit with 0 <= t < tmax, one bit per lane
+int hitMask(const TriangleBlock& block, const TriangleRay& ray, float tmax);
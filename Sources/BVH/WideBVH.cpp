@@ -0,0 +1,355 @@
+#include "BVH.h"
+
+#include <cmath>
+#include <cstring>
+
+
+void BVH::buildWideNodes() {
+    // Every wide node replaces a binary subtree: starting from the children of a binary node,
+    // the inner child with the largest area is replaced by its own children until there are
+    // wideNodeWidth of them or only leaves are left. The children keep their left to right order.
+    wideNodes.clear();
+    quantizedNodes.clear();
+    if (!useWideNodes || nodes.empty()) return;
+
+    struct Pending { uint32_t node; int32_t parent; uint32_t slot; size_t depth; };
+    std::vector<Pending> stack(1, Pending{ 0, -1, 0, 1 });
+    std::vector<uint32_t> children;
+    size_t maxDepth = 0;
+    while (!stack.empty()) {
+        const Pending pending = stack.back();
+        stack.pop_back();
+        const uint32_t index = (uint32_t)wideNodes.size();
+        if (pending.parent >= 0) wideNodes[pending.parent].child[pending.slot] = index;
+        maxDepth = std::max(maxDepth, pending.depth);
+
+        children.clear();
+        const BVHNode& node = nodes[pending.node];
+        if (node.isLeaf()) {
+            children.push_back(pending.node); // Root leaf
+        }
+        else {
+            children.push_back(pending.node + 1);
+            children.push_back(node.offset);
+        }
+        while (children.size() < wideNodeWidth) {
+            int best = -1;
+            float bestArea = -1.0f;
+            for (size_t k = 0; k < children.size(); k++) {
+                const BVHNode& child = nodes[children[k]];
+                if (!child.isLeaf() && child.box.surfaceArea() > bestArea) {
+                    bestArea = child.box.surfaceArea();
+                    best = (int)k;
+                }
+            }
+            if (best < 0) break;
+            const uint32_t opened = children[best];
+            children[best] = opened + 1;
+            children.insert(children.begin() + best + 1, nodes[opened].offset);
+        }
+
+        BVHWideNode wideNode;
+        for (size_t k = 0; k < wideNodeWidth; k++) {
+            const AABBox box = (k < children.size()) ? nodes[children[k]].box : AABBox();
+            for (int a = 0; a < 3; a++) {
+                wideNode.bounds[a][k] = box.cornerDown[a];
+                wideNode.bounds[a + 3][k] = box.cornerUp[a];
+            }
+            const bool leaf = k < children.size() && nodes[children[k]].isLeaf();
+            wideNode.child[k] = leaf ? nodes[children[k]].offset : 0;
+            wideNode.count[k] = leaf ? nodes[children[k]].count : 0;
+        }
+        wideNodes.push_back(wideNode);
+
+        // Depth-first order, the leftmost child first
+        for (size_t k = children.size(); k-- > 0;)
+            if (!nodes[children[k]].isLeaf())
+                stack.push_back(Pending{ children[k], (int32_t)index, (uint32_t)k, pending.depth + 1 });
+    }
+
+    // Every level of the traversal leaves at most wideNodeWidth - 1 children on the stack
+    if ((wideNodeWidth - 1) * maxDepth + 1 > wideStackSize) wideNodes.clear();
+    wideNodes.shrink_to_fit();
+    if (quantizeWideNodes && !wideNodes.empty()) buildQuantizedNodes();
+}
+
+
+namespace {
+
+// 2^exponent, built from its bits as the traversal does
+inline float gridSpacing(int exponent) {
+    const uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float spacing;
+    std::memcpy(&spacing, &bits, sizeof(float));
+    return spacing;
+}
+
+inline float decodeBound(float origin, float spacing, uint8_t q) { return origin + (float)q * spacing; }
+
+}
+
+
+void BVH::buildQuantizedNodes() {
+    // Replaces the wide nodes, keeping their order and children
+    quantizedNodes.resize(wideNodes.size());
+    for (size_t i = 0; i < wideNodes.size(); i++) {
+        const BVHWideNode& node = wideNodes[i];
+        BVHQuantizedNode& quantized = quantizedNodes[i];
+        std::memcpy(quantized.child, node.child, sizeof(node.child));
+        std::memcpy(quantized.count, node.count, sizeof(node.count));
+
+        // Unused children have empty bounds, they are quantized to inverted ones
+        bool used[wideNodeWidth];
+        for (size_t k = 0; k < wideNodeWidth; k++) used[k] = node.bounds[0][k] <= node.bounds[3][k];
+
+        for (int a = 0; a < 3; a++) {
+            float lower = std::numeric_limits<float>::max();
+            float upper = -std::numeric_limits<float>::max();
+            for (size_t k = 0; k < wideNodeWidth; k++) {
+                if (!used[k]) continue;
+                lower = std::min(lower, node.bounds[a][k]);
+                upper = std::max(upper, node.bounds[a + 3][k]);
+            }
+            if (lower > upper) lower = upper = 0.0f;
+
+            // The spacing covers the node in 254 steps, one being lost aligning the origin on
+            // the grid. It is at least twice the float spacing of the node coordinates, so that
+            // every grid point is a float and the decoding is exact.
+            int exponent = -126;
+            int magnitudeExponent;
+            const float magnitude = std::max(std::abs(lower), std::abs(upper));
+            if (magnitude > 0.0f) {
+                std::frexp(magnitude, &magnitudeExponent);
+                exponent = std::max(exponent, magnitudeExponent - 23);
+            }
+            int extentExponent;
+            if (upper > lower) {
+                std::frexp((upper - lower) / 254.0f, &extentExponent);
+                exponent = std::max(exponent, extentExponent);
+            }
+            exponent = std::min(exponent, 127);
+            const float spacing = gridSpacing(exponent);
+            const float origin = std::floor(lower / spacing) * spacing;
+            quantized.origin[a] = origin;
+            quantized.exponent[a] = (int8_t)exponent;
+
+            for (size_t k = 0; k < wideNodeWidth; k++) {
+                if (!used[k]) {
+                    quantized.bounds[a][k] = 255;
+                    quantized.bounds[a + 3][k] = 0;
+                    continue;
+                }
+                // Rounded outwards, then checked against the decoded values
+                int lo = (int)std::floor((node.bounds[a][k] - origin) / spacing);
+                int hi = (int)std::ceil((node.bounds[a + 3][k] - origin) / spacing);
+                lo = std::min(std::max(lo, 0), 255);
+                hi = std::min(std::max(hi, 0), 255);
+                while (lo > 0 && decodeBound(origin, spacing, (uint8_t)lo) > node.bounds[a][k]) lo--;
+                while (hi < 255 && decodeBound(origin, spacing, (uint8_t)hi) < node.bounds[a + 3][k]) hi++;
+                quantized.bounds[a][k] = (uint8_t)lo;
+                quantized.bounds[a + 3][k] = (uint8_t)hi;
+            }
+        }
+    }
+    std::vector<BVHWideNode>().swap(wideNodes);
+}
+
+
+namespace {
+
+// Ray prepared for the slab tests: the near plane of each axis is chosen from the sign of
+// the direction once, instead of taking the min and max of both planes for every box
+struct WideRay {
+    WideRay(const Ray& ray) {
+        for (int a = 0; a < 3; a++) {
+            origin[a] = ray.origin[a];
+            invDir[a] = ray.inv_dir[a];
+            nearPlane[a] = (ray.inv_dir[a] < 0.0f) ? a + 3 : a;
+            farPlane[a] = (ray.inv_dir[a] < 0.0f) ? a : a + 3;
+        }
+    }
+
+    float origin[3];
+    float invDir[3];
+    int nearPlane[3]; // Index in BVHWideNode::bounds
+    int farPlane[3];
+};
+
+struct WideStackEntry {
+    uint32_t child;
+    uint16_t count; // Leaf: number of triangles, 0 for a wide node
+    float tmin;     // Entry distance in the child
+};
+
+// Slab test of all the children at once. Returns the mask of the children entered between
+// 0 and tmax, and stores their entry distances in 'tmins'.
+inline int intersectChildren(const BVHWideNode& node, const WideRay& ray, float tmax, float* tmins) {
+#if defined(BVH_SIMD_AVX2)
+    __m256 tnear = _mm256_setzero_ps();
+    __m256 tfar = _mm256_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const __m256 origin = _mm256_set1_ps(ray.origin[a]);
+        const __m256 invDir = _mm256_set1_ps(ray.invDir[a]);
+        tnear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.nearPlane[a]]), origin), invDir), tnear);
+        tfar  = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[ray.farPlane[a]]),  origin), invDir), tfar);
+    }
+    _mm256_store_ps(tmins, tnear);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+#elif defined(BVH_SIMD_SSE)
+    __m128 tnear = _mm_setzero_ps();
+    __m128 tfar = _mm_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const __m128 origin = _mm_set1_ps(ray.origin[a]);
+        const __m128 invDir = _mm_set1_ps(ray.invDir[a]);
+        tnear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.nearPlane[a]]), origin), invDir), tnear);
+        tfar  = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[ray.farPlane[a]]),  origin), invDir), tfar);
+    }
+    _mm_store_ps(tmins, tnear);
+    return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+#else
+    int mask = 0;
+    for (size_t k = 0; k < wideNodeWidth; k++) {
+        float tnear = 0.0f;
+        float tfar = tmax;
+        for (int a = 0; a < 3; a++) {
+            tnear = std::max((node.bounds[ray.nearPlane[a]][k] - ray.origin[a]) * ray.invDir[a], tnear);
+            tfar  = std::min((node.bounds[ray.farPlane[a]][k]  - ray.origin[a]) * ray.invDir[a], tfar);
+        }
+        tmins[k] = tnear;
+        if (tnear <= tfar) mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
+
+// Same for a quantized node, whose bounds are decoded first. The decoding is exact, so
+// the boxes tested are the quantized ones, which contain the children.
+inline int intersectChildren(const BVHQuantizedNode& node, const WideRay& ray, float tmax, float* tmins) {
+#if defined(BVH_SIMD_AVX2)
+    __m256 tnear = _mm256_setzero_ps();
+    __m256 tfar = _mm256_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const __m256 gridOrigin = _mm256_set1_ps(node.origin[a]);
+        const __m256 spacing = _mm256_castsi256_ps(_mm256_set1_epi32((node.exponent[a] + 127) << 23));
+        const __m256 nearBound = _mm256_add_ps(gridOrigin, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)node.bounds[ray.nearPlane[a]]))), spacing));
+        const __m256 farBound  = _mm256_add_ps(gridOrigin, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)node.bounds[ray.farPlane[a]]))), spacing));
+        const __m256 origin = _mm256_set1_ps(ray.origin[a]);
+        const __m256 invDir = _mm256_set1_ps(ray.invDir[a]);
+        tnear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearBound, origin), invDir), tnear);
+        tfar  = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farBound,  origin), invDir), tfar);
+    }
+    _mm256_store_ps(tmins, tnear);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+#elif defined(BVH_SIMD_SSE)
+    // SSE2 has no byte to int conversion, the bytes are widened by interleaving with zeros
+    const __m128i zero = _mm_setzero_si128();
+    auto load = [&](const uint8_t* bytes) {
+        int32_t packed;
+        std::memcpy(&packed, bytes, sizeof(packed));
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero));
+    };
+    __m128 tnear = _mm_setzero_ps();
+    __m128 tfar = _mm_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const __m128 gridOrigin = _mm_set1_ps(node.origin[a]);
+        const __m128 spacing = _mm_castsi128_ps(_mm_set1_epi32((node.exponent[a] + 127) << 23));
+        const __m128 nearBound = _mm_add_ps(gridOrigin, _mm_mul_ps(load(node.bounds[ray.nearPlane[a]]), spacing));
+        const __m128 farBound  = _mm_add_ps(gridOrigin, _mm_mul_ps(load(node.bounds[ray.farPlane[a]]), spacing));
+        const __m128 origin = _mm_set1_ps(ray.origin[a]);
+        const __m128 invDir = _mm_set1_ps(ray.invDir[a]);
+        tnear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearBound, origin), invDir), tnear);
+        tfar  = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farBound,  origin), invDir), tfar);
+    }
+    _mm_store_ps(tmins, tnear);
+    return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+#else
+    int mask = 0;
+    for (size_t k = 0; k < wideNodeWidth; k++) {
+        float tnear = 0.0f;
+        float tfar = tmax;
+        for (int a = 0; a < 3; a++) {
+            const float spacing = gridSpacing(node.exponent[a]);
+            const float nearBound = decodeBound(node.origin[a], spacing, node.bounds[ray.nearPlane[a]][k]);
+            const float farBound = decodeBound(node.origin[a], spacing, node.bounds[ray.farPlane[a]][k]);
+            tnear = std::max((nearBound - ray.origin[a]) * ray.invDir[a], tnear);
+            tfar  = std::min((farBound  - ray.origin[a]) * ray.invDir[a], tfar);
+        }
+        tmins[k] = tnear;
+        if (tnear <= tfar) mask |= 1 << k;
+    }
+    return mask;
+#endif
+}
+
+}
+
+
+template <BVHQuery query, typename WideNode>
+size_t BVH::traverseWide(const WideNode* wideNodeArray, RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const {
+    const WideRay wideRay(ray);
+    const TriangleRay triangleRay(ray);
+    const TriangleBlock* blockArray = blockData();
+    alignas(32) float tmins[wideNodeWidth];
+    WideStackEntry stack[wideStackSize];
+    size_t stackSize = 0;
+    stack[stackSize++] = WideStackEntry{ 0, 0, 0.0f };
+
+    size_t hits = 0;
+    std::vector<uint64_t> hitTriangles;
+    while (stackSize > 0) {
+        const WideStackEntry entry = stack[--stackSize];
+        if (entry.tmin >= rayHit.t) continue; // A closer triangle was found since it was pushed
+
+        if (entry.count > 0) {
+            BVH_COUNT(triangleTests, entry.count);
+            const size_t lastBlock = entry.child + numOfTriangleBlocks(entry.count);
+            for (size_t b = entry.child; b < lastBlock; b++) {
+                if (query == BVHQuery::Nearest) {
+                    size_t lane;
+                    if (::intersect(blockArray[b], triangleRay, rayHit, lane)) {
+                        const BVHPrimitive& primitive = primitiveData()[blockArray[b].primitive[lane]];
+                        object_index = primitive.object_index;
+                        triangle_index = primitive.triangle_index;
+                        hits = 1;
+                    }
+                }
+                else if (query == BVHQuery::Any) {
+                    if (occluded(blockArray[b], triangleRay, rayHit.t)) return 1;
+                }
+                else {
+                    countHits(blockArray[b], triangleRay, rayHit.t, hits, hitTriangles);
+                }
+            }
+            continue;
+        }
+
+        const WideNode& node = wideNodeArray[entry.child];
+        BVH_COUNT(nodesVisited, 1);
+        BVH_COUNT(boxTests, wideNodeWidth);
+        int mask = intersectChildren(node, wideRay, rayHit.t, tmins);
+        if (query != BVHQuery::Nearest) {
+            // Every child entered is visited whatever the order, so they are not sorted
+            for (size_t k = 0; mask; k++, mask >>= 1)
+                if (mask & 1) stack[stackSize++] = WideStackEntry{ node.child[k], node.count[k], tmins[k] };
+            continue;
+        }
+
+        // Push the children entered sorted by distance, the nearest one on top
+        const size_t first = stackSize;
+        for (size_t k = 0; mask; k++, mask >>= 1) {
+            if (!(mask & 1)) continue;
+            const WideStackEntry child{ node.child[k], node.count[k], tmins[k] };
+            size_t j = stackSize++;
+            for (; j > first && stack[j - 1].tmin < child.tmin; j--) stack[j] = stack[j - 1];
+            stack[j] = child;
+        }
+    }
+    return hits + countDistinct(hitTriangles);
+}
+
+template size_t BVH::traverseWide<BVHQuery::Nearest, BVHWideNode>(const BVHWideNode* wideNodeArray, RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+template size_t BVH::traverseWide<BVHQuery::Nearest, BVHQuantizedNode>(const BVHQuantizedNode* wideNodeArray, RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+template size_t BVH::traverseWide<BVHQuery::Any, BVHWideNode>(const BVHWideNode* wideNodeArray, RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+template size_t BVH::traverseWide<BVHQuery::Any, BVHQuantizedNode>(const BVHQuantizedNode* wideNodeArray, RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+template size_t BVH::traverseWide<BVHQuery::Count, BVHWideNode>(const BVHWideNode* wideNodeArray, RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
+template size_t BVH::traverseWide<BVHQuery::Count, BVHQuantizedNode>(const BVHQuantizedNode* wideNodeArray, RayHit& rayHit, const Ray& ray, size_t& object_index, size_t& triangle_index) const;
@@ -0,0 +1,282 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+
+// Headless ray tracer: renders the scene of MyRenderer from a list of camera poses and
+// writes the images to disk, without any window or OpenGL context.
+
+#define _USE_MATH_DEFINES
+
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <memory>
+#include <chrono>
+#include <future>
+#include <exception>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "Console.h"
+#include "SceneLoader.h"
+#include "Scene.h"
+#include "Image.h"
+#include "RayTracer.h"
+
+using namespace std;
+
+/// Camera pose, as set with the mouse in MyRenderer: the translation of the camera, then its
+/// rotation around the origin, in radians
+struct CameraPose {
+	glm::vec3 translation;
+	glm::vec3 rotation;
+};
+
+static std::string meshFilename;
+static std::string outputFilename;
+static int width = 1024;
+static int height = 768;
+static std::vector<CameraPose> poses;
+static size_t numOfOrbitPoses = 0;
+static bool writeAOVs = false;
+
+void usage (const char * command) {
+	Console::print (std::string ("Usage : ") + command + " <meshfile.off> [options]\n"
+		+ "\t-o <file.ppm>: output image, a %d in its name is replaced by the pose index, otherwise added before the extension with several poses (default: render.ppm)\n"
+		+ "\t-r <width>x<height>: resolution (default: 1024x768)\n"
+		+ "\t-c <tx> <ty> <tz> <rx> <ry> <rz>: camera pose, its translation then its rotation around the origin in degrees, as set with the mouse in MyRenderer. Repeat for several images (default: the initial pose of MyRenderer)\n"
+		+ "\t-p <file>: camera poses, one <tx> <ty> <tz> <rx> <ry> <rz> per line\n"
+		+ "\t--orbit <n>: n poses turning around the vertical axis from the initial pose of MyRenderer\n"
+		+ "\t--spp <n>: n samples per pixel, jittered over the pixel (default: 1, at the pixel center)\n"
+		+ "\t--aa <n>: n x n samples per pixel, in a grid\n"
+		+ "\t--adaptive <min> <max> [<threshold>]: adaptive anti-aliasing, from min to max samples per pixel\n"
+		+ "\t--sampler <pcg|sobol|bluenoise>: sampler of the anti-aliasing and light samples (default: sobol)\n"
+		+ "\t--seed <n>: seed of the sampler\n"
+		+ "\t--light-samples <n>: point lights sampled per shading point\n"
+		+ "\t--occlusion: trace the shadow rays\n"
+		+ "\t--builder <median|sah|sbvh|lbvh>: BVH builder (default: sah)\n"
+		+ "\t--path-tracing [<max depth>]: path tracing, with the background as a sky light\n"
+		+ "\t--aovs: also write the albedo, normal and depth images, with _albedo, _normal and _depth added before the extension\n"
+		+ "\t--denoise [<passes>]: denoise the images with their albedo, normals and depth (default: 5 passes, at most " + std::to_string (Denoiser::maxNumOfPasses) + ")\n"
+		+ "\t--no-packets: trace the rays one at a time\n"
+		+ "\t--wavefront: wavefront ray tracing\n");
+	std::exit (EXIT_FAILURE);
+}
+
+void exitOnError (const std::string & message) {
+	Console::print ("[Error] " + message);
+	std::exit (EXIT_FAILURE);
+}
+
+CameraPose parsePose (const std::string & text) {
+	std::istringstream in (text);
+	CameraPose pose;
+	glm::vec3 rotationInDegrees;
+	if (!(in >> pose.translation[0] >> pose.translation[1] >> pose.translation[2] >> rotationInDegrees[0] >> rotationInDegrees[1] >> rotationInDegrees[2]))
+		exitOnError ("Invalid camera pose <" + text + ">");
+	pose.rotation = glm::radians (rotationInDegrees);
+	return pose;
+}
+
+void loadPoses (const std::string & filename) {
+	std::ifstream in (filename.c_str ());
+	if (!in)
+		exitOnError ("Cannot open " + filename);
+	std::string line;
+	while (std::getline (in, line)) {
+		if (line.find_first_not_of (" \t\r") == std::string::npos || line[line.find_first_not_of (" \t\r")] == '#')
+			continue; // Empty line or comment
+		poses.push_back (parsePose (line));
+	}
+}
+
+void parseCommandLine (int argc, char ** argv, RayTracer & rayTracer) {
+	if (argc < 2 || argv[1][0] == '-')
+		usage (argv[0]);
+	meshFilename = argv[1];
+	int i = 2;
+	// Next argument, as an option value
+	auto next = [&] () -> std::string {
+		if (i >= argc)
+			usage (argv[0]);
+		return argv[i++];
+	};
+	auto nextInt = [&] () {
+		const std::string value = next ();
+		char * end = nullptr;
+		const long n = std::strtol (value.c_str (), &end, 10);
+		if (*end != '\0' || n < 0)
+			exitOnError ("Invalid number <" + value + ">");
+		return (int)n;
+	};
+	while (i < argc) {
+		const std::string option = argv[i++];
+		if (option == "-o") {
+			outputFilename = next ();
+		} else if (option == "-r") {
+			const std::string resolution = next ();
+			if (std::sscanf (resolution.c_str (), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0)
+				exitOnError ("Invalid resolution <" + resolution + ">");
+		} else if (option == "-c") {
+			std::string pose;
+			for (int k = 0; k < 6; k++)
+				pose += next () + " ";
+			poses.push_back (parsePose (pose));
+		} else if (option == "-p") {
+			loadPoses (next ());
+		} else if (option == "--orbit") {
+			numOfOrbitPoses = nextInt ();
+		} else if (option == "--spp") {
+			rayTracer.progressive = true;
+			rayTracer.progressiveSamples = std::max (1, nextInt ());
+		} else if (option == "--aa") {
+			rayTracer.alias_number = std::max (1, nextInt ());
+		} else if (option == "--adaptive") {
+			rayTracer.adaptiveAA = true;
+			rayTracer.adaptiveMinSamples = nextInt ();
+			rayTracer.adaptiveMaxSamples = nextInt ();
+			if (i < argc && argv[i][0] != '-')
+				rayTracer.adaptiveThreshold = std::stof (next ());
+		} else if (option == "--sampler") {
+			const std::string sampler = next ();
+			if (sampler == "pcg") rayTracer.samplerType = SamplerType::PCG;
+			else if (sampler == "sobol") rayTracer.samplerType = SamplerType::Sobol;
+			else if (sampler == "bluenoise") rayTracer.samplerType = SamplerType::BlueNoise;
+			else exitOnError ("Unknown sampler <" + sampler + ">");
+		} else if (option == "--seed") {
+			rayTracer.samplerSeed = (uint32_t)nextInt ();
+		} else if (option == "--light-samples") {
+			rayTracer.pointLightSamples = nextInt ();
+		} else if (option == "--occlusion") {
+			rayTracer.useOcclusion = true;
+		} else if (option == "--builder") {
+			const std::string builder = next ();
+			if (builder == "median") rayTracer.bvhBuilder = BVHBuilder::Median;
+			else if (builder == "sah") rayTracer.bvhBuilder = BVHBuilder::SAH;
+			else if (builder == "sbvh") rayTracer.bvhBuilder = BVHBuilder::SBVH;
+			else if (builder == "lbvh") rayTracer.bvhBuilder = BVHBuilder::LBVH;
+			else exitOnError ("Unknown builder <" + builder + ">");
+		} else if (option == "--path-tracing") {
+			rayTracer.pathTracing = true;
+			if (i < argc && argv[i][0] != '-')
+				rayTracer.maxPathDepth = std::max (1, nextInt ());
+		} else if (option == "--aovs") {
+			writeAOVs = true;
+			rayTracer.outputAOVs = true;
+		} else if (option == "--denoise") {
+			rayTracer.denoise = true;
+			if (i < argc && argv[i][0] != '-') {
+				rayTracer.denoiserPasses = nextInt ();
+				if (rayTracer.denoiserPasses > Denoiser::maxNumOfPasses)
+					exitOnError ("At most " + std::to_string (Denoiser::maxNumOfPasses) + " denoising passes");
+			}
+		} else if (option == "--no-packets") {
+			rayTracer.usePackets = false;
+		} else if (option == "--wavefront") {
+			rayTracer.useWavefront = true;
+		} else {
+			usage (argv[0]);
+		}
+	}
+}
+
+/// 'filename' with 'suffix' added before the extension
+std::string withSuffix (const std::string & filename, const std::string & suffix) {
+	fs::path path (filename);
+	path.replace_filename (path.stem ().string () + suffix + path.extension ().string ());
+	return path.string ();
+}
+
+/// Name of the image of the pose 'index' out of 'numOfPoses'
+std::string imageFilename (size_t index, size_t numOfPoses) {
+	std::string filename = outputFilename.empty () ? "render.ppm" : outputFilename;
+	const size_t position = filename.find ("%d");
+	if (position != std::string::npos) {
+		filename.replace (position, 2, std::to_string (index));
+	} else if (numOfPoses > 1) { // The index goes before the extension
+		filename = withSuffix (filename, "_" + std::to_string (index));
+	}
+	return filename;
+}
+
+/// Writes the AOVs of the render next to its image, brought to [0, 1]: the normals from
+/// [-1, 1], the depths over the largest one
+void saveAOVs (Image albedo, Image normal, Image depth, const std::string & filename) {
+	albedo.savePPM (withSuffix (filename, "_albedo"));
+	for (size_t i = 0; i < normal.width () * normal.height (); i++)
+		normal[i] = 0.5f * normal[i] + glm::vec3 (0.5f);
+	normal.savePPM (withSuffix (filename, "_normal"));
+	float maxDepth = 0.f;
+	for (size_t i = 0; i < depth.width () * depth.height (); i++)
+		maxDepth = std::max (maxDepth, depth[i][0]);
+	if (maxDepth > 0.f)
+		for (size_t i = 0; i < depth.width () * depth.height (); i++)
+			depth[i] /= maxDepth;
+	depth.savePPM (withSuffix (filename, "_depth"));
+}
+
+int main (int argc, char ** argv) {
+	auto rayTracerPtr = make_shared<RayTracer> ();
+	parseCommandLine (argc, argv, *rayTracerPtr);
+
+	glm::vec3 center;
+	float meshScale;
+	std::shared_ptr<Scene> scenePtr;
+	try {
+		scenePtr = SceneLoader::loadDefault (meshFilename, static_cast<float>(width) / static_cast<float>(height), center, meshScale);
+	} catch (std::exception & e) {
+		exitOnError (std::string ("[Error loading mesh]") + e.what ());
+	}
+	const std::shared_ptr<Camera> cameraPtr = scenePtr->camera ();
+	const CameraPose initialPose = { cameraPtr->getTranslation (), cameraPtr->getRotation () };
+	for (size_t k = 0; k < numOfOrbitPoses; k++)
+		poses.push_back (CameraPose { initialPose.translation, initialPose.rotation + glm::vec3 (0.f, 2.f * (float)M_PI * k / numOfOrbitPoses, 0.f) });
+	if (poses.empty ())
+		poses.push_back (initialPose);
+
+	rayTracerPtr->bvhCacheDirectory = fs::absolute (meshFilename).parent_path ().string (); // Next to the model, also for a bare file name
+	rayTracerPtr->init (scenePtr);
+	rayTracerPtr->setResolution (width, height);
+
+	// An image is written while the next one renders, the render threads keeping every core
+	// busy. The ray tracer reuses its image, so the written one is a copy.
+	std::future<void> writing;
+	std::chrono::high_resolution_clock clock;
+	std::chrono::time_point<std::chrono::high_resolution_clock> before = clock.now ();
+	for (size_t k = 0; k < poses.size (); k++) {
+		cameraPtr->setTranslation (poses[k].translation);
+		cameraPtr->setRotation (poses[k].rotation);
+		rayTracerPtr->resetAccumulation (); // The --spp samples of a pose are not added to those of the previous one
+		rayTracerPtr->render (scenePtr);
+		if (writing.valid ())
+			writing.get ();
+		const std::string filename = imageFilename (k, poses.size ());
+		if (writeAOVs)
+			writing = std::async (std::launch::async, [image = *rayTracerPtr->image (), albedo = *rayTracerPtr->albedoImage (), normal = *rayTracerPtr->normalImage (), depth = *rayTracerPtr->depthImage (), filename] () mutable {
+				image.savePPM (filename);
+				saveAOVs (albedo, normal, depth, filename);
+			});
+		else
+			writing = std::async (std::launch::async, [image = *rayTracerPtr->image (), filename] () mutable { image.savePPM (filename); });
+		Console::print ("Pose " + std::to_string (k + 1) + "/" + std::to_string (poses.size ()) + " -> " + filename);
+	}
+	if (writing.valid ())
+		writing.get ();
+	double elapsedTime = (double)std::chrono::duration_cast<std::chrono::milliseconds> (clock.now () - before).count ();
+	Console::print (std::to_string (poses.size ()) + " images rendered in " + std::to_string (elapsedTime) + "ms");
+	return EXIT_SUCCESS;
+}
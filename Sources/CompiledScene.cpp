@@ -0,0 +1,123 @@
+#include "CompiledScene.h"
+
+#include <algorithm>
+
+#include "BVH/Parallel.h"
+
+
+void CompiledScene::compile (const Scene& scene) {
+	const size_t numOfMeshes = scene.numOfMeshes ();
+	m_meshFirstTriangle.resize (numOfMeshes + 1);
+	m_meshFirstVertex.resize (numOfMeshes + 1);
+	size_t numOfVertices = 0, numOfTriangles = 0;
+	for (size_t m = 0; m < numOfMeshes; m++) {
+		const Mesh& mesh = *scene.mesh (m);
+		m_meshFirstTriangle[m] = (uint32_t)numOfTriangles;
+		m_meshFirstVertex[m] = (uint32_t)numOfVertices;
+		numOfTriangles += mesh.triangleIndices ().size ();
+		numOfVertices += mesh.vertexPositions ().size ();
+	}
+	m_meshFirstTriangle[numOfMeshes] = (uint32_t)numOfTriangles;
+	m_meshFirstVertex[numOfMeshes] = (uint32_t)numOfVertices;
+	m_positionsX.resize (numOfVertices);
+	m_positionsY.resize (numOfVertices);
+	m_positionsZ.resize (numOfVertices);
+	m_normalsX.resize (numOfVertices);
+	m_normalsY.resize (numOfVertices);
+	m_normalsZ.resize (numOfVertices);
+	m_triangles.resize (numOfTriangles);
+
+	for (size_t m = 0; m < numOfMeshes; m++) {
+		const Mesh& mesh = *scene.mesh (m);
+		const std::vector<glm::uvec3>& triangleIndices = mesh.triangleIndices ();
+		const std::vector<glm::vec3>& vertexPositions = mesh.vertexPositions ();
+		const std::vector<glm::vec3>& vertexNormals = mesh.vertexNormals ();
+		const glm::uvec3 firstVertex (m_meshFirstVertex[m]);
+		const size_t numChunks = numOfChunks (std::max (triangleIndices.size (), vertexPositions.size ()), 4096);
+		parallelForChunks (numChunks, [&] (size_t chunk) {
+			const size_t endTriangle = chunkBegin (0, triangleIndices.size (), numChunks, chunk + 1);
+			for (size_t t = chunkBegin (0, triangleIndices.size (), numChunks, chunk); t < endTriangle; t++)
+				m_triangles[m_meshFirstTriangle[m] + t] = triangleIndices[t] + firstVertex;
+			const size_t endVertex = chunkBegin (0, vertexPositions.size (), numChunks, chunk + 1);
+			for (size_t v = chunkBegin (0, vertexPositions.size (), numChunks, chunk); v < endVertex; v++) {
+				const size_t i = firstVertex.x + v;
+				m_positionsX[i] = vertexPositions[v].x;
+				m_positionsY[i] = vertexPositions[v].y;
+				m_positionsZ[i] = vertexPositions[v].z;
+				const glm::vec3 n = v < vertexNormals.size () ? vertexNormals[v] : glm::vec3 (0.0f);
+				m_normalsX[i] = n.x;
+				m_normalsY[i] = n.y;
+				m_normalsZ[i] = n.z;
+			}
+		});
+	}
+
+	compileMaterialsAndLights (scene);
+	m_objects.clear ();
+	compileObjects (scene);
+}
+
+void CompiledScene::update (const Scene& scene) {
+	// Compiled again when the meshes or their sizes changed
+	bool sameMeshes = scene.numOfMeshes () + 1 == m_meshFirstTriangle.size ();
+	for (size_t m = 0; sameMeshes && m < scene.numOfMeshes (); m++) {
+		const Mesh& mesh = *scene.mesh (m);
+		sameMeshes = mesh.triangleIndices ().size () == m_meshFirstTriangle[m + 1] - m_meshFirstTriangle[m]
+			&& mesh.vertexPositions ().size () == m_meshFirstVertex[m + 1] - m_meshFirstVertex[m];
+	}
+	if (!sameMeshes) {
+		compile (scene);
+		return;
+	}
+	compileMaterialsAndLights (scene);
+	compileObjects (scene);
+}
+
+void CompiledScene::clear () {
+	m_positionsX.clear ();
+	m_positionsY.clear ();
+	m_positionsZ.clear ();
+	m_normalsX.clear ();
+	m_normalsY.clear ();
+	m_normalsZ.clear ();
+	m_triangles.clear ();
+	m_meshFirstTriangle.clear ();
+	m_meshFirstVertex.clear ();
+	m_objects.clear ();
+	m_materials.clear ();
+	m_lightSourcesDir.clear ();
+	m_lightSourcesPoint.clear ();
+}
+
+void CompiledScene::compileMaterialsAndLights (const Scene& scene) {
+	m_materials.clear ();
+	for (size_t i = 0; i < scene.numOfMaterials (); i++)
+		m_materials.push_back (*scene.material (i));
+	if (m_materials.empty ())
+		m_materials.push_back (Material ()); // The material of the meshes without one
+	m_lightSourcesDir.clear ();
+	for (size_t i = 0; i < scene.numOfLightSourcesDir (); i++)
+		m_lightSourcesDir.push_back (*scene.lightSourceDir (i));
+	m_lightSourcesPoint.clear ();
+	for (size_t i = 0; i < scene.numOflightSourcesPoint (); i++)
+		m_lightSourcesPoint.push_back (*scene.lightSourcePoint (i));
+	m_backgroundColor = scene.backgroundColor ();
+}
+
+void CompiledScene::compileObjects (const Scene& scene) {
+	const size_t numOfObjects = scene.numOfObjects ();
+	const size_t numOfCompiledObjects = std::min (m_objects.size (), numOfObjects);
+	m_objects.resize (numOfObjects);
+	for (size_t o = 0; o < numOfObjects; o++) {
+		Object& object = m_objects[o];
+		object.mesh = (uint32_t)scene.objectMesh (o);
+		object.material = (uint32_t)std::min (scene.getMaterialOfMesh (object.mesh), m_materials.size () - 1);
+		// The matrices are only inverted again for the objects that moved
+		const glm::mat4 objectToWorld = scene.objectTransformMatrix (o);
+		if (o < numOfCompiledObjects && objectToWorld == object.objectToWorld) continue;
+		object.objectToWorld = objectToWorld;
+		object.worldToObject = glm::inverse (objectToWorld);
+		object.normalMatrix = glm::transpose (glm::inverse (glm::mat3 (objectToWorld)));
+		object.identity = (objectToWorld == glm::mat4 (1.0f));
+	}
+}
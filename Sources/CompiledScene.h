@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Scene.h"
+#include "Ray.h"
+#include "RayHit.h"
+#include "Material.h"
+#include "Light/LightSourceDir.h"
+#include "Light/LightSourcePoint.h"
+
+
+/// Immutable, flat snapshot of what tracing and shading a ray read from the scene: the
+/// vertices of every mesh in object space, as a structure of arrays, and its triangles, the
+/// objects with their transforms and material, a dense table of the materials and the
+/// lights, all by value. The hot path only indexes into these arrays, instead of following
+/// the shared pointers of the meshes, materials and lights, looking up the material of each
+/// mesh in a hash map and computing the matrices of every object.
+/// As in the TLAS, a mesh is stored once however many objects place it: a hit is brought to
+/// world space by the matrices of its object, a product per hit. Triangles are numbered as
+/// in the BVHs, the triangle t of an object being the triangle t of its mesh.
+class CompiledScene {
+public:
+	/// Compiles the whole scene, with the current transforms of its objects
+	void compile (const Scene& scene);
+	/// Brings the snapshot up to the scene: the objects, their transforms and materials, the
+	/// materials and lights are copied again. The meshes are assumed unchanged unless meshes
+	/// were added or their sizes changed, in which case everything is compiled again.
+	void update (const Scene& scene);
+	void clear ();
+
+	inline bool empty () const { return m_objects.empty (); }
+	inline size_t numOfObjects () const { return m_objects.size (); }
+	inline size_t numOfTriangles (size_t object_index) const { const uint32_t mesh = m_objects[object_index].mesh; return m_meshFirstTriangle[mesh + 1] - m_meshFirstTriangle[mesh]; }
+
+	/// Triangle 'triangle_index' of the object 'object_index', as indices of object space vertices
+	inline const glm::uvec3 & triangle (size_t object_index, size_t triangle_index) const { return m_triangles[m_meshFirstTriangle[m_objects[object_index].mesh] + triangle_index]; }
+	inline glm::vec3 position (uint32_t vertex) const { return glm::vec3 (m_positionsX[vertex], m_positionsY[vertex], m_positionsZ[vertex]); }
+	inline glm::vec3 normal (uint32_t vertex) const { return glm::vec3 (m_normalsX[vertex], m_normalsY[vertex], m_normalsZ[vertex]); }
+	/// The ray in the space of the object. The direction is not normalized, so the distances
+	/// along the ray are the same in both spaces.
+	inline Ray toObjectSpace (const Ray & ray, size_t object_index) const {
+		const Object & object = m_objects[object_index];
+		if (object.identity) return ray;
+		return Ray (glm::vec3 (object.worldToObject * glm::vec4 (ray.origin, 1.0f)), glm::vec3 (object.worldToObject * glm::vec4 (ray.direction, 0.0f)));
+	}
+	/// World space position of a hit of the triangle 'triangle_index' of the object 'object_index'
+	inline glm::vec3 hitPosition (const RayHit & rayHit, size_t object_index, size_t triangle_index) const {
+		const Object & object = m_objects[object_index];
+		const glm::uvec3 & t = triangle (object_index, triangle_index);
+		const glm::vec3 p = rayHit.hitPosition (position (t[1]), position (t[2]), position (t[0]));
+		return object.identity ? p : glm::vec3 (object.objectToWorld * glm::vec4 (p, 1.0f));
+	}
+	/// World space normal interpolated at a hit of the triangle, not normalized
+	inline glm::vec3 hitNormal (const RayHit & rayHit, size_t object_index, size_t triangle_index) const {
+		const Object & object = m_objects[object_index];
+		const glm::uvec3 & t = triangle (object_index, triangle_index);
+		const glm::vec3 n = rayHit.hitPosition (normal (t[1]), normal (t[2]), normal (t[0]));
+		return object.identity ? n : object.normalMatrix * n;
+	}
+	/// World space normal of the plane of the triangle, on the side of its front face in object
+	/// space, which the rays hit; not normalized
+	inline glm::vec3 geometricNormal (size_t object_index, size_t triangle_index) const {
+		const Object & object = m_objects[object_index];
+		const glm::uvec3 & t = triangle (object_index, triangle_index);
+		const glm::vec3 p0 = position (t[0]);
+		const glm::vec3 n = glm::cross (position (t[1]) - p0, position (t[2]) - p0);
+		return object.identity ? n : object.normalMatrix * n;
+	}
+
+	inline const Material & material (size_t index) const { return m_materials[index]; }
+	inline uint32_t objectMaterialIndex (size_t object_index) const { return m_objects[object_index].material; }
+	inline const Material & objectMaterial (size_t object_index) const { return m_materials[m_objects[object_index].material]; }
+
+	inline size_t numOfLightSourcesDir () const { return m_lightSourcesDir.size (); }
+	inline size_t numOfLightSourcesPoint () const { return m_lightSourcesPoint.size (); }
+	inline const LightSourceDir & lightSourceDir (size_t index) const { return m_lightSourcesDir[index]; }
+	inline const LightSourcePoint & lightSourcePoint (size_t index) const { return m_lightSourcesPoint[index]; }
+	inline const glm::vec3 & backgroundColor () const { return m_backgroundColor; }
+
+private:
+	/// Placement of a mesh in the scene
+	struct Object {
+		glm::mat4 objectToWorld;
+		glm::mat4 worldToObject;
+		glm::mat3 normalMatrix; // Of objectToWorld
+		uint32_t mesh;
+		uint32_t material; // Index in m_materials
+		bool identity; // The hits do not need to be transformed
+	};
+
+	void compileMaterialsAndLights (const Scene& scene);
+	/// Copies the objects of the scene, with the matrices of those whose transform changed
+	void compileObjects (const Scene& scene);
+
+	// Vertices of the meshes, in object space, mesh after mesh
+	std::vector<float> m_positionsX, m_positionsY, m_positionsZ;
+	std::vector<float> m_normalsX, m_normalsY, m_normalsZ;
+	// Triangles of the meshes, as indices in the vertex arrays
+	std::vector<glm::uvec3> m_triangles;
+	// Per mesh, its first triangle and vertex in the arrays, and one past the last ones at the end
+	std::vector<uint32_t> m_meshFirstTriangle;
+	std::vector<uint32_t> m_meshFirstVertex;
+	std::vector<Object> m_objects;
+	// Materials and lights
+	std::vector<Material> m_materials;
+	std::vector<LightSourceDir> m_lightSourcesDir;
+	std::vector<LightSourcePoint> m_lightSourcesPoint;
+	glm::vec3 m_backgroundColor = glm::vec3 (0.0f);
+};
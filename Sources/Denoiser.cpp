@@ -0,0 +1,178 @@
+#include "Denoiser.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "BVH/Parallel.h"
+
+
+namespace {
+
+// B3 spline, the kernel of the à-trous passes along each axis
+constexpr float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// exp(-d) for d >= 0, as (1 - d / 16)^16, which is exactly 0 past d = 16: a few multiplies
+// the loops vectorize, and close enough for weights
+inline float negativeExp(float d) {
+	float t = std::max(0.0f, 1.0f - d * (1.0f / 16.0f));
+	t *= t;
+	t *= t;
+	t *= t;
+	t *= t;
+	return t;
+}
+
+inline float luminance(float r, float g, float b) {
+	return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// Rows of the image a chunk of a parallel loop takes
+constexpr size_t rowsPerChunk = 4;
+
+}
+
+
+void Denoiser::denoise (const Image& color, const Image& albedo, const Image& normal, const Image& depth, Image& output) {
+	const size_t numOfPasses_ = (size_t)std::clamp(numOfPasses, 0, maxNumOfPasses);
+	m_width = color.width();
+	m_height = color.height();
+	m_padding = numOfPasses_ > 0 ? (size_t)2 << (numOfPasses_ - 1) : 0; // Two taps of the widest pass
+	m_stride = m_width + 2 * m_padding;
+	const size_t size = m_stride * m_height;
+	for (size_t k = 0; k < 3; k++) {
+		m_color[0][k].assign(size, 0.0f);
+		m_color[1][k].assign(size, 0.0f);
+		m_normal[k].assign(size, 0.0f);
+	}
+	m_depth.assign(size, 0.0f);
+	m_inside.assign(size, 0.0f);
+
+	// The lighting is the color over the albedo, where there is one
+	const size_t numChunks = numOfChunks(m_height, rowsPerChunk);
+	parallelForChunks(numChunks, [&](size_t chunk) {
+		const size_t end = chunkBegin(0, m_height, numChunks, chunk + 1);
+		for (size_t y = chunkBegin(0, m_height, numChunks, chunk); y < end; y++) {
+			for (size_t x = 0; x < m_width; x++) {
+				const size_t p = y * m_stride + m_padding + x;
+				const glm::vec3& a = albedo(x, y);
+				const glm::vec3& c = color(x, y);
+				const glm::vec3& n = normal(x, y);
+				for (size_t k = 0; k < 3; k++) {
+					m_color[0][k][p] = a[k] > 1e-3f ? c[k] / a[k] : c[k];
+					m_normal[k][p] = n[k];
+				}
+				m_depth[p] = depth(x, y)[0];
+				m_inside[p] = 1.0f;
+			}
+		}
+	});
+
+	size_t source = 0;
+	for (size_t pass = 0; pass < numOfPasses_; pass++) {
+		filterPass(source, (size_t)1 << pass, colorSigma / (float)((size_t)1 << pass));
+		source = 1 - source;
+	}
+
+	parallelForChunks(numChunks, [&](size_t chunk) {
+		const size_t end = chunkBegin(0, m_height, numChunks, chunk + 1);
+		for (size_t y = chunkBegin(0, m_height, numChunks, chunk); y < end; y++) {
+			for (size_t x = 0; x < m_width; x++) {
+				const size_t p = y * m_stride + m_padding + x;
+				const glm::vec3& a = albedo(x, y);
+				glm::vec3 c;
+				for (size_t k = 0; k < 3; k++) c[k] = a[k] > 1e-3f ? m_color[source][k][p] * a[k] : m_color[source][k][p];
+				output(x, y) = c;
+			}
+		}
+	});
+}
+
+void Denoiser::filterPass (size_t source, size_t step, float passColorSigma) {
+	const float invNormalVariance = 1.0f / (normalSigma * normalSigma);
+	const float invColorVariance = 1.0f / (passColorSigma * passColorSigma);
+	const float invDepthVariance = 1.0f / (depthSigma * depthSigma);
+	const size_t width = m_width;
+	const size_t numChunks = numOfChunks(m_height, rowsPerChunk);
+	parallelForChunks(numChunks, [&](size_t chunk) {
+		// Sums of the taps of a row, and the scales of the color and depth differences of its pixels
+		std::vector<float> rowScratch(6 * width);
+		float* sumR = &rowScratch[0];
+		float* sumG = sumR + width;
+		float* sumB = sumG + width;
+		float* sumW = sumB + width;
+		float* colorScale = sumW + width;
+		float* depthScale = colorScale + width;
+
+		const size_t end = chunkBegin(0, m_height, numChunks, chunk + 1);
+		for (size_t y = chunkBegin(0, m_height, numChunks, chunk); y < end; y++) {
+			const size_t row = y * m_stride + m_padding;
+			const float* cR = &m_color[source][0][row];
+			const float* cG = &m_color[source][1][row];
+			const float* cB = &m_color[source][2][row];
+			const float* nX = &m_normal[0][row];
+			const float* nY = &m_normal[1][row];
+			const float* nZ = &m_normal[2][row];
+			const float* z = &m_depth[row];
+			const float* inside = &m_inside[row];
+
+			// The color differences are relative to the luminance around the center, the noise
+			// growing with it; that of the center alone would make its outliers reject everything
+			for (size_t x = 0; x < width; x++) sumR[x] = sumW[x] = 0.0f;
+			for (ptrdiff_t yq = std::max((ptrdiff_t)y - 1, (ptrdiff_t)0); yq <= std::min((ptrdiff_t)y + 1, (ptrdiff_t)m_height - 1); yq++) {
+				const ptrdiff_t offset = (yq - (ptrdiff_t)y) * (ptrdiff_t)m_stride;
+				for (ptrdiff_t i = -1; i <= 1; i++) {
+					#pragma omp simd
+					for (size_t x = 0; x < width; x++) {
+						const ptrdiff_t q = (ptrdiff_t)x + offset + i;
+						sumR[x] += inside[q] * luminance(cR[q], cG[q], cB[q]);
+						sumW[x] += inside[q];
+					}
+				}
+			}
+			#pragma omp simd
+			for (size_t x = 0; x < width; x++) {
+				const float l = std::max(sumR[x] / sumW[x], 1e-2f);
+				colorScale[x] = invColorVariance / (l * l);
+				const float d = std::max(z[x], 1e-4f);
+				depthScale[x] = invDepthVariance / (d * d);
+				sumR[x] = sumG[x] = sumB[x] = sumW[x] = 0.0f;
+			}
+
+			for (int j = -2; j <= 2; j++) {
+				const ptrdiff_t yq = (ptrdiff_t)y + j * (ptrdiff_t)step;
+				if (yq < 0 || yq >= (ptrdiff_t)m_height) continue; // Dropped, the weights are normalized
+				for (int i = -2; i <= 2; i++) {
+					const float h = kernel[j + 2] * kernel[i + 2];
+					const ptrdiff_t offset = (yq - (ptrdiff_t)y) * (ptrdiff_t)m_stride + i * (ptrdiff_t)step;
+					#pragma omp simd
+					for (size_t x = 0; x < width; x++) {
+						const ptrdiff_t q = (ptrdiff_t)x + offset;
+						const float dR = cR[q] - cR[x], dG = cG[q] - cG[x], dB = cB[q] - cB[x];
+						const float dX = nX[q] - nX[x], dY = nY[q] - nY[x], dZ = nZ[q] - nZ[x];
+						const float dDepth = z[q] - z[x];
+						const float distance = (dR * dR + dG * dG + dB * dB) * colorScale[x]
+							+ (dX * dX + dY * dY + dZ * dZ) * invNormalVariance
+							+ dDepth * dDepth * depthScale[x];
+						const float w = h * inside[q] * negativeExp(distance);
+						sumR[x] += w * cR[q];
+						sumG[x] += w * cG[q];
+						sumB[x] += w * cB[q];
+						sumW[x] += w;
+					}
+				}
+			}
+
+			// The center always weighs h > 0
+			float* outR = &m_color[1 - source][0][row];
+			float* outG = &m_color[1 - source][1][row];
+			float* outB = &m_color[1 - source][2][row];
+			#pragma omp simd
+			for (size_t x = 0; x < width; x++) {
+				const float invSum = 1.0f / sumW[x];
+				outR[x] = sumR[x] * invSum;
+				outG[x] = sumG[x] * invSum;
+				outB[x] = sumB[x] * invSum;
+			}
+		}
+	});
+}
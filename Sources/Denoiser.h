@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "Image.h"
+
+
+/// Edge-avoiding à-trous wavelet filter (Dammertz et al., "Edge-Avoiding À-Trous Wavelet
+/// Transform for fast Global Illumination Filtering", HPG 2010), guided by the AOVs of the
+/// ray tracer. Every pass blurs the image with the 5x5 B3 spline kernel, its taps spread
+/// 2^pass pixels apart, each tap weighted down as its normal, depth and color differ from
+/// those of the center: a few passes of 25 taps cover a wide footprint, while the edges of
+/// the geometry and of the lighting stop the blur. The lighting is filtered apart from the
+/// albedo, which multiplies it back at the end, so that the edges between materials stay
+/// sharp. Made for images of a few samples per pixel.
+class Denoiser {
+public:
+	/// Denoises 'color' into 'output', which may be the same image. 'albedo', 'normal' and
+	/// 'depth' are the AOVs of RayTracer, of the same size.
+	void denoise (const Image& color, const Image& albedo, const Image& normal, const Image& depth, Image& output);
+
+	int numOfPasses = 5; // Clamped to maxNumOfPasses
+	float colorSigma = 4.0f; // Of the color differences, relative to the luminance around the center, halved at every pass
+	float normalSigma = 0.3f; // Of the distances between the normals
+	float depthSigma = 0.05f; // Of the depth differences, relative to the center depth
+
+	// The taps of the last pass are 2^(numOfPasses - 1) pixels apart, beyond the images
+	static constexpr int maxNumOfPasses = 10;
+
+private:
+	/// One pass, from m_color[source] to m_color[1 - source], with taps 'step' pixels apart
+	void filterPass (size_t source, size_t step, float passColorSigma);
+
+	// Planes of the image, row by row, each row padded by m_padding pixels on both sides so
+	// that the taps never leave it; m_inside is 0 on the padding
+	size_t m_width = 0, m_height = 0, m_padding = 0, m_stride = 0;
+	std::vector<float> m_color[2][3]; // Lighting, without the albedo, ping-ponged between the passes
+	std::vector<float> m_normal[3];
+	std::vector<float> m_depth;
+	std::vector<float> m_inside;
+};
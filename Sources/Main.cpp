@@ -32,7 +32,7 @@ namespace fs = std::filesystem;
 #include "Resources.h"
 #include "Error.h"
 #include "Console.h"
-#include "MeshLoader.h"
+#include "SceneLoader.h"
 #include "Scene.h"
 #include "Image.h"
 #include "Rasterizer.h"
@@ -88,8 +88,19 @@ void printHelp () {
    			  + "\t* TAB: switch between rasterization and ray tracing display\n"
    			  + "\t* SPACE: execute ray tracing\n"
 		      + "\t* A: enable/disable acceleration ray tracing with BVH\n"
+		      + "\t* B: cycle between the median, SAH, SBVH and LBVH builders\n"
+		      + "\t* C: enable/disable the compressed BVH nodes (8-bit child bounds)\n"
+		      + "\t* U: enable/disable the treelet restructuring of the built BVHs\n"
+		      + "\t* I: enable/disable the two-level BVH (one BVH per mesh, following the mesh transforms)\n"
+		      + "\t* K: enable/disable the ray packets (the pixels of 8x8 tiles traced together)\n"
+		      + "\t* W: enable/disable the wavefront ray tracing (rays sorted and traced by large batches)\n"
+		      + "\t* L: cycle between 1, 4 and 16 point lights sampled per shading point in ray tracing\n"
 		      + "\t* O: enable/disable occlusion in ray tracing\n"
-		      + "\t* P: enable/disable anti-aliasing in ray tracing\n"
+		      + "\t* P: cycle between no anti-aliasing, 3x3 samples per pixel and adaptive anti-aliasing (more samples on the edges and noisy pixels) in ray tracing\n"
+		      + "\t* S: cycle between the PCG, Sobol and blue-noise samplers of the anti-aliasing and progressive samples\n"
+		      + "\t* N: enable/disable the progressive ray tracing (displayed, refined at every frame until the camera moves)\n"
+		      + "\t* M: enable/disable the path tracing (GGX importance sampling, lit by the lights and the background), best with N\n"
+		      + "\t* E: enable/disable the denoising of the ray traced image (edge-avoiding filter guided by the albedo, normals and depth)\n"
 		      + "\n"
 		      + "\n Diagnostic and SSR:\n"
 		      + "\t* F1: render (SSR: also reset booleans togglers) \n"
@@ -119,6 +130,7 @@ void raytrace () {
 /// Executed each time a key is entered.
 void keyCallback (GLFWwindow * windowPtr, int key, int scancode, int action, int mods) {
 	if (action == GLFW_PRESS) {
+		rayTracerPtr->resetAccumulation (); // Any key may change what the progressive samples show
 		if (key == GLFW_KEY_H) {
 			printHelp ();
 		} else if (action == GLFW_PRESS && key == GLFW_KEY_ESCAPE) {
@@ -129,16 +141,52 @@ void keyCallback (GLFWwindow * windowPtr, int key, int scancode, int action, int
 			scenePtr->camera()->setFoV (std::max (5.f, scenePtr->camera()->getFoV () - 5.f));
 		} else if (action == GLFW_PRESS && key == GLFW_KEY_Q) { // A on a french keyboard
 			rayTracerPtr->useBVH =!(rayTracerPtr->useBVH);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_B) {
+			if (rayTracerPtr->bvhBuilder == BVHBuilder::Median) rayTracerPtr->bvhBuilder = BVHBuilder::SAH;
+			else if (rayTracerPtr->bvhBuilder == BVHBuilder::SAH) rayTracerPtr->bvhBuilder = BVHBuilder::SBVH;
+			else if (rayTracerPtr->bvhBuilder == BVHBuilder::SBVH) rayTracerPtr->bvhBuilder = BVHBuilder::LBVH;
+			else rayTracerPtr->bvhBuilder = BVHBuilder::Median;
+			rayTracerPtr->init (scenePtr);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_C) {
+			rayTracerPtr->quantizeBVH = !(rayTracerPtr->quantizeBVH);
+			rayTracerPtr->init (scenePtr);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_U) {
+			rayTracerPtr->optimizeBVHTreelets = !(rayTracerPtr->optimizeBVHTreelets);
+			rayTracerPtr->init (scenePtr);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_I) {
+			rayTracerPtr->useInstancing = !(rayTracerPtr->useInstancing);
+			rayTracerPtr->init (scenePtr);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_K) {
+			rayTracerPtr->usePackets = !(rayTracerPtr->usePackets);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_W) { // Z on a french keyboard
+			rayTracerPtr->useWavefront = !(rayTracerPtr->useWavefront);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_L) {
+			rayTracerPtr->pointLightSamples = rayTracerPtr->pointLightSamples >= 16 ? 1 : 4 * rayTracerPtr->pointLightSamples;
 		} else if (action == GLFW_PRESS && key == GLFW_KEY_O) { // O on a french keyboard
 			rayTracerPtr->useOcclusion =!(rayTracerPtr->useOcclusion);
 		} else if (action == GLFW_PRESS && key == GLFW_KEY_P) { // P on a french keyboard
-			if (rayTracerPtr->alias_number > 1) rayTracerPtr->alias_number = 1;
+			if (rayTracerPtr->adaptiveAA) {
+				rayTracerPtr->adaptiveAA = false;
+				rayTracerPtr->alias_number = 1;
+			}
+			else if (rayTracerPtr->alias_number > 1) rayTracerPtr->adaptiveAA = true;
 			else rayTracerPtr->alias_number = 3;
 		} else if (action == GLFW_PRESS && key == GLFW_KEY_G) {
 			scenePtr->camera()->setFoV (std::min (120.f, scenePtr->camera()->getFoV () + 5.f));
 		} else if (action == GLFW_PRESS && key == GLFW_KEY_TAB) {
 			isDisplayRaytracing = !isDisplayRaytracing;
 			//if(isDisplayRaytracing) rayTracerPtr->render (scenePtr);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_S) {
+			if (rayTracerPtr->samplerType == SamplerType::PCG) rayTracerPtr->samplerType = SamplerType::Sobol;
+			else if (rayTracerPtr->samplerType == SamplerType::Sobol) rayTracerPtr->samplerType = SamplerType::BlueNoise;
+			else rayTracerPtr->samplerType = SamplerType::PCG;
+			Console::print (std::string ("Sampler: ") + samplerName (rayTracerPtr->samplerType));
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_N) {
+			rayTracerPtr->progressive = !(rayTracerPtr->progressive);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_M) {
+			rayTracerPtr->pathTracing = !(rayTracerPtr->pathTracing);
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_E) {
+			rayTracerPtr->denoise = !(rayTracerPtr->denoise);
 		} else if (action == GLFW_PRESS && key == GLFW_KEY_SPACE) {
 			raytrace ();
 		} else if (action == GLFW_PRESS && key == GLFW_KEY_F1) {
@@ -282,81 +330,14 @@ void initGLFW () {
 }
 
 void initScene () {
-	scenePtr = std::make_shared<Scene> ();
-	scenePtr->setBackgroundColor (glm::vec3 (0.1f, 0.5f, 0.95f));
-
-	// Mesh
-	auto meshPtr = std::make_shared<Mesh> ();
+	// Actual scene, shared with the batch renderer
+	int width, height;
+	glfwGetWindowSize (windowPtr, &width, &height);
 	try {
-		MeshLoader::loadOFF (meshFilename, meshPtr);
+		scenePtr = SceneLoader::loadDefault (meshFilename, static_cast<float>(width) / static_cast<float>(height), center, meshScale);
 	} catch (std::exception & e) {
 		exitOnCriticalError (std::string ("[Error loading mesh]") + e.what ());
 	}
-	meshPtr->computeBoundingSphere (center, meshScale);
-	meshPtr->computePlanarParameterization();
-	BoundingBox bbox = meshPtr->computeBoundingBox ();
-	float extent = 2 * bbox.size ();
-	if (meshFilename.find("sphere") != std::string::npos)
-		meshPtr->setTranslation(glm::vec3(0, -0.2f * extent, 0));
-    auto meshMaterialPtr = std::make_shared<Material> (glm::vec3 (0.05, 0.05, 0.05), 0.3, 0.2);
-    scenePtr->add (meshPtr);
-    scenePtr->addMaterial (meshMaterialPtr);
-	scenePtr->setMaterialToMesh (0, 0);
-	std::cout << meshFilename << std::endl;
-
-	
-	// Adding a ground adapted to the loaded model
-	std::shared_ptr<Mesh> groundMeshPtr = std::make_shared<Mesh> ();
-	std::cout << "EXTENT: " << extent << std::endl;
-	glm::vec3 startP = bbox.center () + glm::vec3 (-extent, -bbox.height()/2.f, -extent);
-	groundMeshPtr->vertexPositions().push_back (startP); 
-	groundMeshPtr->vertexPositions().push_back (startP + glm::vec3 (0.f, 0.f, 2.f*extent));
-	groundMeshPtr->vertexPositions().push_back (startP + glm::vec3 (2.f*extent, 0.f, 2.f*extent));
-	groundMeshPtr->vertexPositions().push_back (startP + glm::vec3 (2.f*extent, 0.f, 0.f));
-	groundMeshPtr->triangleIndices().push_back (glm::uvec3 (0, 1, 2));
-	groundMeshPtr->triangleIndices().push_back (glm::uvec3 (0, 2, 3));
-	groundMeshPtr->recomputePerVertexNormals ();
-    auto groundMaterialPtr = std::make_shared<Material> (glm::vec3 (0.6, 0.6, 0.6f), 0.1f, 0.9);
-    scenePtr->add (groundMeshPtr);
-    scenePtr->addMaterial (groundMaterialPtr);
-	scenePtr->setMaterialToMesh (1, 1);
-
-
-	// Adding a wall adapted to the loaded model
-	std::shared_ptr<Mesh> wallMeshPtr = std::make_shared<Mesh> ();
-	startP = bbox.center () + glm::vec3 (-extent, -bbox.height()/2.f, -extent);
-	wallMeshPtr->vertexPositions().push_back (startP); 
-	wallMeshPtr->vertexPositions().push_back (startP + glm::vec3 (2.f*extent, 0.f, 0.f));
-	wallMeshPtr->vertexPositions().push_back (startP + glm::vec3 (2.f*extent, 2.f*extent, 0.f));
-	wallMeshPtr->vertexPositions().push_back (startP + glm::vec3 (0.f, 2.f*extent, 0.f));
-	wallMeshPtr->triangleIndices().push_back (glm::uvec3 (0, 1, 2));
-	wallMeshPtr->triangleIndices().push_back (glm::uvec3 (0, 2, 3));
-	wallMeshPtr->recomputePerVertexNormals ();
-    auto wallMaterialPtr = std::make_shared<Material> (glm::vec3 (0.9, 0.5, 0.3f), 0.1f, 0.5f);
-    scenePtr->add (wallMeshPtr);
-    scenePtr->addMaterial (wallMaterialPtr);
-	scenePtr->setMaterialToMesh (2, 2);
-
-	// Light Sources
-	//auto lightPtr = std::make_shared<LightSourceDir> ();
-	//scenePtr->addLightSource(lightPtr);
-	//auto lightPtr2 = std::make_shared<LightSourcePoint> ();
-	//scenePtr->addLightSource(lightPtr2);
-	float factor = 4;
-	float distance = 1;
-	scenePtr->addLightSource (std::make_shared<LightSourceDir> (distance * normalize (glm::vec3(0.f, -1.f, -1.f)), glm::vec3(1.f, 1.f, 1.f), factor*0.4f));
-	scenePtr->addLightSource (std::make_shared<LightSourceDir> (distance * normalize (glm::vec3(-2.f, -0.5f, 0.f)), glm::vec3(0.2f, 0.6f, 1.f), factor*0.25f));
-	scenePtr->addLightSource (std::make_shared<LightSourceDir> (distance * normalize (glm::vec3(2.f, -0.5f, 0.f)), glm::vec3(1.0f, 0.25f, 0.1f), factor*0.25f));
-
-	// Camera
-	int width, height;
-	glfwGetWindowSize (windowPtr, &width, &height);
-	auto cameraPtr = std::make_shared<Camera> ();
-	cameraPtr->setAspectRatio (static_cast<float>(width) / static_cast<float>(height));
-	cameraPtr->setTranslation (center + glm::vec3 (0.0, 0.0, 3.0 * meshScale));
-	cameraPtr->setNear (0.1f);
-	cameraPtr->setFar (100.f * meshScale);
-	scenePtr->set (cameraPtr);
 }
 
 void init () {
@@ -367,6 +348,7 @@ void init () {
 	rasterizerPtr = make_shared<Rasterizer> ();
 	rasterizerPtr->init (basePath, scenePtr); // Mut be called before creating the scene, to generate an OpenGL context and allow mesh VBOs
 	rayTracerPtr = make_shared<RayTracer> ();
+	rayTracerPtr->bvhCacheDirectory = fs::absolute (meshFilename).parent_path ().string (); // Next to the model, also for a bare file name
 	rayTracerPtr->init (scenePtr);
 }
 
@@ -378,7 +360,11 @@ void clear () {
 
 // The main rendering call
 void render () {
-	if (isDisplayRaytracing)
+	if (rayTracerPtr->progressive) {
+		raytrace ();
+		rasterizerPtr->display (rayTracerPtr->image ());
+	}
+	else if (isDisplayRaytracing)
 		//rasterizerPtr->display (rayTracerPtr->image ());
 		rasterizerPtr->renderSSR (scenePtr, diagnostic);
 	else
@@ -1,12 +1,10 @@
 // Fichier Material.h
 #pragma once
 
-#include <glad/glad.h>
 #include <string>
 #include <memory>
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
-#include <GLFW/glfw3.h>
 #define GLM_ENABLE_EXPERIMENTAL
 
 #include <glm/gtx/string_cast.hpp>
@@ -74,7 +74,7 @@ void Mesh::computePlanarParameterization() {
 
 	for(size_t i=0; i<m_vertexPositions.size(); i++) {
 		glm::vec2 onCircle = glm::vec2(0.5f * (m_vertexPositions[i] - center) / radius);
-		float angle = std::atan2f(onCircle.y, onCircle.x);
+		float angle = std::atan2(onCircle.y, onCircle.x);
 		glm::vec2 finalPos = onCircle;
 		if(((angle >= -PI/4.0f) && (angle <= PI/4.0f)) || (angle <= -3.0f*PI/4.0f) || (angle >= 3.0f*PI/4.0f))  onCircle /= pow(std::cos(angle), 2.0f);
 		else  onCircle /= pow(std::sin(angle), 2.0f);
@@ -0,0 +1,232 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#include "RayTracer.h"
+
+
+// Unidirectional path tracing with the material model of shade, get_fd + get_fs, in world
+// space. At every vertex the lights are sampled (next event estimation), then the path goes
+// on in a direction drawn from the BRDF. The background is a uniform sky of its color, which
+// both the light sampling and the BRDF sampling reach: their estimates are combined with
+// multiple importance sampling (Veach and Guibas, "Optimally Combining Sampling Techniques
+// for Monte Carlo Rendering", 1995). The directional and point lights are deltas, which only
+// the light sampling reaches.
+
+namespace {
+
+constexpr float pi = 3.14159265f;
+
+inline float luminance(const glm::vec3& color) {
+	return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Power heuristic of MIS with beta = 2, weight of the technique of density pdfA
+inline float powerHeuristic(float pdfA, float pdfB) {
+	const float a2 = pdfA * pdfA;
+	const float b2 = pdfB * pdfB;
+	return a2 + b2 > 0.0f ? a2 / (a2 + b2) : 0.0f;
+}
+
+// Orthonormal basis around n (Duff et al., "Building an Orthonormal Basis, Revisited", JCGT 2017)
+inline void orthonormalBasis(const glm::vec3& n, glm::vec3& t, glm::vec3& b) {
+	const float sign = std::copysign(1.0f, n.z);
+	const float a = -1.0f / (sign + n.z);
+	const float c = n.x * n.y * a;
+	t = glm::vec3(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+	b = glm::vec3(c, sign + n.y * n.y * a, -n.y);
+}
+
+// Cosine-weighted direction around n, of density cos / pi
+inline glm::vec3 sampleCosineHemisphere(const glm::vec3& n, const glm::vec2& u) {
+	glm::vec3 t, b;
+	orthonormalBasis(n, t, b);
+	const float r = std::sqrt(u.x);
+	const float phi = 2.0f * pi * u.y;
+	return r * std::cos(phi) * t + r * std::sin(phi) * b + std::sqrt(std::max(0.0f, 1.0f - u.x)) * n;
+}
+
+// The GGX terms of get_fs, where alpha is the roughness
+inline float ggxD(float alpha, float nDotH) {
+	const float alpha2 = alpha * alpha;
+	const float d = 1.0f + (alpha2 - 1.0f) * nDotH * nDotH;
+	return alpha2 / (pi * d * d);
+}
+
+inline float ggxG1(float alpha, float nDotW) {
+	const float alpha2 = alpha * alpha;
+	return 2.0f * nDotW / (nDotW + std::sqrt(alpha2 + (1.0f - alpha2) * nDotW * nDotW));
+}
+
+// Half vector drawn from the normals visible from wo (Heitz, "Sampling the GGX Distribution
+// of Visible Normals", JCGT 2018), in the frame (t, b, n) of the shading normal. The
+// reflected directions have a density of D(h) G1(wo) / (4 n.wo): only the G1 of the
+// incoming direction is left in the weights, instead of the large variance of sampling D
+// alone at grazing angles.
+glm::vec3 sampleGGXVisibleNormal(const glm::vec3& n, const glm::vec3& wo, float alpha, const glm::vec2& u) {
+	glm::vec3 t, b;
+	orthonormalBasis(n, t, b);
+	const glm::vec3 localWo(glm::dot(wo, t), glm::dot(wo, b), glm::dot(wo, n));
+	// Stretch the view to the hemisphere configuration
+	const glm::vec3 vh = glm::normalize(glm::vec3(alpha * localWo.x, alpha * localWo.y, localWo.z));
+	const float lengthSquared = vh.x * vh.x + vh.y * vh.y;
+	const glm::vec3 t1 = lengthSquared > 0.0f ? glm::vec3(-vh.y, vh.x, 0.0f) / std::sqrt(lengthSquared) : glm::vec3(1.0f, 0.0f, 0.0f);
+	const glm::vec3 t2 = glm::cross(vh, t1);
+	// Point on the projected half disk
+	const float r = std::sqrt(u.x);
+	const float phi = 2.0f * pi * u.y;
+	const float p1 = r * std::cos(phi);
+	const float s = 0.5f * (1.0f + vh.z);
+	const float p2 = (1.0f - s) * std::sqrt(std::max(0.0f, 1.0f - p1 * p1)) + s * r * std::sin(phi);
+	const glm::vec3 nh = p1 * t1 + p2 * t2 + std::sqrt(std::max(0.0f, 1.0f - p1 * p1 - p2 * p2)) * vh;
+	// Unstretch
+	const glm::vec3 localH = glm::normalize(glm::vec3(alpha * nh.x, alpha * nh.y, std::max(1e-6f, nh.z)));
+	return localH.x * t + localH.y * b + localH.z * n;
+}
+
+}
+
+
+float RayTracer::specularProbability (const Material& material, float nDotWo) const {
+	// Share of the specular lobe in the reflectance seen from wo, the Fresnel term of get_fs
+	// against the diffuse albedo, kept away from 0 and 1 so that neither lobe is missed
+	const glm::vec3 F0 = material.albedo() + (glm::vec3(1.0f) - material.albedo()) * material.metallicness();
+	const glm::vec3 F = F0 + (float)std::pow(1.0f - nDotWo, 5.0f) * (glm::vec3(1.0f) - F0);
+	const float specular = luminance(F);
+	const float diffuse = luminance(material.albedo());
+	return glm::clamp(specular / std::max(specular + diffuse, 1e-6f), 0.05f, 0.95f);
+}
+
+float RayTracer::brdfPdf (const Material& material, const glm::vec3& n, const glm::vec3& wo, const glm::vec3& wi) const {
+	const float nDotWo = glm::dot(n, wo);
+	const float nDotWi = glm::dot(n, wi);
+	if (nDotWo <= 0.0f || nDotWi <= 0.0f) return 0.0f;
+	const float alpha = std::max(material.roughness(), minRoughness);
+	const glm::vec3 wh = glm::normalize(wo + wi);
+	const float specularPdf = ggxD(alpha, std::max(0.0f, glm::dot(n, wh))) * ggxG1(alpha, nDotWo) / (4.0f * nDotWo);
+	const float diffusePdf = nDotWi / pi;
+	const float pSpecular = specularProbability(material, nDotWo);
+	return pSpecular * specularPdf + (1.0f - pSpecular) * diffusePdf;
+}
+
+glm::vec3 RayTracer::brdf (const Material& material, const glm::vec3& n, const glm::vec3& wo, const glm::vec3& wi) {
+	if (glm::dot(n, wo) <= 0.0f || glm::dot(n, wi) <= 0.0f) return glm::vec3(0.0f);
+	glm::vec3 w0 = wo, wIn = wi, normal = n;
+	glm::vec3 wh = glm::normalize(wo + wi);
+	// The diffuse lobe only gets the light the specular one does not reflect: with get_fd +
+	// get_fs as such, a surface would reflect up to twice what it receives, which a single
+	// bounce hides but which blows up along a path
+	const glm::vec3 F0 = material.albedo() + (glm::vec3(1.0f) - material.albedo()) * material.metallicness();
+	const glm::vec3 F = F0 + (float)std::pow(1.0f - std::max(0.0f, glm::dot(wi, wh)), 5.0f) * (glm::vec3(1.0f) - F0);
+	// The specular lobe is evaluated with the roughness it is sampled with, GGX being a Dirac at 0
+	Material specularMaterial = material;
+	specularMaterial.setRoughness(std::max(material.roughness(), minRoughness));
+	return get_fd(material) * (glm::vec3(1.0f) - F) + get_fs(specularMaterial, w0, wIn, wh, normal);
+}
+
+glm::vec3 RayTracer::tracePath (Ray ray, Sampler& sampler, uint32_t& surface, AOVSample& aov) {
+	const CompiledScene& scene = m_compiledScene;
+	const glm::vec3 backgroundColor = scene.backgroundColor();
+	const size_t numOfLightSourcesDir = scene.numOfLightSourcesDir();
+	glm::vec3 radiance(0.0f);
+	glm::vec3 throughput(1.0f);
+	float lastBrdfPdf = 0.0f; // Of the direction of the ray, 0 for the camera ray
+	glm::vec3 lastNormal(0.0f);
+	surface = 0;
+
+	for (int depth = 0; ; depth++) {
+		RayHit rayHit(0, 0, 0, std::numeric_limits<float>::max());
+		size_t object_index = 0, triangle_index = 0;
+		if (!traceRay(rayHit, ray, object_index, triangle_index)) {
+			// The sky, weighted against its sampling at the previous vertex
+			const float weight = depth == 0 ? 1.0f : powerHeuristic(lastBrdfPdf, std::max(0.0f, glm::dot(lastNormal, ray.direction)) / pi);
+			radiance += throughput * backgroundColor * weight;
+			break;
+		}
+		if (depth >= maxPathDepth) break; // The ray past the last vertex only completes the MIS of its sky
+		if (depth == 0) {
+			surface = (uint32_t)object_index + 1;
+			aov = surfaceAOVs(rayHit, object_index, triangle_index);
+		}
+
+		// World space position, shading normal and geometric normal of the hit
+		const Material& material = scene.objectMaterial(object_index);
+		const glm::vec3 position = scene.hitPosition(rayHit, object_index, triangle_index);
+		const glm::vec3 geometricNormal = glm::normalize(scene.geometricNormal(object_index, triangle_index)); // Faces the ray, the back faces are culled
+		glm::vec3 normal = glm::normalize(scene.hitNormal(rayHit, object_index, triangle_index));
+		const glm::vec3 wo = -ray.direction;
+		if (glm::dot(normal, wo) <= 0.0f) normal = geometricNormal; // Interpolated normal facing away near the silhouettes
+
+		// 1. Lights. Only the directions above the surface reach it, the rays below it would
+		// leave through the culled back faces.
+		for (size_t l = 0; l < numOfLightSourcesDir; l++) {
+			const LightSourceDir& light = scene.lightSourceDir(l);
+			const glm::vec3 wi = -glm::normalize(light.direction);
+			if (glm::dot(geometricNormal, wi) <= 0.0f) continue;
+			Ray shadowRay(position, wi);
+			if (traceShadowRay(shadowRay)) continue;
+			radiance += throughput * light.intensity * light.color * brdf(material, normal, wo, wi) * std::max(0.0f, glm::dot(normal, wi));
+		}
+		if (!m_lightBVH.empty() && pointLightSamples > 0) {
+			for (int s = 0; s < pointLightSamples; s++) {
+				size_t light_index;
+				float pmf;
+				if (!m_lightBVH.sample(position, normal, sampler.get1D(), light_index, pmf)) break;
+				const LightSourcePoint& light = scene.lightSourcePoint(light_index);
+				const glm::vec3 toLight = light.position - position;
+				const float d = glm::length(toLight);
+				const glm::vec3 wi = toLight / d;
+				if (glm::dot(geometricNormal, wi) <= 0.0f) continue;
+				Ray shadowRay(position, toLight); // Reaches the light at t = 1
+				if (traceShadowRay(shadowRay, 1.0f)) continue;
+				const float Li = light.intensity / (light.a_c + light.a_l * d + light.a_q * d * d) / (pmf * pointLightSamples);
+				radiance += throughput * Li * light.color * brdf(material, normal, wo, wi) * std::max(0.0f, glm::dot(normal, wi));
+			}
+		}
+		{
+			// The sky, sampled with the cosine
+			const glm::vec3 wi = sampleCosineHemisphere(normal, sampler.get2D());
+			const float lightPdf = glm::dot(normal, wi) / pi;
+			if (lightPdf > 0.0f && glm::dot(geometricNormal, wi) > 0.0f) {
+				Ray skyRay(position, wi);
+				if (!traceShadowRay(skyRay)) {
+					const float weight = powerHeuristic(lightPdf, brdfPdf(material, normal, wo, wi));
+					radiance += throughput * backgroundColor * brdf(material, normal, wo, wi) * (glm::dot(normal, wi) * weight / lightPdf);
+				}
+			}
+		}
+
+		// 2. Next direction, from the specular lobe with the visible normals of GGX, or from
+		// the diffuse one with the cosine. Its density is the mix of both, whichever drew it.
+		const float pSpecular = specularProbability(material, glm::dot(normal, wo));
+		const float uLobe = sampler.get1D();
+		const glm::vec2 u = sampler.get2D();
+		glm::vec3 wi;
+		if (uLobe < pSpecular) {
+			const glm::vec3 wh = sampleGGXVisibleNormal(normal, wo, std::max(material.roughness(), minRoughness), u);
+			wi = glm::reflect(-wo, wh);
+		}
+		else wi = sampleCosineHemisphere(normal, u);
+		const float pdf = brdfPdf(material, normal, wo, wi);
+		if (pdf <= 0.0f || glm::dot(geometricNormal, wi) <= 0.0f) break;
+		throughput *= brdf(material, normal, wo, wi) * (glm::dot(normal, wi) / pdf);
+
+		// 3. Russian roulette: past a few bounces, a path carrying little is stopped, the others
+		// are weighted up by the same amount on average
+		const float uRoulette = sampler.get1D();
+		if (depth + 1 >= rouletteDepth) {
+			const float survival = std::min(0.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+			if (uRoulette >= survival) break;
+			throughput /= survival;
+		}
+
+		ray = Ray(position, wi);
+		lastBrdfPdf = pdf;
+		lastNormal = normal;
+	}
+	return radiance;
+}
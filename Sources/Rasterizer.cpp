@@ -164,12 +164,13 @@ void Rasterizer::render (std::shared_ptr<Scene> scenePtr, int diagnostic) {
 
 	setLights(m_pbrShaderProgramPtr, scenePtr);
 
-	// Meshes
-	size_t numOfMeshes = scenePtr->numOfMeshes ();
-	for (size_t i = 0; i < numOfMeshes; i++) {
+	// Meshes and their instances
+	size_t numOfObjects = scenePtr->numOfObjects ();
+	for (size_t i = 0; i < numOfObjects; i++) {
+		size_t meshIndex = scenePtr->objectMesh (i);
 		glm::mat4 projectionMatrix = scenePtr->camera()->computeProjectionMatrix ();
 		m_pbrShaderProgramPtr->set ("projectionMat", projectionMatrix); // Compute the projection matrix of the camera and pass it to the GPU program
-		glm::mat4 modelMatrix = scenePtr->mesh (i)->computeTransformMatrix ();
+		glm::mat4 modelMatrix = scenePtr->objectTransformMatrix (i);
 		glm::mat4 viewMatrix = scenePtr->camera()->computeViewMatrix ();
 		m_pbrShaderProgramPtr->set ("viewMat", viewMatrix);
 		glm::mat4 modelViewMatrix = viewMatrix * modelMatrix;
@@ -177,8 +178,8 @@ void Rasterizer::render (std::shared_ptr<Scene> scenePtr, int diagnostic) {
 		m_pbrShaderProgramPtr->set ("modelViewMat", modelViewMatrix);
 		m_pbrShaderProgramPtr->set ("normalMat", normalMatrix);
 
-		setMaterial(m_pbrShaderProgramPtr, scenePtr, i);
-		draw (i, scenePtr->mesh (i)->triangleIndices().size ());
+		setMaterial(m_pbrShaderProgramPtr, scenePtr, meshIndex);
+		draw (meshIndex, scenePtr->mesh (meshIndex)->triangleIndices().size ());
 	}
 
 	m_pbrShaderProgramPtr->stop ();
@@ -203,10 +204,11 @@ void Rasterizer::renderSSR (std::shared_ptr<Scene> scenePtr, int diagnostic) {
 		glm::mat4 viewMatrix = scenePtr->camera()->computeViewMatrix ();
 		shaderFirstPass->set ("viewMat", viewMatrix);
 
-        // Meshes
-        size_t numOfMeshes = scenePtr->numOfMeshes ();
-        for (size_t i = 0; i < numOfMeshes; i++) {
-            glm::mat4 modelMatrix = scenePtr->mesh (i)->computeTransformMatrix ();
+        // Meshes and their instances
+        size_t numOfObjects = scenePtr->numOfObjects ();
+        for (size_t i = 0; i < numOfObjects; i++) {
+            size_t meshIndex = scenePtr->objectMesh (i);
+            glm::mat4 modelMatrix = scenePtr->objectTransformMatrix (i);
             glm::mat4 modelViewMatrix = viewMatrix * modelMatrix;
             glm::mat4 normalMatrix = glm::transpose (glm::inverse (modelViewMatrix));
             glm::mat4 invView = glm::inverse (viewMatrix);
@@ -215,8 +217,8 @@ void Rasterizer::renderSSR (std::shared_ptr<Scene> scenePtr, int diagnostic) {
             shaderFirstPass->set ("normalMat", normalMatrix);
             shaderFirstPass->set ("invView", invView);
 
-            setMaterial(shaderFirstPass, scenePtr, i);
-            draw (i, scenePtr->mesh (i)->triangleIndices().size ());
+            setMaterial(shaderFirstPass, scenePtr, meshIndex);
+            draw (meshIndex, scenePtr->mesh (meshIndex)->triangleIndices().size ());
         }
 
         
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <numeric>
+
+#include "Ray.h"
+#include "RayHit.h"
+#include "BVH/Parallel.h"
+
+
+/// Rays of a stage of the wavefront renderer, with their nearest hits once traced, stored as
+/// a structure of arrays. 'source' ties every ray to what generated it: the sample of a camera
+/// ray in its batch, or the hit of a shadow ray.
+struct RayQueue {
+	inline size_t size () const { return rays.size (); }
+	inline void resize (size_t n) {
+		rays.resize (n);
+		source.resize (n);
+		keys.resize (n);
+		t.resize (n);
+		b0.resize (n);
+		b1.resize (n);
+		b2.resize (n);
+		objectIndex.resize (n);
+		triangleIndex.resize (n);
+		hit.resize (n);
+	}
+	inline RayHit rayHit (size_t i) const { return RayHit (b0[i], b1[i], b2[i], t[i]); }
+
+	/// Reorders the rays and their sources by increasing key, so that the rays traced one
+	/// after the other visit the same nodes. The keys are sorted on their lowest 'bits' bits.
+	inline void sortByKey (size_t bits) {
+		order.resize (size ());
+		std::iota (order.begin (), order.end (), 0u);
+		radixSort (keys, order, bits);
+		sortedRays.resize (size ());
+		sortedSource.resize (size ());
+		for (size_t i = 0; i < order.size (); i++) {
+			sortedRays[i] = rays[order[i]];
+			sortedSource[i] = source[order[i]];
+		}
+		rays.swap (sortedRays);
+		source.swap (sortedSource);
+	}
+
+	std::vector<Ray> rays;
+	std::vector<uint32_t> source;
+	std::vector<uint64_t> keys; // Sort keys of the rays, see sortByKey
+
+	// Nearest hits, t is the maximum distance on input
+	std::vector<float> t;
+	std::vector<float> b0;
+	std::vector<float> b1;
+	std::vector<float> b2;
+	std::vector<uint32_t> objectIndex;
+	std::vector<uint32_t> triangleIndex;
+	std::vector<uint8_t> hit; // 1 when the ray hit a triangle, or is occluded for a shadow ray
+
+private:
+	std::vector<uint32_t> order;
+	std::vector<Ray> sortedRays;
+	std::vector<uint32_t> sortedSource;
+};
@@ -14,6 +14,22 @@
 #define PI 3.1415f
 
 
+namespace {
+
+// Inverse of the bit spreading of the Morton codes: packs the even bits of x, so that the
+// i-th cell of a 2D Morton order is at (compactBits(i), compactBits(i >> 1))
+inline size_t compactBits(size_t x) {
+	x &= 0x55555555;
+	x = (x | (x >> 1)) & 0x33333333;
+	x = (x | (x >> 2)) & 0x0f0f0f0f;
+	x = (x | (x >> 4)) & 0x00ff00ff;
+	x = (x | (x >> 8)) & 0x0000ffff;
+	return x;
+}
+
+}
+
+
 RayTracer::RayTracer() : 
 	m_imagePtr (std::make_shared<Image>()) {}
 
@@ -21,179 +37,514 @@ RayTracer::~RayTracer() {
 }
 
 void RayTracer::init (const std::shared_ptr<Scene> scenePtr) {
-	std::cout << "BVH initiation...";
-	//bvh.init(scenePtr);
-	std::cout << " done" << std::endl;
+	std::cout << "BVH initiation (" << builderName(bvhBuilder) << " builder" << (useInstancing ? ", two levels" : "") << ")...";
+	buildBVH(scenePtr);
+	m_compiledScene.compile(*scenePtr);
+	if (useInstancing)
+		std::cout << " done (" << tlas.numOfBLAS() << " mesh BVHs, " << tlas.numOfInstances() << " instances, " << tlas.numOfPrimitives() << " triangles)" << std::endl;
+	else
+		std::cout << " done" << std::endl << bvh.stats() << std::endl;
+}
+
+void RayTracer::buildBVH (const std::shared_ptr<Scene> scenePtr) {
+	if (useInstancing) {
+		bvh.clear();
+		tlas.builder = bvhBuilder;
+		tlas.quantizeNodes = quantizeBVH;
+		tlas.optimizeTreelets = optimizeBVHTreelets;
+		tlas.cacheDirectory = bvhCacheDirectory;
+		tlas.init(scenePtr);
+	}
+	else {
+		tlas.clear();
+		bvh.builder = bvhBuilder;
+		bvh.quantizeWideNodes = quantizeBVH;
+		bvh.optimizeTreelets = optimizeBVHTreelets;
+		bvh.init(scenePtr);
+	}
+}
+
+bool RayTracer::traceRay (RayHit& rayHit, Ray& ray, size_t& object_index, size_t& triangle_index) {
+	if (useInstancing) return tlas.intersect(rayHit, ray, object_index, triangle_index);
+	return bvh.intersect(rayHit, ray, object_index, triangle_index);
+}
+
+bool RayTracer::traceShadowRay (Ray& ray, float tmax) {
+	if (useInstancing) return tlas.fastIntersect(ray, tmax);
+	return bvh.fastIntersect(ray, tmax);
+}
+
+void RayTracer::traceRays (RayPacket& packet) {
+	if (useInstancing) tlas.intersect(packet);
+	else bvh.intersect(packet);
+}
+
+void RayTracer::traceShadowRays (RayPacket& packet) {
+	if (useInstancing) tlas.fastIntersect(packet);
+	else bvh.fastIntersect(packet);
+}
+
+void RayTracer::compileScene (const Scene& scene) {
+	// The meshes deformed between renders are compiled again, as their BVHs are rebuilt or
+	// refit; otherwise only the matrices of the objects that moved are computed again
+	if (m_compiledScene.empty() || (useBVH && (rebuildBVHEachRender || refitBVHEachRender)))
+		m_compiledScene.compile(scene);
+	else
+		m_compiledScene.update(scene);
 }
 
 void RayTracer::render (const std::shared_ptr<Scene> scenePtr) {
 	size_t width = m_imagePtr->width();
 	size_t height = m_imagePtr->height();
 	std::chrono::high_resolution_clock clock;
-	Console::print ("Start ray tracing at " + std::to_string (width) + "x" + std::to_string (height) + " resolution...");
+	if (!progressive) Console::print ("Start ray tracing at " + std::to_string (width) + "x" + std::to_string (height) + " resolution...");
 	std::chrono::time_point<std::chrono::high_resolution_clock> before = clock.now();
 	//m_imagePtr->clear (scenePtr->backgroundColor ());
 	//m_imagePtr->operator()(10, 10) = glm::vec3(1.0, 0.0, 0.0);
 	
+	if (useBVH && rebuildBVHEachRender) {
+		buildBVH(scenePtr);
+		double buildTime = (double)std::chrono::duration_cast<std::chrono::milliseconds>(clock.now() - before).count();
+		Console::print ("BVH rebuilt in " + std::to_string(buildTime) + "ms");
+	}
+	else if (useBVH && refitBVHEachRender) {
+		size_t numOfRebuilds = useInstancing ? tlas.refit(scenePtr) : (bvh.refit(scenePtr) ? 1 : 0);
+		double refitTime = (double)std::chrono::duration_cast<std::chrono::milliseconds>(clock.now() - before).count();
+		Console::print ("BVH refit in " + std::to_string(refitTime) + "ms (" + std::to_string(numOfRebuilds) + " rebuilt)");
+	}
+	else if (useBVH && useInstancing) {
+		tlas.update(scenePtr); // Objects may have moved or been added, only the top level is rebuilt
+	}
+
+	BVH::resetTraversalCounters();
+	compileScene(*scenePtr);
+	if (useAOVs()) {
+		for (std::shared_ptr<Image>* aovImagePtr : { &m_albedoImagePtr, &m_normalImagePtr, &m_depthImagePtr })
+			if (!*aovImagePtr || (*aovImagePtr)->width() != width || (*aovImagePtr)->height() != height) *aovImagePtr = make_shared<Image> (width, height);
+	}
+	m_lightBVH.init(*scenePtr);
+	m_viewMat = scenePtr->camera()->computeViewMatrix ();
+
+	if (progressive) {
+		// The accumulated samples only hold for the camera they were traced with
+		const glm::mat4 projectionMat = scenePtr->camera()->computeProjectionMatrix ();
+		if (m_accumulation.size() != width * height || m_viewMat != m_accumulationViewMat || projectionMat != m_accumulationProjectionMat)
+			resetAccumulation();
+		if (useAOVs() && m_aovAccumulation.size() != width * height)
+			resetAccumulation(); // The AOVs of the accumulated samples were not kept
+		if (m_numOfAccumulatedSamples == 0) {
+			m_accumulation.assign(width * height, glm::vec3(0.0f, 0.0f, 0.0f));
+			m_aovAccumulation.assign(useAOVs() ? width * height : 0, AOVSample());
+			m_accumulationViewMat = m_viewMat;
+			m_accumulationProjectionMat = projectionMat;
+		}
+		// Counted before the pass: the pixels not yet traced keep the mean of the previous
+		// samples, so the image stays a valid estimate during the pass
+		m_firstSampleIndex = m_numOfAccumulatedSamples;
+		m_numOfAccumulatedSamples += numOfPixelSamples();
+	}
+	else {
+		resetAccumulation();
+		m_firstSampleIndex = 0;
+	}
+
 	// <---- Ray tracing code ---->
-	size_t numOfMeshes = scenePtr->numOfMeshes ();
-	glm::vec3 camPos = scenePtr->camera()->getPosition();
-	
-	RayHit rayHit = RayHit(0, 0, 0, 0);
-	Ray ray;
+	const Scene& scene = *scenePtr; // Not owned by the inner loops, which do not need to count references
 
 	// Precomputation
-	glm::vec3 viewRight,  viewUp,  viewDir,  eye;
-    float w;
-	std::vector<glm::mat4> modelViewMats;
-	std::vector<glm::mat4> normalMats;
-    if(useBVH) {
-		scenePtr->camera()->computeVectorsForRayAt(viewRight, viewUp, viewDir, eye, w);
-	
-		for (size_t i = 0; i < numOfMeshes; i++) {
-			const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(i);
-			glm::mat4 modelMat = mesh->computeTransformMatrix ();
-			glm::mat4 viewMat = scenePtr->camera()->computeViewMatrix ();
-			glm::mat4 modelViewMat = viewMat * modelMat;
-			glm::mat4 normalMat = glm::transpose (glm::inverse (modelViewMat));
-
-			modelViewMats.push_back(modelViewMat);
-			normalMats.push_back(normalMat);
+	RenderContext context;
+	scenePtr->camera()->computeVectorsForRayAt(context.viewRight, context.viewUp, context.viewDir, context.eye, context.w);
+
+	const size_t numOfScratches = numOfWorkers();
+	while (m_renderScratch.size() < numOfScratches) m_renderScratch.emplace_back(new RenderScratch());
+	for (size_t i = 0; i < m_renderScratch.size(); i++) {
+		m_renderScratch[i]->sampler = makeSampler(samplerType, samplerSeed);
+		m_renderScratch[i]->numOfTracedSamples = 0;
+	}
+	if (useWavefrontStages()) {
+		renderWavefront(scene, context);
+	}
+	else {
+		// The tiles, in row-major order, are shared out between the threads with work
+		// stealing: each thread starts with a band of the image and steals from the others
+		// once done, as the cost of the tiles varies much with what they see
+		const size_t numOfTilesX = (width + renderTileSize - 1) / renderTileSize;
+		const size_t numOfTilesY = (height + renderTileSize - 1) / renderTileSize;
+		parallelForStealing(numOfTilesX * numOfTilesY, [&](size_t worker, size_t tile) {
+			renderTile(scene, context, tile % numOfTilesX * renderTileSize, tile / numOfTilesX * renderTileSize, *m_renderScratch[worker]);
+		});
+	}
+
+	if (denoise) {
+		// The noisy mean stays in the accumulation of the progressive samples
+		std::chrono::time_point<std::chrono::high_resolution_clock> beforeDenoising = clock.now();
+		m_denoiser.numOfPasses = denoiserPasses;
+		m_denoiser.denoise(*m_imagePtr, *m_albedoImagePtr, *m_normalImagePtr, *m_depthImagePtr, *m_imagePtr);
+		double denoisingTime = (double)std::chrono::duration_cast<std::chrono::milliseconds>(clock.now() - beforeDenoising).count();
+		if (!progressive) Console::print ("Denoised in " + std::to_string(denoisingTime) + "ms");
+	}
+
+	std::chrono::time_point<std::chrono::high_resolution_clock> after = clock.now();
+	double elapsedTime = (double)std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count();
+	if (useAdaptiveAA()) {
+		size_t numOfTracedSamples = 0;
+		for (const std::unique_ptr<RenderScratch>& scratch : m_renderScratch) numOfTracedSamples += scratch->numOfTracedSamples;
+		Console::print ("Ray tracing executed in " + std::to_string(elapsedTime) + "ms (adaptive anti-aliasing, " + std::to_string((double)numOfTracedSamples / (double)(width * height)) + " samples per pixel)");
+	}
+	else if (!progressive)
+		Console::print ("Ray tracing executed in " + std::to_string(elapsedTime) + "ms");
+	else if ((m_numOfAccumulatedSamples & (m_numOfAccumulatedSamples - 1)) == 0) // Not at every pass
+		Console::print ("Progressive ray tracing: " + std::to_string(m_numOfAccumulatedSamples) + " samples per pixel, last pass in " + std::to_string(elapsedTime) + "ms");
+#ifdef BVH_COUNTERS
+	if (useBVH) std::cout << "BVH traversal: " << BVH::traversalCounters() << std::endl;
+#endif
+}
+
+void RayTracer::renderTile (const Scene& scene, const RenderContext& context, size_t tileX, size_t tileY, RenderScratch& scratch) {
+	const size_t width = m_imagePtr->width();
+	const size_t height = m_imagePtr->height();
+	const size_t tileWidth = std::min(renderTileSize, width - tileX);
+	const size_t tileHeight = std::min(renderTileSize, height - tileY);
+	scratch.tileColors.assign(renderTileSize * renderTileSize, glm::vec3(0.0f, 0.0f, 0.0f));
+	scratch.tileStats.assign(renderTileSize * renderTileSize, PixelStats());
+	if (useAOVs()) scratch.tileAOVs.assign(renderTileSize * renderTileSize, AOVSample());
+
+	// The pixels are visited in Morton order, consecutive rays stay close to each other
+	std::vector<uint32_t>& pixels = scratch.tilePixels;
+	pixels.clear();
+	for(size_t i=0; i<renderTileSize*renderTileSize; i++) {
+		const size_t x = compactBits(i);
+		const size_t y = compactBits(i >> 1);
+		if(x < tileWidth && y < tileHeight) pixels.push_back((uint32_t)(y * renderTileSize + x));
+	}
+	auto traceSamples = [&](const std::vector<uint32_t>& tracedPixels, size_t firstSample, size_t endSample) {
+		if (useBVH && usePackets && !pathTracing) renderTilePackets(scene, context, tileX, tileY, tracedPixels, firstSample, endSample, scratch);
+		else renderTileRays(scene, context, tileX, tileY, tracedPixels, firstSample, endSample, scratch);
+		scratch.numOfTracedSamples += tracedPixels.size() * (endSample - firstSample);
+	};
+
+	if (useAdaptiveAA()) {
+		// Every round doubles the samples of the pixels that need more, which all have the same
+		// count: the low-discrepancy samplers are best at powers of two
+		const size_t maxSamples = (size_t)std::max(1, adaptiveMaxSamples);
+		size_t numOfSamples = std::min((size_t)std::max(1, adaptiveMinSamples), maxSamples);
+		traceSamples(pixels, 0, numOfSamples);
+		std::vector<uint32_t>& refinedPixels = scratch.refinedPixels;
+		while (numOfSamples < maxSamples && !pixels.empty()) {
+			refinedPixels.clear();
+			for (uint32_t pixel : pixels)
+				if (needsMoreSamples(scratch.tileColors[pixel], scratch.tileStats[pixel])) refinedPixels.push_back(pixel);
+			const size_t nextNumOfSamples = std::min(2 * numOfSamples, maxSamples);
+			if (!refinedPixels.empty()) traceSamples(refinedPixels, numOfSamples, nextNumOfSamples);
+			numOfSamples = nextNumOfSamples;
+			pixels.swap(refinedPixels);
 		}
 	}
+	else traceSamples(pixels, 0, numOfPixelSamples());
+
+	// Written row by row, as the image is stored
+	for(size_t y=0; y<tileHeight; y++) {
+		for(size_t x=0; x<tileWidth; x++) {
+			storePixel(tileX + x, tileY + y, scratch.tileColors[y * renderTileSize + x], scratch.tileStats[y * renderTileSize + x].numOfSamples);
+			if (useAOVs()) storeAOVs(tileX + x, tileY + y, scratch.tileAOVs[y * renderTileSize + x], scratch.tileStats[y * renderTileSize + x].numOfSamples);
+		}
+	}
+}
+
+bool RayTracer::needsMoreSamples (const glm::vec3& sum, const PixelStats& stats) const {
+	// The samples seeing different objects sit across a silhouette or the edge of a
+	// material, whatever the variance of the few samples drawn so far
+	if (stats.edge) return true;
+	// A single sample tells neither, so the pixel gets a second one
+	if (stats.numOfSamples < 2) return true;
+	// Otherwise the pixel is refined while the standard error of its mean luminance is high.
+	// It is compared to the square root of the mean, the eye seeing the same error better
+	// in the dark pixels, down to a floor for the black ones.
+	const float n = (float)stats.numOfSamples;
+	const float mean = glm::dot(sum, glm::vec3(0.2126f, 0.7152f, 0.0722f)) / n;
+	const float variance = std::max(0.0f, (stats.luminanceSquares - n * mean * mean) / (n - 1.0f));
+	const float standardError = std::sqrt(variance / n);
+	return standardError > adaptiveThreshold * std::sqrt(std::max(mean, 0.01f));
+}
+
+void RayTracer::samplePosition (size_t x, size_t y, size_t sample, Sampler& sampler, float& shiftedX, float& shiftedY) const {
+	sampler.startPixelSample((uint32_t)x, (uint32_t)y, (uint32_t)(m_firstSampleIndex + sample));
+	const glm::vec2 u = sampler.get2D();
+	if(progressive || useAdaptiveAA() || (alias_number > 1 && samplerType != SamplerType::PCG)) { // Over the whole pixel, the low-discrepancy samplers spread the samples by themselves
+		shiftedX = x + u.x - 0.5f;
+		shiftedY = y + u.y - 0.5f;
+	}
+	else if(alias_number > 1) { // Use anti-aliasing, a sample per cell of an alias_number x alias_number grid
+		const size_t kx = sample / alias_number;
+		const size_t ky = sample % alias_number;
+		shiftedX = x + (kx + u.x) /(float)(alias_number) - 0.5f;
+		shiftedY = y + (ky + u.y) /(float)(alias_number) - 0.5f;
+	}
+	else { // No anti-aliasing
+		shiftedX = x;
+		shiftedY = y;
+	}
+}
+
+void RayTracer::storePixel (size_t x, size_t y, const glm::vec3& sum, size_t numOfSamples) {
+	glm::vec3& pixel = m_imagePtr->operator()(x, y);
+	if(progressive) {
+		glm::vec3& accumulated = m_accumulation[y * m_imagePtr->width() + x];
+		accumulated += sum;
+		pixel = accumulated / (float)m_numOfAccumulatedSamples;
+	}
+	else pixel = sum / (float)numOfSamples;
+}
+
+void RayTracer::storeAOVs (size_t x, size_t y, const AOVSample& sum, size_t numOfSamples) {
+	AOVSample mean = sum;
+	float n = (float)numOfSamples;
+	if(progressive) {
+		AOVSample& accumulated = m_aovAccumulation[y * m_imagePtr->width() + x];
+		accumulated += sum;
+		mean = accumulated;
+		n = (float)m_numOfAccumulatedSamples;
+	}
+	m_albedoImagePtr->operator()(x, y) = mean.albedo / n;
+	m_normalImagePtr->operator()(x, y) = mean.normal / n;
+	m_depthImagePtr->operator()(x, y) = glm::vec3(mean.depth / n);
+}
+
+AOVSample RayTracer::surfaceAOVs (const RayHit& rayHit, size_t object_index, size_t triangle_index) const {
+	AOVSample aov;
+	aov.albedo = m_compiledScene.objectMaterial(object_index).albedo();
+	aov.normal = glm::normalize(m_compiledScene.hitNormal(rayHit, object_index, triangle_index));
+	aov.depth = -(m_viewMat * glm::vec4(m_compiledScene.hitPosition(rayHit, object_index, triangle_index), 1.0f)).z;
+	return aov;
+}
 
+void RayTracer::renderTileRays (const Scene& scene, const RenderContext& context, size_t tileX, size_t tileY, const std::vector<uint32_t>& pixels, size_t firstSample, size_t endSample, RenderScratch& scratch) {
+	const size_t width = m_imagePtr->width();
+	const size_t height = m_imagePtr->height();
+	const size_t numOfObjects = m_compiledScene.numOfObjects ();
+	const glm::vec3 backgroundColor = m_compiledScene.backgroundColor ();
+	Camera& camera = *scene.camera();
+	glm::vec3 viewRight = context.viewRight, viewUp = context.viewUp, viewDir = context.viewDir, eye = context.eye;
+	float w = context.w;
+	RayHit rayHit = RayHit(0, 0, 0, 0);
+	Ray ray;
 	float posX, posY;
 	float shiftedX, shiftedY;
-	float rx, ry;
-	glm::vec3 color;
-	glm::vec3 backgroundColor = scenePtr->backgroundColor ();
-
-	for(size_t x=0; x<width; x++) {
-		for(size_t y=0; y<height; y++) {
-			color = glm::vec3(0.0f, 0.0f, 0.0f);
-
-			for(size_t kx=0; kx<alias_number; kx++) {
-				for(size_t ky=0; ky<alias_number; ky++) {
-					if(alias_number > 1) { // Use anti-aliasing
-						rx = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-						ry = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-						shiftedX = x + (kx + rx) /(float)(alias_number) - 0.5f;
-						shiftedY = y + (ky + ry) /(float)(alias_number) - 0.5f;
-					}
-					else { // No anti-aliasing
-						shiftedX = x;
-						shiftedY = y;
-					}
-					posX = shiftedX / (float)(width  - 1);
-					posY = 1 - (shiftedY / (float)(height - 1));
-
-					rayHit.t = std::numeric_limits<float>::max();
-
-					if (useBVH) {
-						ray = scenePtr->camera()->rayAt(posX, posY, viewRight, viewUp, viewDir, eye, w);
-						size_t mesh_index = 0;
-						size_t triangle_index = 0;
-						bool hit = bvh.intersect(scenePtr, rayHit, ray, mesh_index, triangle_index);
-						if(hit) color += shade(scenePtr, rayHit, mesh_index, triangle_index, modelViewMats[mesh_index], normalMats[mesh_index]);
-						else 	color += backgroundColor;
-					}
-					else {
-						ray = scenePtr->camera()->rayAt(posX, posY);
-						for (size_t i = 0; i < numOfMeshes; i++) {
-							const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(i);
-
-							const std::vector<glm::vec3>& vertexPositions  = mesh->vertexPositions();
-							const std::vector<glm::uvec3>& triangleIndices = mesh->triangleIndices();
-							const size_t nbTriangles = triangleIndices.size();
-
-							for(size_t k=0; k<nbTriangles; k++) {
-								const glm::uvec3& trianglePos = triangleIndices[k];
-								const glm::vec3& p0 = vertexPositions[trianglePos[0]];
-								const glm::vec3& p1 = vertexPositions[trianglePos[1]];
-								const glm::vec3& p2 = vertexPositions[trianglePos[2]];
-								
-								bool hit = ray.intersect(rayHit, p0, p1, p2);
-								if(hit) color += shade(scenePtr, rayHit, i, k);
-								else 	color += backgroundColor;
-							}
+
+	for(uint32_t pixel : pixels) {
+		const size_t x = tileX + pixel % renderTileSize;
+		const size_t y = tileY + pixel / renderTileSize;
+
+		for(size_t sample=firstSample; sample<endSample; sample++) {
+			glm::vec3 color = glm::vec3(0.0f, 0.0f, 0.0f);
+			uint32_t surface = 0;
+			AOVSample aov = backgroundAOVs();
+			samplePosition(x, y, sample, *scratch.sampler, shiftedX, shiftedY);
+			posX = shiftedX / (float)(width  - 1);
+			posY = 1 - (shiftedY / (float)(height - 1));
+
+			rayHit.t = std::numeric_limits<float>::max();
+			ray = camera.rayAt(posX, posY, viewRight, viewUp, viewDir, eye, w);
+
+			if (useBVH && pathTracing) {
+				color += tracePath(ray, *scratch.sampler, surface, aov);
+			}
+			else if (useBVH) {
+				size_t object_index = 0;
+				size_t triangle_index = 0;
+				bool hit = traceRay(rayHit, ray, object_index, triangle_index);
+				if(hit) {
+					surface = (uint32_t)object_index + 1;
+					color += shade(rayHit, object_index, triangle_index, *scratch.sampler);
+					if (useAOVs()) aov = surfaceAOVs(rayHit, object_index, triangle_index);
+				}
+				else 	color += backgroundColor;
+			}
+			else {
+				// Every triangle of the compiled scene, in the space of its object, for the nearest hit
+				size_t object_index = 0;
+				size_t triangle_index = 0;
+				bool hit = false;
+				for (size_t i = 0; i < numOfObjects; i++) {
+					const Ray objectRay = m_compiledScene.toObjectSpace(ray, i);
+					const size_t numOfTriangles = m_compiledScene.numOfTriangles(i);
+					for(size_t k=0; k<numOfTriangles; k++) {
+						const glm::uvec3& trianglePos = m_compiledScene.triangle(i, k);
+						if(objectRay.intersect(rayHit, m_compiledScene.position(trianglePos[0]), m_compiledScene.position(trianglePos[1]), m_compiledScene.position(trianglePos[2]))) {
+							object_index = i;
+							triangle_index = k;
+							hit = true;
 						}
 					}
 				}
+				if(hit) {
+					surface = (uint32_t)object_index + 1;
+					color += shade(rayHit, object_index, triangle_index, *scratch.sampler);
+					if (useAOVs()) aov = surfaceAOVs(rayHit, object_index, triangle_index);
+				}
+				else 	color += backgroundColor;
 			}
-			m_imagePtr->operator()(x,y) = color / (float)(alias_number*alias_number);
+			scratch.addSample(pixel, color, surface);
+			if (useAOVs()) scratch.tileAOVs[pixel] += aov;
 		}
 	}
-
-	std::chrono::time_point<std::chrono::high_resolution_clock> after = clock.now();
-	double elapsedTime = (double)std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count();
-	Console::print ("Ray tracing executed in " + std::to_string(elapsedTime) + "ms");
 }
 
+void RayTracer::renderTilePackets (const Scene& scene, const RenderContext& context, size_t tileX, size_t tileY, const std::vector<uint32_t>& pixels, size_t firstSample, size_t endSample, RenderScratch& scratch) {
+	// Every run of RayPacket::maxSize pixels is traced as one packet per sample, then the
+	// shadow rays of their hits as one packet per light. In Morton order, the runs of a whole
+	// tile are its packetTileSize x packetTileSize blocks; those of the pixels an adaptive
+	// round refines are spread wider, but along the same edges.
+	static_assert(packetTileSize * packetTileSize == RayPacket::maxSize, "A packet is a block of the tile");
+	const size_t width = m_imagePtr->width();
+	const size_t height = m_imagePtr->height();
+	const size_t numOfLightSourcesDir = m_compiledScene.numOfLightSourcesDir();
+	const glm::vec3 backgroundColor = m_compiledScene.backgroundColor ();
+	Camera& camera = *scene.camera();
+	glm::vec3 viewRight = context.viewRight, viewUp = context.viewUp, viewDir = context.viewDir, eye = context.eye;
+	float w = context.w;
+	RayPacket& packet = scratch.packet;
+	RayPacket& shadowPacket = scratch.shadowPacket;
+	size_t shadowRayOf[RayPacket::maxSize]; // Index in the shadow packet of the hit of each primary ray
+	uint32_t pixelOf[RayPacket::maxSize]; // Index in the tile colors of each primary ray
+	std::vector<uint64_t>& occludedRays = scratch.occludedRays;
+	std::vector<bool>& lightOcclusion = scratch.lightOcclusion;
+	occludedRays.resize(numOfLightSourcesDir);
+	lightOcclusion.resize(numOfLightSourcesDir);
+	float posX, posY;
+	float shiftedX, shiftedY;
 
+	for(size_t run=0; run<pixels.size(); run+=RayPacket::maxSize) {
+		const size_t runEnd = std::min(run + RayPacket::maxSize, pixels.size());
+
+		for(size_t sample=firstSample; sample<endSample; sample++) {
+			packet.clear();
+			for(size_t i=run; i<runEnd; i++) {
+				const size_t x = tileX + pixels[i] % renderTileSize;
+				const size_t y = tileY + pixels[i] / renderTileSize;
+				samplePosition(x, y, sample, *scratch.sampler, shiftedX, shiftedY);
+				posX = shiftedX / (float)(width  - 1);
+				posY = 1 - (shiftedY / (float)(height - 1));
+				pixelOf[packet.add(camera.rayAt(posX, posY, viewRight, viewUp, viewDir, eye, w))] = pixels[i];
+			}
+			traceRays(packet);
+
+			if (useOcclusion) {
+				for (size_t l = 0; l < numOfLightSourcesDir; l++) {
+					const LightSourceDir& lightSource = m_compiledScene.lightSourceDir(l);
+					shadowPacket.clear();
+					for (size_t i = 0; i < packet.size; i++) {
+						if (!packet.hit(i)) continue;
+						Ray rayOcclusion;
+						rayOcclusion.origin = worldHitPosition(packet.rayHit(i), packet.objectIndex[i], packet.triangleIndex[i]);
+						rayOcclusion.setDirection(- lightSource.direction);
+						shadowRayOf[i] = shadowPacket.add(rayOcclusion);
+					}
+					traceShadowRays(shadowPacket);
+					occludedRays[l] = 0;
+					for (size_t i = 0; i < packet.size; i++) {
+						if (packet.hit(i) && shadowPacket.hit(shadowRayOf[i])) occludedRays[l] |= 1ull << i;
+					}
+				}
+			}
 
-glm::vec3 RayTracer::shade(const std::shared_ptr<Scene> scenePtr, RayHit& rayHit, size_t& mesh_index, size_t& triangle_index) {
-	const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(mesh_index);
-	glm::mat4 modelMat = mesh->computeTransformMatrix ();
-	glm::mat4 viewMat = scenePtr->camera()->computeViewMatrix ();
-	glm::mat4 modelViewMat = viewMat * modelMat;
-	glm::mat4 normalMat = glm::transpose (glm::inverse (modelViewMat));
-
-	return shade(scenePtr, rayHit, mesh_index, triangle_index, modelViewMat, normalMat);
+			for (size_t i = 0; i < packet.size; i++) {
+				if (!packet.hit(i)) {
+					scratch.addSample(pixelOf[i], backgroundColor, 0);
+					if (useAOVs()) scratch.tileAOVs[pixelOf[i]] += backgroundAOVs();
+					continue;
+				}
+				for (size_t l = 0; l < numOfLightSourcesDir; l++) lightOcclusion[l] = useOcclusion && ((occludedRays[l] >> i) & 1);
+				const size_t object_index = packet.objectIndex[i];
+				// The sampler goes back to the pixel sample of the ray, after its position
+				scratch.sampler->startPixelSample((uint32_t)(tileX + pixelOf[i] % renderTileSize), (uint32_t)(tileY + pixelOf[i] / renderTileSize), (uint32_t)(m_firstSampleIndex + sample), pixelDimensions);
+				scratch.addSample(pixelOf[i], shade(packet.rayHit(i), object_index, packet.triangleIndex[i], *scratch.sampler, &lightOcclusion), (uint32_t)object_index + 1);
+				if (useAOVs()) scratch.tileAOVs[pixelOf[i]] += surfaceAOVs(packet.rayHit(i), object_index, packet.triangleIndex[i]);
+			}
+		}
+	}
 }
 
-glm::vec3 RayTracer::shade(const std::shared_ptr<Scene> scenePtr, RayHit& rayHit, size_t& mesh_index, size_t& triangle_index, glm::mat4& modelViewMat, glm::mat4& normalMat) {
-	// To compute the shading
-	const std::shared_ptr<Mesh>& mesh = scenePtr->mesh(mesh_index);
-	size_t materialIndex = scenePtr->getMaterialOfMesh(mesh_index);
-	std::shared_ptr<Material> material  = scenePtr->material(materialIndex);
-	const std::vector<glm::vec3>& vertexPositions  = mesh->vertexPositions();
-	const std::vector<glm::vec3>& vertexNormals    = mesh->vertexNormals();
-	const std::vector<glm::uvec3>& triangleIndices = mesh->triangleIndices();
-	const glm::uvec3& trianglePos = triangleIndices[triangle_index];
+
+
+glm::vec3 RayTracer::shade(const RayHit& rayHit, size_t object_index, size_t triangle_index, Sampler& sampler, const std::vector<bool>* lightOcclusion, const PointLightPick* pointLightPicks) {
+	// To compute the shading, in view space
+	const CompiledScene& scene = m_compiledScene;
+	const Material& material = scene.objectMaterial(object_index);
+	const glm::mat3 viewRotation = glm::mat3(m_viewMat); // The view is a rigid transform
 
 	// fPosition
-	const glm::vec3& p0 = vertexPositions[trianglePos[0]];
-	const glm::vec3& p1 = vertexPositions[trianglePos[1]];
-	const glm::vec3& p2 = vertexPositions[trianglePos[2]];
-	const glm::vec3 interpolatedPos = rayHit.hitPosition(p1, p2, p0);
-	glm::vec3 fPosition =  glm::vec3(modelViewMat * glm::vec4(interpolatedPos, 1.0f));
+	const glm::vec3 worldPosition = scene.hitPosition(rayHit, object_index, triangle_index);
+	glm::vec3 fPosition = glm::vec3(m_viewMat * glm::vec4(worldPosition, 1.0f));
 
 	// Normal
-	const glm::vec3& n0 = vertexNormals[trianglePos[0]];
-	const glm::vec3& n1 = vertexNormals[trianglePos[1]];
-	const glm::vec3& n2 = vertexNormals[trianglePos[2]];
-	const glm::vec3 vNormal = glm::normalize(rayHit.hitPosition(n1, n2, n0));
-	glm::vec3 fNormal = glm::normalize(glm::vec3(normalMat * glm::vec4 (normalize (vNormal), 1.0)));
+	const glm::vec3 worldNormal = glm::normalize(scene.hitNormal(rayHit, object_index, triangle_index));
+	glm::vec3 fNormal = viewRotation * worldNormal;
 
-	const size_t numOfLightSourcesDir = scenePtr->numOfLightSourcesDir();
+	const size_t numOfLightSourcesDir = scene.numOfLightSourcesDir();
 	glm::vec3 r = glm::vec3(0., 0., 0.);
 	Ray rayOcclusion;
 
 	for(size_t i=0; i<numOfLightSourcesDir; i++) {
-		auto lightSourcePtr = scenePtr->lightSourceDir(i);
+		LightSourceDir lightSource = scene.lightSourceDir(i); // A copy, get_r takes its intensity and color by reference
 
 		bool hit = false;
-		if(useOcclusion) {
-			rayOcclusion.origin = interpolatedPos;
-			rayOcclusion.setDirection(- lightSourcePtr->direction);
-			hit = bvh.fastIntersect(scenePtr, rayOcclusion);
+		if(lightOcclusion) {
+			hit = (*lightOcclusion)[i];
+		}
+		else if(useOcclusion) {
+			rayOcclusion.origin = worldPosition;
+			rayOcclusion.setDirection(- lightSource.direction);
+			hit = traceShadowRay(rayOcclusion);
 		}
 
 		if(!hit) {
-			glm::vec3 lightDirection = glm::normalize(glm::vec3(normalMat * glm::vec4(lightSourcePtr->direction, 1.0)));
-			r += get_r(material, fPosition, fNormal, -lightDirection, lightSourcePtr->intensity, lightSourcePtr->color);
+			glm::vec3 lightDirection = glm::normalize(viewRotation * lightSource.direction);
+			r += get_r(material, fPosition, fNormal, -lightDirection, lightSource.intensity, lightSource.color);
+		}
+	}
+
+	// Point lights: a few are picked from the light BVH, each weighted by the inverse of the
+	// probability it had to be picked, instead of looping over all of them
+	if(!m_lightBVH.empty() && pointLightSamples > 0) {
+		for(int s=0; s<pointLightSamples; s++) {
+			size_t light_index;
+			float pmf;
+			if(pointLightPicks) {
+				const PointLightPick& pick = pointLightPicks[s];
+				if(pick.light_index == PointLightPick::none) break;
+				if(pick.occluded) continue;
+				light_index = pick.light_index;
+				pmf = pick.pmf;
+			}
+			else if(!m_lightBVH.sample(worldPosition, worldNormal, sampler.get1D(), light_index, pmf)) break;
+			const LightSourcePoint& light = scene.lightSourcePoint(light_index);
+
+			if(useOcclusion && !pointLightPicks) {
+				// The direction reaches the light at t = 1
+				rayOcclusion.origin = worldPosition;
+				rayOcclusion.setDirection(light.position - worldPosition);
+				if(traceShadowRay(rayOcclusion, 1.0f)) continue;
+			}
+
+			glm::vec3 lightDirection = glm::vec3(m_viewMat * glm::vec4(light.position, 1.0f)) - fPosition;
+			float d = glm::length(lightDirection);
+			lightDirection /= d;
+			float Li = light.intensity / (light.a_c + light.a_l * d + light.a_q * d * d) / (pmf * pointLightSamples);
+			glm::vec3 lightColor = light.color;
+			r += get_r(material, fPosition, fNormal, lightDirection, Li, lightColor);
 		}
 	}
 
 	return r;
 }
 
-glm::vec3 RayTracer::get_fd(std::shared_ptr<Material> material) {
-	return material->albedo() / (float)(PI);
+glm::vec3 RayTracer::get_fd(const Material& material) {
+	return material.albedo() / (float)(PI);
 }
 
-glm::vec3 RayTracer::get_fs(std::shared_ptr<Material> material, glm::vec3& w0, glm::vec3& wi, glm::vec3& wh, glm::vec3& n) {
-	float alpha = material->roughness();
+glm::vec3 RayTracer::get_fs(const Material& material, glm::vec3& w0, glm::vec3& wi, glm::vec3& wh, glm::vec3& n) {
+	float alpha = material.roughness();
 	float alpha2 = pow(alpha, 2.0f);
 		
 	float n_wh2 = pow(std::max(0.0f, dot(n, wh)), 2.0f);
@@ -202,8 +553,8 @@ glm::vec3 RayTracer::get_fs(std::shared_ptr<Material> material, glm::vec3& w0, g
 	float wi_wh = std::max(0.0f, glm::dot(wi, wh));
 	float D = alpha2 / (PI * pow(1.0f + (alpha2 - 1.0f) * n_wh2, 2.0f));
 		
-	glm::vec3 F0 = material->albedo() + (glm::vec3(1.) - material->albedo()) * material->metallicness();
-	glm::vec3 F = F0 - (float)(pow(1.0f - wi_wh, 5.0f)) * (glm::vec3(1.0f) - F0);
+	glm::vec3 F0 = material.albedo() + (glm::vec3(1.) - material.albedo()) * material.metallicness();
+	glm::vec3 F = F0 + (float)(pow(1.0f - wi_wh, 5.0f)) * (glm::vec3(1.0f) - F0);
 		
 	float G1 = 2.0f * n_wi / (n_wi+sqrt(alpha2+(1-alpha2)*pow(n_wi, 2.0f)));
 	float G2 = 2.0f * n_w0 / (n_w0+sqrt(alpha2+(1-alpha2)*pow(n_w0, 2.0f)));
@@ -213,16 +564,18 @@ glm::vec3 RayTracer::get_fs(std::shared_ptr<Material> material, glm::vec3& w0, g
 	return fs;
 }
 
-glm::vec3 RayTracer::get_r(std::shared_ptr<Material> material, glm::vec3& fPosition, glm::vec3& fNormal, glm::vec3& lightDirection, float& lightIntensity, glm::vec3& lightColor) {
+glm::vec3 RayTracer::get_r(const Material& material, glm::vec3& fPosition, glm::vec3& fNormal, glm::vec3 lightDirection, float& lightIntensity, glm::vec3& lightColor) {
 	glm::vec3 w0 = - glm::normalize(fPosition);
 	glm::vec3& wi = lightDirection;
 	glm::vec3 wh = glm::normalize(wi + w0);
 
 	glm::vec3& n = fNormal;
+	float scalarProd = dot(n, wi);
+	if (scalarProd <= 0.0f)
+		return glm::vec3(0.0f); // Light behind the surface, get_fs would divide by zero at grazing angles
 	glm::vec3 fs = get_fs(material, w0, wi, wh, n);
 	glm::vec3 fd = get_fd(material);
 
-	float scalarProd = max(0.0f, dot(n, wi));
 	glm::vec3 luminosity = lightIntensity * lightColor;
 		
 	return luminosity * (fd + fs) * scalarProd;
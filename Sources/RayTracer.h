@@ -24,32 +24,222 @@
 #include "RayHit.h"
 #include "Triangle.h"
 #include "Material.h"
+#include "RayQueue.h"
+#include "Sampler.h"
+#include "CompiledScene.h"
+#include "Denoiser.h"
 #include "BVH/BVH.h"
+#include "BVH/TLAS.h"
+#include "BVH/LightBVH.h"
 
 using namespace std;
 
+/// What the pixels of a render share, computed once per render
+struct RenderContext {
+	glm::vec3 viewRight, viewUp, viewDir, eye;
+	float w;
+};
+
+/// What the adaptive anti-aliasing knows of the samples of a pixel, besides their sum
+struct PixelStats {
+	float luminanceSquares = 0.0f; // Sum of the squared luminances of the samples
+	uint32_t numOfSamples = 0;
+	uint32_t surface = 0; // Object hit by the first sample plus one, 0 for the background
+	bool edge = false; // Set when the samples hit different surfaces
+};
+
+/// Auxiliary outputs (AOVs) of a sample, of the first surface its camera ray hits, which tell
+/// the denoiser where the edges of the image are. Summed over the samples of a pixel.
+struct AOVSample {
+	glm::vec3 albedo = glm::vec3(0.0f); // The background color for the background
+	glm::vec3 normal = glm::vec3(0.0f); // Shading normal in world space, 0 for the background
+	float depth = 0.0f; // Along the view direction, 0 for the background
+
+	inline AOVSample& operator+= (const AOVSample& other) {
+		albedo += other.albedo;
+		normal += other.normal;
+		depth += other.depth;
+		return *this;
+	}
+};
+
+/// Point light picked from the light BVH for a shading point, with the occlusion of its shadow
+/// ray when it was traced beforehand
+struct PointLightPick {
+	static constexpr uint32_t none = 0xffffffff; // No light could be picked, nor at the next picks
+
+	uint32_t light_index = none;
+	float pmf = 0.0f; // Probability the light had to be picked
+	uint8_t occluded = 0;
+};
+
+/// State of a render thread, kept between renders
+struct RenderScratch {
+	/// Adds the sample 'color' to the pixel of the tile, 'surface' being the object it hit plus one, 0 for the background
+	inline void addSample (size_t pixel, const glm::vec3& color, uint32_t surface) {
+		tileColors[pixel] += color;
+		PixelStats& stats = tileStats[pixel];
+		const float luminance = glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		stats.luminanceSquares += luminance * luminance;
+		if (stats.numOfSamples++ == 0) stats.surface = surface;
+		else if (stats.surface != surface) stats.edge = true;
+	}
+
+	RayPacket packet;
+	RayPacket shadowPacket;
+	std::vector<uint64_t> occludedRays; // Per directional light, the rays of the packet whose shadow ray is occluded
+	std::vector<bool> lightOcclusion;
+	std::vector<glm::vec3> tileColors; // Sum of the samples of the pixels of the tile, row by row
+	std::vector<PixelStats> tileStats; // Of the pixels of the tile, row by row
+	std::vector<AOVSample> tileAOVs; // Sums of the AOVs of the pixels of the tile, row by row, when they are output
+	std::vector<uint32_t> tilePixels; // Pixels of the tile to trace, as indices in tileColors, in Morton order
+	std::vector<uint32_t> refinedPixels; // Those of them that need more samples, with the adaptive anti-aliasing
+	size_t numOfTracedSamples = 0; // Since the start of the render
+	std::unique_ptr<Sampler> sampler; // Of the pixel sample being traced
+};
+
 class RayTracer {
 public:
 	
 	RayTracer();
 	virtual ~RayTracer();
 
-	inline void setResolution (int width, int height) { m_imagePtr = make_shared<Image> (width, height); }
+	inline void setResolution (int width, int height) {
+		if (m_imagePtr->width() != (size_t)width || m_imagePtr->height() != (size_t)height) m_imagePtr = make_shared<Image> (width, height);
+	}
 	inline std::shared_ptr<Image> image () { return m_imagePtr; }
+	/// AOVs of the last render, as the means over the samples of each pixel, when outputAOVs or
+	/// denoise is set: the albedo, the world space normal and the depth, in every channel
+	inline std::shared_ptr<Image> albedoImage () { return m_albedoImagePtr; }
+	inline std::shared_ptr<Image> normalImage () { return m_normalImagePtr; }
+	inline std::shared_ptr<Image> depthImage () { return m_depthImagePtr; }
 	void init (const std::shared_ptr<Scene> scenePtr);
+	/// Renders the image, or in progressive mode adds progressiveSamples samples per pixel to
+	/// the accumulated ones, the image being their mean
 	void render (const std::shared_ptr<Scene> scenePtr);
+	/// Restarts the progressive accumulation, to call when the scene or the settings change.
+	/// A change of the camera or of the resolution restarts it by itself.
+	inline void resetAccumulation () { m_numOfAccumulatedSamples = 0; }
+	/// Samples per pixel the progressive image is the mean of
+	inline size_t numOfAccumulatedSamples () const { return m_numOfAccumulatedSamples; }
 
-	glm::vec3 shade(const std::shared_ptr<Scene> scenePtr, RayHit& rayHit, size_t& mesh_index, size_t& triangle_index);
-	glm::vec3 shade(const std::shared_ptr<Scene> scenePtr, RayHit& rayHit, size_t& mesh_index, size_t& triangle_index, glm::mat4& modelViewMat, glm::mat4& normalMat);
-	glm::vec3 get_fd(std::shared_ptr<Material> material);
-	glm::vec3 get_fs(std::shared_ptr<Material> material, glm::vec3& w0, glm::vec3& wi, glm::vec3& wh, glm::vec3& n);
-	glm::vec3 get_r (std::shared_ptr<Material> material, glm::vec3& fPosition, glm::vec3& fNormal, glm::vec3& lightDirection, float& lightIntensity, glm::vec3& lightColor);
+	/// Shades the hit of the triangle 'triangle_index' of the object 'object_index', from the
+	/// compiled scene of the render. 'lightOcclusion' gives the occlusion of each directional
+	/// light when it was traced beforehand, otherwise the shadow rays are traced here when
+	/// useOcclusion is set. 'sampler', started at the pixel sample, picks the point lights,
+	/// unless the pointLightSamples picks are given in 'pointLightPicks' with their occlusion.
+	glm::vec3 shade(const RayHit& rayHit, size_t object_index, size_t triangle_index, Sampler& sampler, const std::vector<bool>* lightOcclusion = nullptr, const PointLightPick* pointLightPicks = nullptr);
+	glm::vec3 get_fd(const Material& material);
+	glm::vec3 get_fs(const Material& material, glm::vec3& w0, glm::vec3& wi, glm::vec3& wh, glm::vec3& n);
+	glm::vec3 get_r (const Material& material, glm::vec3& fPosition, glm::vec3& fNormal, glm::vec3 lightDirection, float& lightIntensity, glm::vec3& lightColor);
 
 	bool useBVH = true;
+	BVHBuilder bvhBuilder = BVHBuilder::SAH;
+	bool rebuildBVHEachRender = false; // For scenes whose vertices move between renders, best with the LBVH builder
+	bool refitBVHEachRender = false; // For meshes deformed between renders: the BVH follows the vertices, and is only rebuilt when its quality degrades
+	bool useInstancing = true; // One BVH per mesh under a top level over the objects, which follows their transforms
+	bool optimizeBVHTreelets = false; // Post-pass restructuring the small treelets of the built BVHs to lower their SAH cost
+	bool quantizeBVH = false; // 8-bit child bounds, half the memory traffic of the wide nodes for large scenes
+	std::string bvhCacheDirectory; // Where the BVHs of the meshes are cached between runs, with instancing only
+	bool usePackets = true; // Trace the pixels of packetTileSize x packetTileSize tiles together, and their shadow rays per light
+	bool useWavefront = false; // Generate, sort, trace and shade the rays a stage at a time over large batches, see Wavefront.cpp. Not with the path tracing.
 	bool useOcclusion = false;
+	int pointLightSamples = 1; // Point lights picked per shading point from the light BVH, each with its shadow ray when useOcclusion is set
 	int alias_number = 1;
+	// Adaptive anti-aliasing, in place of the alias_number x alias_number samples: every pixel
+	// starts with adaptiveMinSamples, then the pixels across an edge or still noisy get twice
+	// as many, round after round, up to adaptiveMaxSamples. Not in the progressive and
+	// wavefront modes, which trace the same samples everywhere.
+	bool adaptiveAA = false;
+	int adaptiveMinSamples = 4;
+	int adaptiveMaxSamples = 64;
+	float adaptiveThreshold = 0.01f; // Largest standard error of the mean luminance of a pixel, relative to its square root
+	SamplerType samplerType = SamplerType::Sobol; // Of the anti-aliasing, progressive and light samples
+	uint32_t samplerSeed = 0; // Renders with the same seed draw the same samples
+	bool progressive = false; // Every render adds samples to those of the previous renders, alias_number is not used
+	int progressiveSamples = 1; // Samples per pixel added by a progressive render, jittered over the pixel
+	// Path tracing in place of the direct lighting of shade, with the BVH, see PathTracer.cpp.
+	// The background lights the scene as a uniform sky, and every light is shadowed.
+	bool pathTracing = false;
+	int maxPathDepth = 8; // Vertices of a path at most
+	int rouletteDepth = 3; // Vertices after which the paths carrying little are randomly stopped
+	bool outputAOVs = false; // Fill albedoImage, normalImage and depthImage
+	// Denoising of the image with its AOVs, see Denoiser.h. The progressive samples are
+	// accumulated as traced, every render denoises their mean.
+	bool denoise = false;
+	int denoiserPasses = 5;
+
+	// Side of the pixel tiles traced as one packet, a packet holds at most RayPacket::maxSize rays
+	static constexpr size_t packetTileSize = 8;
+	// Side of the pixel tiles the render threads share out, a multiple of packetTileSize
+	static constexpr size_t renderTileSize = 32;
+	// Samples of a wavefront batch, the queues of a batch take about 64 bytes per sample
+	static constexpr size_t wavefrontBatchSize = 1 << 18;
 	
 private:
+	void buildBVH (const std::shared_ptr<Scene> scenePtr);
+	bool traceRay (RayHit& rayHit, Ray& ray, size_t& object_index, size_t& triangle_index);
+	bool traceShadowRay (Ray& ray, float tmax = std::numeric_limits<float>::infinity());
+	void traceRays (RayPacket& packet);
+	void traceShadowRays (RayPacket& packet);
+	/// Compiles the scene for the render, or brings the snapshot of the previous render up to date
+	void compileScene (const Scene& scene);
+	/// World space position of the hit of the triangle 'triangle_index' of the object 'object_index'
+	inline glm::vec3 worldHitPosition (const RayHit& rayHit, size_t object_index, size_t triangle_index) const { return m_compiledScene.hitPosition(rayHit, object_index, triangle_index); }
+	void renderTile (const Scene& scene, const RenderContext& context, size_t tileX, size_t tileY, RenderScratch& scratch);
+	/// Traces the samples [firstSample, endSample) of the pixels of the tile, given as indices in
+	/// its colors, and adds them to the colors and statistics of the pixels
+	void renderTileRays (const Scene& scene, const RenderContext& context, size_t tileX, size_t tileY, const std::vector<uint32_t>& pixels, size_t firstSample, size_t endSample, RenderScratch& scratch);
+	void renderTilePackets (const Scene& scene, const RenderContext& context, size_t tileX, size_t tileY, const std::vector<uint32_t>& pixels, size_t firstSample, size_t endSample, RenderScratch& scratch);
+	inline bool useAdaptiveAA () const { return adaptiveAA && !progressive && !useWavefrontStages(); }
+	bool needsMoreSamples (const glm::vec3& sum, const PixelStats& stats) const;
+	void renderWavefront (const Scene& scene, const RenderContext& context);
+	inline size_t numOfPixelSamples () const { return progressive ? (size_t)std::max(1, progressiveSamples) : (size_t)(alias_number * alias_number); }
+	/// Starts the sampler at the sample 'sample' of the render for the pixel (x, y), and
+	/// draws its position in the image
+	void samplePosition (size_t x, size_t y, size_t sample, Sampler& sampler, float& shiftedX, float& shiftedY) const;
+	// Dimensions of a pixel sample drawn by samplePosition, those of the shading follow
+	static constexpr uint32_t pixelDimensions = 2;
+	void storePixel (size_t x, size_t y, const glm::vec3& sum, size_t numOfSamples);
+	inline bool useAOVs () const { return outputAOVs || denoise; }
+	/// AOVs of the hit of the triangle 'triangle_index' of the object 'object_index'
+	AOVSample surfaceAOVs (const RayHit& rayHit, size_t object_index, size_t triangle_index) const;
+	inline AOVSample backgroundAOVs () const { AOVSample aov; aov.albedo = m_compiledScene.backgroundColor(); return aov; }
+	void storeAOVs (size_t x, size_t y, const AOVSample& sum, size_t numOfSamples);
+	/// Radiance along the camera ray, gathered by a path. 'surface' returns the object the ray
+	/// hits plus one, 0 for the background, and 'aov' the AOVs of the hit, when there is one.
+	glm::vec3 tracePath (Ray ray, Sampler& sampler, uint32_t& surface, AOVSample& aov);
+	/// The BRDF of shade, get_fd + get_fs, for the world space directions wo and wi around n
+	glm::vec3 brdf (const Material& material, const glm::vec3& n, const glm::vec3& wo, const glm::vec3& wi);
+	/// Density of the directions the path tracer draws from the BRDF
+	float brdfPdf (const Material& material, const glm::vec3& n, const glm::vec3& wo, const glm::vec3& wi) const;
+	float specularProbability (const Material& material, float nDotWo) const;
+	// Roughness below which the specular lobe is sampled as this one, GGX being a Dirac at 0
+	static constexpr float minRoughness = 1e-3f;
+	inline bool useWavefrontStages () const { return useBVH && useWavefront && !pathTracing; }
+
+	void computeRayKeys (RayQueue& queue) const;
+	/// Traces the rays of the queue, up to tmax for shadow rays
+	void traceQueue (RayQueue& queue, bool occlusion, float tmax = std::numeric_limits<float>::infinity());
+
 	std::shared_ptr<Image> m_imagePtr;
+	std::shared_ptr<Image> m_albedoImagePtr;
+	std::shared_ptr<Image> m_normalImagePtr;
+	std::shared_ptr<Image> m_depthImagePtr;
+	Denoiser m_denoiser;
 	BVH bvh;
+	TLAS tlas;
+	RayQueue m_cameraRays; // Queues of the wavefront stages, kept between renders
+	RayQueue m_shadowRays;
+	RayQueue m_pointShadowRays;
+	std::vector<std::unique_ptr<RenderScratch>> m_renderScratch; // Per render thread
+	size_t m_firstSampleIndex = 0; // Index in the sequence of every pixel of the first sample of the render
+	CompiledScene m_compiledScene; // What the rays read from the scene, brought up to date every render
+	LightBVH m_lightBVH; // Over the point lights, rebuilt every render
+	glm::mat4 m_viewMat; // Of the current render, to bring the shading points back to world space
+	std::vector<glm::vec3> m_accumulation; // Sum of the progressive samples of each pixel, row by row
+	std::vector<AOVSample> m_aovAccumulation; // Sum of their AOVs, when they are output
+	size_t m_numOfAccumulatedSamples = 0; // Per pixel, 0 when the accumulation restarts
+	glm::mat4 m_accumulationViewMat; // Camera of the accumulated samples
+	glm::mat4 m_accumulationProjectionMat;
 };
\ No newline at end of file
@@ -0,0 +1,246 @@
+#include "Sampler.h"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+
+namespace {
+
+// Finalizer of MurmurHash3, as a 64-bit mixing function
+inline uint64_t mixBits(uint64_t v) {
+	v ^= v >> 31;
+	v *= 0x7fb5d329728ea185ull;
+	v ^= v >> 27;
+	v *= 0x81dadef4bc2dd44dull;
+	v ^= v >> 33;
+	return v;
+}
+
+inline uint64_t hashOf(uint64_t a, uint64_t b, uint64_t c, uint64_t d) {
+	return mixBits(mixBits(mixBits(mixBits(a) ^ b) ^ c) ^ d);
+}
+
+// Uniform float in [0, 1) from the highest 24 bits of x
+inline float toFloat(uint32_t x) {
+	return (float)(x >> 8) * 0x1p-24f;
+}
+
+inline uint32_t reverseBits(uint32_t x) {
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+	x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+	x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+	x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+	return x;
+}
+
+// Owen scrambling of the bits of x, highest first, from the hash-based permutation of Laine
+// and Karras as improved by Burley
+inline uint32_t owenScramble(uint32_t x, uint32_t seed) {
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits(x);
+}
+
+// Second dimension of the Sobol sequence, the first being reverseBits
+inline uint32_t sobolSecondDimension(uint32_t index) {
+	uint32_t x = 0;
+	for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+		if (index & 1) x ^= v;
+	return x;
+}
+
+// Void and cluster (Ulichney, "The void-and-cluster method for dither array generation",
+// 1993): the cells are ranked so that those of every rank threshold are evenly spread, as
+// measured by a Gaussian energy on the torus. Returns the ranks as values in (0, 1).
+std::vector<float> generateBlueNoise(uint32_t size) {
+	const size_t n = (size_t)size * size;
+	const uint32_t mask = size - 1;
+	const float sigma = 1.5f;
+	std::vector<float> kernel(n);
+	for (uint32_t y = 0; y < size; y++) {
+		for (uint32_t x = 0; x < size; x++) {
+			const float dx = (float)std::min(x, size - x);
+			const float dy = (float)std::min(y, size - y);
+			kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+		}
+	}
+
+	std::vector<uint8_t> pattern(n, 0);
+	std::vector<float> energy(n, 0.0f);
+	auto toggle = [&](size_t cell) {
+		pattern[cell] ^= 1;
+		const float sign = pattern[cell] ? 1.0f : -1.0f;
+		const uint32_t cx = (uint32_t)(cell % size), cy = (uint32_t)(cell / size);
+		for (uint32_t y = 0; y < size; y++) {
+			const float* row = &kernel[((y - cy) & mask) * size];
+			float* energyRow = &energy[y * size];
+			for (uint32_t x = 0; x < size; x++) energyRow[x] += sign * row[(x - cx) & mask];
+		}
+	};
+	// Set cell of highest energy, and empty cell of lowest energy
+	auto tightestCluster = [&]() {
+		size_t best = 0;
+		float bestEnergy = -1.0f;
+		for (size_t i = 0; i < n; i++)
+			if (pattern[i] && energy[i] > bestEnergy) { bestEnergy = energy[i]; best = i; }
+		return best;
+	};
+	auto largestVoid = [&]() {
+		size_t best = 0;
+		float bestEnergy = std::numeric_limits<float>::max();
+		for (size_t i = 0; i < n; i++)
+			if (!pattern[i] && energy[i] < bestEnergy) { bestEnergy = energy[i]; best = i; }
+		return best;
+	};
+
+	// 1. Initial pattern: a tenth of the cells at random, spread by moving the tightest
+	// cluster to the largest void until it moves back where it was
+	const size_t numOfInitialCells = n / 10;
+	PCG32 pcg;
+	for (size_t count = 0; count < numOfInitialCells;) {
+		const size_t cell = pcg.next() % n;
+		if (pattern[cell]) continue;
+		toggle(cell);
+		count++;
+	}
+	for (size_t iteration = 0; iteration < n; iteration++) {
+		const size_t cluster = tightestCluster();
+		toggle(cluster);
+		const size_t emptiest = largestVoid();
+		toggle(emptiest);
+		if (emptiest == cluster) break;
+	}
+
+	// 2. Ranks of the initial cells, removed from the tightest cluster down, then of the
+	// others, added to the largest void up
+	std::vector<uint32_t> rank(n);
+	const std::vector<uint8_t> initialPattern = pattern;
+	const std::vector<float> initialEnergy = energy;
+	for (size_t r = numOfInitialCells; r-- > 0;) {
+		const size_t cluster = tightestCluster();
+		toggle(cluster);
+		rank[cluster] = (uint32_t)r;
+	}
+	pattern = initialPattern;
+	energy = initialEnergy;
+	for (size_t r = numOfInitialCells; r < n; r++) {
+		const size_t emptiest = largestVoid();
+		toggle(emptiest);
+		rank[emptiest] = (uint32_t)r;
+	}
+
+	std::vector<float> values(n);
+	for (size_t i = 0; i < n; i++) values[i] = (rank[i] + 0.5f) / (float)n;
+	return values;
+}
+
+const std::vector<float>& blueNoiseTile() {
+	static const std::vector<float> tile = generateBlueNoise(BlueNoiseSampler::tileSize); // Generated once, on first use
+	return tile;
+}
+
+}
+
+
+std::unique_ptr<Sampler> makeSampler (SamplerType type, uint32_t seed) {
+	switch (type) {
+		case SamplerType::Sobol:     return std::unique_ptr<Sampler> (new SobolSampler (seed));
+		case SamplerType::BlueNoise: return std::unique_ptr<Sampler> (new BlueNoiseSampler (seed));
+		default:                     return std::unique_ptr<Sampler> (new PCGSampler (seed));
+	}
+}
+
+
+void PCG32::setSequence (uint64_t sequenceIndex, uint64_t seed) {
+	m_state = 0;
+	m_inc = (sequenceIndex << 1) | 1;
+	next ();
+	m_state += seed;
+	next ();
+}
+
+void PCG32::advance (uint64_t delta) {
+	// Brown, "Random Number Generation with Arbitrary Strides", 1994: the affine step of the
+	// generator composed with itself delta times, in O(log delta)
+	uint64_t currentMultiplier = multiplier, currentIncrement = m_inc;
+	uint64_t accumulatedMultiplier = 1, accumulatedIncrement = 0;
+	while (delta > 0) {
+		if (delta & 1) {
+			accumulatedMultiplier *= currentMultiplier;
+			accumulatedIncrement = accumulatedIncrement * currentMultiplier + currentIncrement;
+		}
+		currentIncrement = (currentMultiplier + 1) * currentIncrement;
+		currentMultiplier *= currentMultiplier;
+		delta >>= 1;
+	}
+	m_state = accumulatedMultiplier * m_state + accumulatedIncrement;
+}
+
+
+void PCGSampler::start () {
+	m_pcg.setSequence (hashOf (m_x, m_y, seed, 0), mixBits (seed));
+	m_pcg.advance ((uint64_t)m_sampleIndex * dimensionsPerSample + m_dimension);
+}
+
+float PCGSampler::get1D () {
+	m_dimension++;
+	return toFloat (m_pcg.next ());
+}
+
+glm::vec2 PCGSampler::get2D () {
+	m_dimension += 2;
+	const float x = toFloat (m_pcg.next ());
+	return glm::vec2 (x, toFloat (m_pcg.next ()));
+}
+
+
+float SobolSampler::get1D () {
+	const uint64_t hash = hashOf (m_x, m_y, m_dimension, seed);
+	m_dimension++;
+	const uint32_t index = owenScramble (m_sampleIndex, (uint32_t)hash);
+	return toFloat (owenScramble (reverseBits (index), (uint32_t)(hash >> 32)));
+}
+
+glm::vec2 SobolSampler::get2D () {
+	const uint64_t hash = hashOf (m_x, m_y, m_dimension, seed);
+	m_dimension += 2;
+	// The shuffled index keeps the first 2^k samples a permutation of the first 2^k points
+	const uint32_t index = owenScramble (m_sampleIndex, (uint32_t)hash);
+	const uint32_t x = owenScramble (reverseBits (index), (uint32_t)(hash >> 32));
+	const uint32_t y = owenScramble (sobolSecondDimension (index), (uint32_t)mixBits (hash));
+	return glm::vec2 (toFloat (x), toFloat (y));
+}
+
+
+float BlueNoiseSampler::value (uint32_t dimension, uint32_t increment) const {
+	const uint64_t hash = hashOf (dimension, seed, 0, 0);
+	const uint32_t mask = tileSize - 1;
+	const uint32_t offsetX = (uint32_t)hash & mask;
+	const uint32_t offsetY = (uint32_t)(hash >> 32) & mask;
+	const float v = blueNoiseTile ()[((m_y + offsetY) & mask) * tileSize + ((m_x + offsetX) & mask)];
+	// Rotation by the sample index times the increment, modulo 1, in fixed point so that it
+	// stays exact for any index
+	const float rotation = toFloat (m_sampleIndex * increment);
+	const float rotated = v + rotation;
+	return std::min (rotated >= 1.0f ? rotated - 1.0f : rotated, 0x1.fffffep-1f);
+}
+
+float BlueNoiseSampler::get1D () {
+	return value (m_dimension++, 0x9e3779b9u); // Golden ratio
+}
+
+glm::vec2 BlueNoiseSampler::get2D () {
+	// The R2 sequence (Roberts, 2018), its increments are the inverse powers of the plastic
+	// number: the pairs of the successive samples of a pixel are well spread in 2D
+	const float x = value (m_dimension, 0xc13fa9a9u);
+	const float y = value (m_dimension + 1, 0x91e10da5u);
+	m_dimension += 2;
+	return glm::vec2 (x, y);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include <glm/glm.hpp>
+
+
+enum class SamplerType {
+	PCG,      // Independent numbers, jittered in a grid for the anti-aliasing samples
+	Sobol,    // Sobol points with Owen scrambling, a fresh scrambled pair every 2 dimensions
+	BlueNoise // A blue-noise tile shifted per dimension, animated along the samples of a pixel
+};
+
+inline const char* samplerName(SamplerType type) {
+	switch (type) {
+		case SamplerType::Sobol:     return "Sobol";
+		case SamplerType::BlueNoise: return "blue noise";
+		default:                     return "PCG";
+	}
+}
+
+/// Source of the random numbers of a pixel sample: the jitter of its position, then those of
+/// its shading, consumed in order as dimensions. The numbers only depend on the pixel, the
+/// index of the sample, the dimension and the seed, never on the samples drawn before, so a
+/// render does not depend on the order the pixels are traced in or on the thread count, and
+/// progressive renders continue the sequence of each pixel where the previous one stopped.
+/// A sampler holds the state of one pixel sample at a time, one is needed per thread.
+class Sampler {
+public:
+	inline Sampler (uint32_t seed_) : seed (seed_) {}
+	virtual ~Sampler () {}
+
+	/// Starts the sample 'sampleIndex' of the pixel (x, y), at 'dimension'
+	inline void startPixelSample (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t dimension = 0) {
+		m_x = x;
+		m_y = y;
+		m_sampleIndex = sampleIndex;
+		m_dimension = dimension;
+		start ();
+	}
+	/// Uniform number in [0, 1) of the next dimension
+	virtual float get1D () = 0;
+	/// Uniform point in [0, 1)^2 of the next two dimensions
+	virtual glm::vec2 get2D () = 0;
+
+	const uint32_t seed;
+
+protected:
+	virtual void start () {}
+
+	uint32_t m_x = 0;
+	uint32_t m_y = 0;
+	uint32_t m_sampleIndex = 0;
+	uint32_t m_dimension = 0;
+};
+
+std::unique_ptr<Sampler> makeSampler (SamplerType type, uint32_t seed = 0);
+
+
+/// Minimal PCG32 generator (O'Neill, "PCG: A Family of Simple Fast Space-Efficient
+/// Statistically Good Algorithms for Random Number Generation", 2014), with jump ahead.
+class PCG32 {
+public:
+	inline PCG32 () { setSequence (0, 0x853c49e6748fea9bull); }
+	void setSequence (uint64_t sequenceIndex, uint64_t seed);
+	void advance (uint64_t delta);
+	inline uint32_t next () {
+		const uint64_t old = m_state;
+		m_state = old * multiplier + m_inc;
+		const uint32_t xorShifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+		const uint32_t rot = (uint32_t)(old >> 59);
+		return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+	}
+
+private:
+	static constexpr uint64_t multiplier = 0x5851f42d4c957f2dull;
+	uint64_t m_state;
+	uint64_t m_inc;
+};
+
+/// Independent numbers: a PCG32 stream per pixel, jumped ahead to the sample and dimension
+class PCGSampler : public Sampler {
+public:
+	inline PCGSampler (uint32_t seed_) : Sampler (seed_) {}
+	float get1D () override;
+	glm::vec2 get2D () override;
+
+	// Dimensions a pixel sample may use before overlapping the next sample
+	static constexpr uint64_t dimensionsPerSample = 65536;
+
+protected:
+	void start () override;
+
+private:
+	PCG32 m_pcg;
+};
+
+/// Sobol points with hash-based Owen scrambling (Burley, "Practical Hash-based Owen
+/// Scrambling", JCGT 2020). Every pair of dimensions takes the first two Sobol dimensions,
+/// with their own scrambling and shuffling of the sample index, hashed from the pixel and the
+/// dimension: any number of samples stays stratified per pair, and the pairs are independent.
+class SobolSampler : public Sampler {
+public:
+	inline SobolSampler (uint32_t seed_) : Sampler (seed_) {}
+	float get1D () override;
+	glm::vec2 get2D () override;
+};
+
+/// Blue-noise tile (void and cluster, Ulichney 1993) toroidally shifted by a hash of the
+/// dimension, its values rotated from a sample to the next along a low-discrepancy sequence.
+/// Neighbouring pixels get distant values, so that the error at one or a few samples is high
+/// frequency noise, which the eye and the denoisers barely see.
+class BlueNoiseSampler : public Sampler {
+public:
+	inline BlueNoiseSampler (uint32_t seed_) : Sampler (seed_) {}
+	float get1D () override;
+	glm::vec2 get2D () override;
+
+	static constexpr uint32_t tileSize = 64; // Side of the tile, a power of two
+
+private:
+	// Value of the tile for the dimension, rotated by 'increment' / 2^32 per sample
+	float value (uint32_t dimension, uint32_t increment) const;
+};
@@ -11,6 +11,7 @@
 #include <vector>
 #include <memory>
 #include <unordered_map>
+#include <utility>
 
 #include "Camera.h"
 #include "Mesh.h"
@@ -40,25 +41,36 @@ public:
 	// Mesh
 	inline void add (std::shared_ptr<Mesh> mesh) { m_meshes.push_back (mesh); }
 	inline size_t numOfMeshes () const { return m_meshes.size (); }
-	inline const std::shared_ptr<Mesh> mesh (size_t index) const { return m_meshes[index]; }
+	inline const std::shared_ptr<Mesh> & mesh (size_t index) const { return m_meshes[index]; }
 	inline std::shared_ptr<Mesh> mesh (size_t index) { return m_meshes[index]; }
 
+	// Instance: a mesh placed once more with another transform, sharing its geometry and material
+	inline void addInstance (size_t meshIndex, const Transform & transform) { m_instances.push_back (std::make_pair (meshIndex, transform)); }
+	inline size_t numOfInstances () const { return m_instances.size (); }
+	inline size_t instanceMesh (size_t index) const { return m_instances[index].first; }
+	inline const Transform & instanceTransform (size_t index) const { return m_instances[index].second; }
+
+	// Object: every mesh with its own transform, followed by every instance
+	inline size_t numOfObjects () const { return m_meshes.size () + m_instances.size (); }
+	inline size_t objectMesh (size_t index) const { return index < m_meshes.size () ? index : m_instances[index - m_meshes.size ()].first; }
+	inline glm::mat4 objectTransformMatrix (size_t index) const { return index < m_meshes.size () ? m_meshes[index]->computeTransformMatrix () : m_instances[index - m_meshes.size ()].second.computeTransformMatrix (); }
+
 	// Material
 	inline void addMaterial (std::shared_ptr<Material> material) { m_materials.push_back (material); }
 	inline size_t numOfMaterials () const { return m_materials.size (); }
-	inline const std::shared_ptr<Material> material (size_t index) const { return m_materials[index]; }
+	inline const std::shared_ptr<Material> & material (size_t index) const { return m_materials[index]; }
 	inline std::shared_ptr<Material> material (size_t index) { return m_materials[index]; }
 	inline void setMaterialToMesh(size_t indexMesh, size_t indexMaterial) { this->m_mesh2material[indexMesh] = indexMaterial; }
-	inline size_t getMaterialOfMesh(size_t indexMesh) { if (m_mesh2material.find(indexMesh) == m_mesh2material.end()) { return 0; } else { return m_mesh2material[indexMesh]; }}
+	inline size_t getMaterialOfMesh(size_t indexMesh) const { auto found = m_mesh2material.find(indexMesh); return found == m_mesh2material.end() ? 0 : found->second; }
 
 	// Lightsource
 	inline void addLightSource (std::shared_ptr<LightSourceDir>   lightSource) { m_lightSourcesDir.push_back (lightSource); }
 	inline void addLightSource (std::shared_ptr<LightSourcePoint> lightSource) { m_lightSourcesPoint.push_back (lightSource); }
 	inline size_t numOfLightSourcesDir   () const { return m_lightSourcesDir.size (); }
 	inline size_t numOflightSourcesPoint () const { return m_lightSourcesPoint.size (); }
-	inline const std::shared_ptr<LightSourceDir> lightSourceDir (size_t index) const { return m_lightSourcesDir[index]; }
+	inline const std::shared_ptr<LightSourceDir> & lightSourceDir (size_t index) const { return m_lightSourcesDir[index]; }
 	inline std::shared_ptr<LightSourceDir> lightSourceDir (size_t index) { return m_lightSourcesDir[index]; }
-	inline const std::shared_ptr<LightSourcePoint> lightSourcePoint (size_t index) const { return m_lightSourcesPoint[index]; }
+	inline const std::shared_ptr<LightSourcePoint> & lightSourcePoint (size_t index) const { return m_lightSourcesPoint[index]; }
 	inline std::shared_ptr<LightSourcePoint> lightSourcePoint (size_t index) { return m_lightSourcesPoint[index]; }
 
 	// Extent
@@ -68,6 +80,7 @@ public:
 	inline void clear () {
 		m_camera.reset ();
 		m_meshes.clear ();
+		m_instances.clear ();
 	}
 
 private:
@@ -76,6 +89,7 @@ private:
 
 	// Objects
 	std::vector<std::shared_ptr<Mesh> > m_meshes;
+	std::vector<std::pair<size_t, Transform> > m_instances;
 	std::vector<std::shared_ptr<Material> > m_materials;
 	std::unordered_map<size_t, size_t> m_mesh2material;
 	float extent = 1.0f;
@@ -0,0 +1,90 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#include "SceneLoader.h"
+
+#include <iostream>
+
+#include "MeshLoader.h"
+
+namespace SceneLoader {
+
+std::shared_ptr<Scene> loadDefault (const std::string & meshFilename, float aspectRatio, glm::vec3 & center, float & meshScale) {
+	auto scenePtr = std::make_shared<Scene> ();
+	scenePtr->setBackgroundColor (glm::vec3 (0.1f, 0.5f, 0.95f));
+
+	// Mesh
+	auto meshPtr = std::make_shared<Mesh> ();
+	MeshLoader::loadOFF (meshFilename, meshPtr);
+	meshPtr->computeBoundingSphere (center, meshScale);
+	meshPtr->computePlanarParameterization();
+	BoundingBox bbox = meshPtr->computeBoundingBox ();
+	float extent = 2 * bbox.size ();
+	if (meshFilename.find("sphere") != std::string::npos)
+		meshPtr->setTranslation(glm::vec3(0, -0.2f * extent, 0));
+    auto meshMaterialPtr = std::make_shared<Material> (glm::vec3 (0.05, 0.05, 0.05), 0.3, 0.2);
+    scenePtr->add (meshPtr);
+    scenePtr->addMaterial (meshMaterialPtr);
+	scenePtr->setMaterialToMesh (0, 0);
+	std::cout << meshFilename << std::endl;
+
+	
+	// Adding a ground adapted to the loaded model
+	std::shared_ptr<Mesh> groundMeshPtr = std::make_shared<Mesh> ();
+	std::cout << "EXTENT: " << extent << std::endl;
+	glm::vec3 startP = bbox.center () + glm::vec3 (-extent, -bbox.height()/2.f, -extent);
+	groundMeshPtr->vertexPositions().push_back (startP); 
+	groundMeshPtr->vertexPositions().push_back (startP + glm::vec3 (0.f, 0.f, 2.f*extent));
+	groundMeshPtr->vertexPositions().push_back (startP + glm::vec3 (2.f*extent, 0.f, 2.f*extent));
+	groundMeshPtr->vertexPositions().push_back (startP + glm::vec3 (2.f*extent, 0.f, 0.f));
+	groundMeshPtr->triangleIndices().push_back (glm::uvec3 (0, 1, 2));
+	groundMeshPtr->triangleIndices().push_back (glm::uvec3 (0, 2, 3));
+	groundMeshPtr->recomputePerVertexNormals ();
+    auto groundMaterialPtr = std::make_shared<Material> (glm::vec3 (0.6, 0.6, 0.6f), 0.1f, 0.9);
+    scenePtr->add (groundMeshPtr);
+    scenePtr->addMaterial (groundMaterialPtr);
+	scenePtr->setMaterialToMesh (1, 1);
+
+
+	// Adding a wall adapted to the loaded model
+	std::shared_ptr<Mesh> wallMeshPtr = std::make_shared<Mesh> ();
+	startP = bbox.center () + glm::vec3 (-extent, -bbox.height()/2.f, -extent);
+	wallMeshPtr->vertexPositions().push_back (startP); 
+	wallMeshPtr->vertexPositions().push_back (startP + glm::vec3 (2.f*extent, 0.f, 0.f));
+	wallMeshPtr->vertexPositions().push_back (startP + glm::vec3 (2.f*extent, 2.f*extent, 0.f));
+	wallMeshPtr->vertexPositions().push_back (startP + glm::vec3 (0.f, 2.f*extent, 0.f));
+	wallMeshPtr->triangleIndices().push_back (glm::uvec3 (0, 1, 2));
+	wallMeshPtr->triangleIndices().push_back (glm::uvec3 (0, 2, 3));
+	wallMeshPtr->recomputePerVertexNormals ();
+    auto wallMaterialPtr = std::make_shared<Material> (glm::vec3 (0.9, 0.5, 0.3f), 0.1f, 0.5f);
+    scenePtr->add (wallMeshPtr);
+    scenePtr->addMaterial (wallMaterialPtr);
+	scenePtr->setMaterialToMesh (2, 2);
+
+	// Light Sources
+	//auto lightPtr = std::make_shared<LightSourceDir> ();
+	//scenePtr->addLightSource(lightPtr);
+	//auto lightPtr2 = std::make_shared<LightSourcePoint> ();
+	//scenePtr->addLightSource(lightPtr2);
+	float factor = 4;
+	float distance = 1;
+	scenePtr->addLightSource (std::make_shared<LightSourceDir> (distance * normalize (glm::vec3(0.f, -1.f, -1.f)), glm::vec3(1.f, 1.f, 1.f), factor*0.4f));
+	scenePtr->addLightSource (std::make_shared<LightSourceDir> (distance * normalize (glm::vec3(-2.f, -0.5f, 0.f)), glm::vec3(0.2f, 0.6f, 1.f), factor*0.25f));
+	scenePtr->addLightSource (std::make_shared<LightSourceDir> (distance * normalize (glm::vec3(2.f, -0.5f, 0.f)), glm::vec3(1.0f, 0.25f, 0.1f), factor*0.25f));
+
+	// Camera
+	auto cameraPtr = std::make_shared<Camera> ();
+	cameraPtr->setAspectRatio (aspectRatio);
+	cameraPtr->setTranslation (center + glm::vec3 (0.0, 0.0, 3.0 * meshScale));
+	cameraPtr->setNear (0.1f);
+	cameraPtr->setFar (100.f * meshScale);
+	scenePtr->set (cameraPtr);
+	return scenePtr;
+}
+
+}
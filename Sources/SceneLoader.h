@@ -0,0 +1,26 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <string>
+#include <memory>
+
+#include <glm/glm.hpp>
+
+#include "Scene.h"
+
+namespace SceneLoader {
+
+/// Builds the scene of the renderers around an OFF mesh: the mesh on a ground, in front of a
+/// wall, under three directional lights, with the camera looking at it from the front.
+/// 'center' and 'meshScale' return the bounding sphere of the mesh, the scale of the
+/// navigation. Throws when the mesh cannot be loaded.
+std::shared_ptr<Scene> loadDefault (const std::string & meshFilename, float aspectRatio, glm::vec3 & center, float & meshScale);
+
+}
@@ -11,6 +11,7 @@
 
 class Triangle {
 public:
+	Triangle() {};
 	Triangle(glm::vec3 p0_, glm::vec3 p1_, glm::vec3 p2_) : p0(p0_), p1(p1_), p2(p2_) {};
 
 	glm::vec3 p0;
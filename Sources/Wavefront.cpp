@@ -0,0 +1,282 @@
+#include "RayTracer.h"
+
+#include <cmath>
+
+// Wavefront rendering: every stage of the frame runs over a whole batch of rays before the
+// next one starts, so that each stage keeps its own data in the caches. The stages are split
+// in chunks shared out between the render threads, each with its own RenderScratch.
+
+
+namespace {
+
+// Rays of a chunk of the parallel stages, but the traversal which takes a packet at a time
+constexpr size_t raysPerChunk = 4096;
+
+// Length of the keys of rayKey
+constexpr size_t rayKeyBits = 49;
+
+// Sort key of a ray: the octant of its direction, then the Morton code of its origin in the
+// scene bounds, then its direction within the octant. Camera rays share their origin and are
+// sorted by direction, the shadow rays of a light share their direction and are sorted by
+// origin.
+inline uint64_t rayKey(const Ray& ray, const AABBox& sceneBox, const glm::vec3& scale) {
+	const glm::vec3& d = ray.direction;
+	const uint64_t octant = (d.x < 0.0f ? 4 : 0) | (d.y < 0.0f ? 2 : 0) | (d.z < 0.0f ? 1 : 0);
+	const glm::vec3 q = glm::clamp((ray.origin - sceneBox.cornerDown) * scale, glm::vec3(0.0f), glm::vec3(1023.0f));
+	const uint64_t origin = (expandBits10((uint64_t)q.x) << 2) | (expandBits10((uint64_t)q.y) << 1) | expandBits10((uint64_t)q.z);
+	const float sum = std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+	const uint64_t u = sum > 0.0f ? (uint64_t)(255.0f * std::abs(d.x) / sum) : 0;
+	const uint64_t v = sum > 0.0f ? (uint64_t)(255.0f * std::abs(d.y) / sum) : 0;
+	return (octant << 46) | (origin << 16) | (u << 8) | v;
+}
+
+}
+
+
+void RayTracer::computeRayKeys (RayQueue& queue) const {
+	const AABBox sceneBox = useInstancing ? tlas.nodes[0].box : bvh.bounds();
+	const glm::vec3 extent = sceneBox.cornerUp - sceneBox.cornerDown;
+	glm::vec3 scale;
+	for (int a = 0; a < 3; a++) scale[a] = extent[a] > 0.0f ? 1023.0f / extent[a] : 0.0f;
+	const size_t numChunks = numOfChunks(queue.size(), raysPerChunk);
+	parallelForChunks(numChunks, [&](size_t chunk) {
+		const size_t end = chunkBegin(0, queue.size(), numChunks, chunk + 1);
+		for (size_t i = chunkBegin(0, queue.size(), numChunks, chunk); i < end; i++) queue.keys[i] = rayKey(queue.rays[i], sceneBox, scale);
+	});
+}
+
+void RayTracer::traceQueue (RayQueue& queue, bool occlusion, float tmax) {
+	// Consecutive sorted rays are close to each other, and make coherent packets: the queue
+	// is traced a packet at a time, each worker with its own
+	const size_t numOfPackets = (queue.size() + RayPacket::maxSize - 1) / RayPacket::maxSize;
+	parallelForStealing(numOfPackets, [&](size_t worker, size_t packetIndex) {
+		const size_t first = packetIndex * RayPacket::maxSize;
+		const size_t last = std::min(first + RayPacket::maxSize, queue.size());
+		if (usePackets) {
+			RayPacket& packet = m_renderScratch[worker]->packet;
+			packet.clear();
+			for (size_t i = first; i < last; i++) packet.add(queue.rays[i], occlusion ? tmax : std::numeric_limits<float>::max());
+			if (occlusion) traceShadowRays(packet);
+			else traceRays(packet);
+			for (size_t i = first; i < last; i++) {
+				const size_t j = i - first;
+				queue.hit[i] = packet.hit(j);
+				if (occlusion || !packet.hit(j)) continue;
+				queue.t[i] = packet.t[j];
+				queue.b0[i] = packet.b0[j];
+				queue.b1[i] = packet.b1[j];
+				queue.b2[i] = packet.b2[j];
+				queue.objectIndex[i] = packet.objectIndex[j];
+				queue.triangleIndex[i] = packet.triangleIndex[j];
+			}
+			return;
+		}
+
+		for (size_t i = first; i < last; i++) {
+			if (occlusion) {
+				queue.hit[i] = traceShadowRay(queue.rays[i], tmax);
+				continue;
+			}
+			RayHit rayHit = RayHit(0, 0, 0, std::numeric_limits<float>::max());
+			size_t object_index = 0;
+			size_t triangle_index = 0;
+			queue.hit[i] = traceRay(rayHit, queue.rays[i], object_index, triangle_index);
+			if (!queue.hit[i]) continue;
+			queue.t[i] = rayHit.t;
+			queue.b0[i] = rayHit.b0;
+			queue.b1[i] = rayHit.b1;
+			queue.b2[i] = rayHit.b2;
+			queue.objectIndex[i] = (uint32_t)object_index;
+			queue.triangleIndex[i] = (uint32_t)triangle_index;
+		}
+	});
+}
+
+void RayTracer::renderWavefront (const Scene& scene, const RenderContext& context) {
+	const size_t width = m_imagePtr->width();
+	const size_t height = m_imagePtr->height();
+	const size_t samplesPerPixel = numOfPixelSamples();
+	const size_t numOfSamples = width * height * samplesPerPixel;
+	const size_t numOfLightSourcesDir = m_compiledScene.numOfLightSourcesDir();
+	const glm::vec3 backgroundColor = m_compiledScene.backgroundColor();
+	Camera& camera = *scene.camera();
+	glm::vec3 viewRight = context.viewRight, viewUp = context.viewUp, viewDir = context.viewDir, eye = context.eye;
+	float w = context.w;
+	for (const std::unique_ptr<RenderScratch>& scratch : m_renderScratch) scratch->lightOcclusion.resize(numOfLightSourcesDir);
+
+	std::vector<glm::vec3> colors(width * height, glm::vec3(0.0f, 0.0f, 0.0f)); // Sum of the samples of each pixel, row by row
+	std::vector<AOVSample> aovs(useAOVs() ? width * height : 0); // Sum of their AOVs
+	std::vector<uint32_t> hits;
+	std::vector<uint64_t> hitKeys;
+	std::vector<uint8_t> occluded; // Whether hits[h] is occluded from light l, at h * numOfLightSourcesDir + l
+	std::vector<PointLightPick> pointLightPicks; // Those of hits[h], at h * pointLightSamples
+	std::vector<uint32_t> pickedRays; // Picks with a shadow ray
+	std::vector<glm::vec3> hitColors; // Shading of hits[h]
+	std::vector<AOVSample> hitAOVs; // AOVs of hits[h]
+	for (size_t first = 0; first < numOfSamples; first += wavefrontBatchSize) {
+		const size_t count = std::min(wavefrontBatchSize, numOfSamples - first);
+
+		// 1. Camera rays of the samples of the batch, sorted
+		m_cameraRays.resize(count);
+		const size_t numChunks = numOfChunks(count, raysPerChunk);
+		parallelForStealing(numChunks, [&](size_t worker, size_t chunk) {
+			Sampler& sampler = *m_renderScratch[worker]->sampler;
+			const size_t end = chunkBegin(0, count, numChunks, chunk + 1);
+			for (size_t i = chunkBegin(0, count, numChunks, chunk); i < end; i++) {
+				const size_t pixel = (first + i) / samplesPerPixel;
+				const size_t sample = (first + i) % samplesPerPixel;
+				const size_t x = pixel % width;
+				const size_t y = pixel / width;
+				float shiftedX, shiftedY;
+				samplePosition(x, y, sample, sampler, shiftedX, shiftedY);
+				const float posX = shiftedX / (float)(width  - 1);
+				const float posY = 1 - (shiftedY / (float)(height - 1));
+				m_cameraRays.rays[i] = camera.rayAt(posX, posY, viewRight, viewUp, viewDir, eye, w);
+				m_cameraRays.source[i] = (uint32_t)i;
+			}
+		});
+		computeRayKeys(m_cameraRays);
+		m_cameraRays.sortByKey(rayKeyBits);
+
+		// 2. Traversal
+		traceQueue(m_cameraRays, false);
+
+		// 3. Compaction: the misses get the background, the hits are sorted by material
+		hits.clear();
+		hitKeys.clear();
+		for (size_t i = 0; i < count; i++) {
+			if (!m_cameraRays.hit[i]) {
+				colors[(first + m_cameraRays.source[i]) / samplesPerPixel] += backgroundColor;
+				if (useAOVs()) aovs[(first + m_cameraRays.source[i]) / samplesPerPixel] += backgroundAOVs();
+				continue;
+			}
+			const size_t object_index = m_cameraRays.objectIndex[i];
+			const uint64_t material = m_compiledScene.objectMaterialIndex(object_index);
+			hitKeys.push_back((material << 32) | object_index);
+			hits.push_back((uint32_t)i);
+		}
+		radixSort(hitKeys, hits, 64);
+		const size_t numHitChunks = numOfChunks(hits.size(), raysPerChunk);
+
+		// 4. Shadow rays of the hits, traced a light at a time. The rays of every light start
+		// from the hits and share their direction, so they are sorted once by origin.
+		occluded.assign(hits.size() * numOfLightSourcesDir, 0);
+		if (useOcclusion && numOfLightSourcesDir > 0) {
+			m_shadowRays.resize(hits.size());
+			parallelForChunks(numHitChunks, [&](size_t chunk) {
+				const size_t end = chunkBegin(0, hits.size(), numHitChunks, chunk + 1);
+				for (size_t h = chunkBegin(0, hits.size(), numHitChunks, chunk); h < end; h++) {
+					const size_t i = hits[h];
+					Ray& rayOcclusion = m_shadowRays.rays[h];
+					rayOcclusion.origin = worldHitPosition(m_cameraRays.rayHit(i), m_cameraRays.objectIndex[i], m_cameraRays.triangleIndex[i]);
+					rayOcclusion.setDirection(- m_compiledScene.lightSourceDir(0).direction);
+					m_shadowRays.source[h] = (uint32_t)h;
+				}
+			});
+			computeRayKeys(m_shadowRays);
+			m_shadowRays.sortByKey(rayKeyBits);
+			for (size_t l = 0; l < numOfLightSourcesDir; l++) {
+				const glm::vec3 lightDirection = m_compiledScene.lightSourceDir(l).direction;
+				parallelForChunks(numHitChunks, [&](size_t chunk) {
+					const size_t end = chunkBegin(0, m_shadowRays.size(), numHitChunks, chunk + 1);
+					for (size_t j = chunkBegin(0, m_shadowRays.size(), numHitChunks, chunk); j < end; j++) m_shadowRays.rays[j].setDirection(- lightDirection);
+				});
+				traceQueue(m_shadowRays, true);
+				parallelForChunks(numHitChunks, [&](size_t chunk) {
+					const size_t end = chunkBegin(0, m_shadowRays.size(), numHitChunks, chunk + 1);
+					for (size_t j = chunkBegin(0, m_shadowRays.size(), numHitChunks, chunk); j < end; j++)
+						occluded[m_shadowRays.source[j] * numOfLightSourcesDir + l] = m_shadowRays.hit[j];
+				});
+			}
+		}
+
+		// 5. Point lights picked from the light BVH for the hits, as shade would pick them. Their
+		// shadow rays go every way, and are sorted and traced as a queue of their own.
+		const size_t numOfPicks = (!m_lightBVH.empty() && pointLightSamples > 0) ? hits.size() * (size_t)pointLightSamples : 0;
+		pointLightPicks.assign(numOfPicks, PointLightPick());
+		if (numOfPicks > 0) {
+			parallelForStealing(numHitChunks, [&](size_t worker, size_t chunk) {
+				Sampler& sampler = *m_renderScratch[worker]->sampler;
+				const size_t end = chunkBegin(0, hits.size(), numHitChunks, chunk + 1);
+				for (size_t h = chunkBegin(0, hits.size(), numHitChunks, chunk); h < end; h++) {
+					const size_t i = hits[h];
+					const size_t pixel = (first + m_cameraRays.source[i]) / samplesPerPixel;
+					const size_t sample = (first + m_cameraRays.source[i]) % samplesPerPixel;
+					sampler.startPixelSample((uint32_t)(pixel % width), (uint32_t)(pixel / width), (uint32_t)(m_firstSampleIndex + sample), pixelDimensions);
+					const glm::vec3 position = m_compiledScene.hitPosition(m_cameraRays.rayHit(i), m_cameraRays.objectIndex[i], m_cameraRays.triangleIndex[i]);
+					const glm::vec3 normal = glm::normalize(m_compiledScene.hitNormal(m_cameraRays.rayHit(i), m_cameraRays.objectIndex[i], m_cameraRays.triangleIndex[i]));
+					for (size_t p = 0; p < (size_t)pointLightSamples; p++) {
+						size_t light_index;
+						float pmf;
+						if (!m_lightBVH.sample(position, normal, sampler.get1D(), light_index, pmf)) break;
+						PointLightPick& pick = pointLightPicks[h * pointLightSamples + p];
+						pick.light_index = (uint32_t)light_index;
+						pick.pmf = pmf;
+					}
+				}
+			});
+		}
+		if (numOfPicks > 0 && useOcclusion) {
+			pickedRays.clear();
+			for (size_t p = 0; p < numOfPicks; p++)
+				if (pointLightPicks[p].light_index != PointLightPick::none) pickedRays.push_back((uint32_t)p);
+			m_pointShadowRays.resize(pickedRays.size());
+			const size_t numRayChunks = numOfChunks(pickedRays.size(), raysPerChunk);
+			parallelForChunks(numRayChunks, [&](size_t chunk) {
+				const size_t end = chunkBegin(0, pickedRays.size(), numRayChunks, chunk + 1);
+				for (size_t j = chunkBegin(0, pickedRays.size(), numRayChunks, chunk); j < end; j++) {
+					const size_t p = pickedRays[j];
+					const size_t i = hits[p / pointLightSamples];
+					// The direction reaches the light at t = 1
+					Ray& rayOcclusion = m_pointShadowRays.rays[j];
+					rayOcclusion.origin = worldHitPosition(m_cameraRays.rayHit(i), m_cameraRays.objectIndex[i], m_cameraRays.triangleIndex[i]);
+					rayOcclusion.setDirection(m_compiledScene.lightSourcePoint(pointLightPicks[p].light_index).position - rayOcclusion.origin);
+					m_pointShadowRays.source[j] = (uint32_t)p;
+				}
+			});
+			computeRayKeys(m_pointShadowRays);
+			m_pointShadowRays.sortByKey(rayKeyBits);
+			traceQueue(m_pointShadowRays, true, 1.0f);
+			parallelForChunks(numRayChunks, [&](size_t chunk) {
+				const size_t end = chunkBegin(0, m_pointShadowRays.size(), numRayChunks, chunk + 1);
+				for (size_t j = chunkBegin(0, m_pointShadowRays.size(), numRayChunks, chunk); j < end; j++)
+					pointLightPicks[m_pointShadowRays.source[j]].occluded = m_pointShadowRays.hit[j];
+			});
+		}
+
+		// 6. Shading, material by material. Each hit gets its own result, summed into its pixel
+		// afterwards in the order of the hits, so that the image does not depend on the threads.
+		hitColors.resize(hits.size());
+		if (useAOVs()) hitAOVs.resize(hits.size());
+		parallelForStealing(numHitChunks, [&](size_t worker, size_t chunk) {
+			RenderScratch& scratch = *m_renderScratch[worker];
+			const size_t end = chunkBegin(0, hits.size(), numHitChunks, chunk + 1);
+			for (size_t h = chunkBegin(0, hits.size(), numHitChunks, chunk); h < end; h++) {
+				const size_t i = hits[h];
+				for (size_t l = 0; l < numOfLightSourcesDir; l++) scratch.lightOcclusion[l] = occluded[h * numOfLightSourcesDir + l] != 0;
+				// The sampler goes back to the pixel sample of the ray, after its position
+				const size_t pixel = (first + m_cameraRays.source[i]) / samplesPerPixel;
+				const size_t sample = (first + m_cameraRays.source[i]) % samplesPerPixel;
+				scratch.sampler->startPixelSample((uint32_t)(pixel % width), (uint32_t)(pixel / width), (uint32_t)(m_firstSampleIndex + sample), pixelDimensions);
+				hitColors[h] = shade(m_cameraRays.rayHit(i), m_cameraRays.objectIndex[i], m_cameraRays.triangleIndex[i], *scratch.sampler, &scratch.lightOcclusion, numOfPicks > 0 ? &pointLightPicks[h * pointLightSamples] : nullptr);
+				if (useAOVs()) hitAOVs[h] = surfaceAOVs(m_cameraRays.rayHit(i), m_cameraRays.objectIndex[i], m_cameraRays.triangleIndex[i]);
+			}
+		});
+		for (size_t h = 0; h < hits.size(); h++) {
+			const size_t pixel = (first + m_cameraRays.source[hits[h]]) / samplesPerPixel;
+			colors[pixel] += hitColors[h];
+			if (useAOVs()) aovs[pixel] += hitAOVs[h];
+		}
+	}
+
+	const size_t numChunks = numOfChunks(height, 4);
+	parallelForChunks(numChunks, [&](size_t chunk) {
+		const size_t end = chunkBegin(0, height, numChunks, chunk + 1);
+		for (size_t y = chunkBegin(0, height, numChunks, chunk); y < end; y++) {
+			for (size_t x = 0; x < width; x++) {
+				storePixel(x, y, colors[y * width + x], samplesPerPixel);
+				if (useAOVs()) storeAOVs(x, y, aovs[y * width + x], samplesPerPixel);
+			}
+		}
+	});
+}